@@ -17,8 +17,13 @@ LOCAL_SRC_FILES := \
     ../../../../FetchTrackRecords.c \
     ../../../../Glide2x.c \
     ../../../../Kernel32.c \
+    ../../../../PathIndex.c \
+    ../../../../Prefetch.c \
+    ../../../../Scheduler.c \
+    ../../../../Stats.c \
     ../../../../Timer.c \
     ../../../../User32.c \
+    ../../../../virtual_controls.c \
     ../../../../WinMM.c \
     ../../../../Wrapper.c \
     ../../../../Wsock32.c
@@ -54,6 +54,25 @@ static const char *g_joyPaths[2];
 static SDL_threadID g_mainThread;
 static uint8_t g_buttonsPressedCount[2][32];
 
+/*
+ * Joystick state is updated from joystick events on the event thread and read
+ * by "GetDeviceState()" without locking. "seq" is odd while the state is being
+ * written, readers retry if it changed during the copy.
+ */
+#define JOY_SNAPSHOT_AXES 16
+typedef struct
+{
+	SDL_atomic_t seq;
+	SDL_JoystickID instanceId; // -1 if no joystick is open at this index
+	int32_t numButtons, numAxes, numHats; // Cached when the joystick is opened
+	uint32_t buttons;
+	int16_t axes[JOY_SNAPSHOT_AXES];
+	uint8_t hat;
+} JoystickSnapshot;
+static JoystickSnapshot g_joySnapshots[2] = {{{0}, -1}, {{0}, -1}};
+static SDL_SpinLock g_joySnapshotsLock; // Serializes writers only
+static SDL_atomic_t g_joyDevicesGeneration; // Incremented when a joystick is added or removed
+
 extern SDL_Window *sdlWin;
 extern int32_t winWidth, winHeight;
 extern float dpr;
@@ -182,6 +201,125 @@ static void maybeInitEffect(DirectInputDevice *dev, DirectInputEffect *eff)
 	}
 }
 
+/* Must be called with "g_joySnapshotsLock" locked */
+static void beginSnapshotWrite(JoystickSnapshot *snapshot)
+{
+	SDL_AtomicIncRef(&snapshot->seq);
+	SDL_MemoryBarrierRelease();
+}
+static void endSnapshotWrite(JoystickSnapshot *snapshot)
+{
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicIncRef(&snapshot->seq);
+}
+
+static void readSnapshot(int32_t joyIdx, JoystickSnapshot *out)
+{
+	JoystickSnapshot *snapshot = &g_joySnapshots[joyIdx];
+	int seq;
+	do
+	{
+		while ((seq = SDL_AtomicGet(&snapshot->seq)) & 1);
+		SDL_MemoryBarrierAcquire();
+		memcpy(out, snapshot, sizeof(JoystickSnapshot));
+		SDL_MemoryBarrierAcquire();
+	} while (SDL_AtomicGet(&snapshot->seq) != seq);
+}
+
+static void openSnapshot(int32_t joyIdx, SDL_Joystick *joy)
+{
+	JoystickSnapshot *snapshot = &g_joySnapshots[joyIdx];
+	int32_t i;
+	SDL_AtomicLock(&g_joySnapshotsLock);
+	beginSnapshotWrite(snapshot);
+	snapshot->instanceId = SDL_JoystickInstanceID(joy);
+	snapshot->numButtons = SDL_min(SDL_JoystickNumButtons(joy), 32);
+	snapshot->numAxes = SDL_min(SDL_JoystickNumAxes(joy), 6);
+	snapshot->numHats = SDL_JoystickNumHats(joy);
+	snapshot->buttons = 0;
+	for (i = 0; i < snapshot->numButtons; ++i)
+		snapshot->buttons |= (uint32_t)!!SDL_JoystickGetButton(joy, i) << i;
+	for (i = 0; i < JOY_SNAPSHOT_AXES; ++i)
+		snapshot->axes[i] = SDL_JoystickGetAxis(joy, i);
+	snapshot->hat = snapshot->numHats > 0 ? SDL_JoystickGetHat(joy, 0) : SDL_HAT_CENTERED;
+	endSnapshotWrite(snapshot);
+	SDL_AtomicUnlock(&g_joySnapshotsLock);
+}
+static void closeSnapshot(int32_t joyIdx)
+{
+	JoystickSnapshot *snapshot = &g_joySnapshots[joyIdx];
+	SDL_AtomicLock(&g_joySnapshotsLock);
+	beginSnapshotWrite(snapshot);
+	snapshot->instanceId = -1;
+	snapshot->numButtons = snapshot->numAxes = snapshot->numHats = 0;
+	endSnapshotWrite(snapshot);
+	SDL_AtomicUnlock(&g_joySnapshotsLock);
+}
+
+static JoystickSnapshot *findSnapshot(SDL_JoystickID instanceId)
+{
+	int32_t i;
+	for (i = 0; i < 2; ++i)
+	{
+		if (g_joySnapshots[i].instanceId == instanceId)
+			return &g_joySnapshots[i];
+	}
+	return NULL;
+}
+
+static inline uint8_t getSnapshotButton(const JoystickSnapshot *snapshot, int32_t button)
+{
+	return (snapshot->buttons >> button) & 1;
+}
+static inline int16_t getSnapshotAxis(const JoystickSnapshot *snapshot, int32_t axis)
+{
+	return axis < JOY_SNAPSHOT_AXES ? snapshot->axes[axis] : 0;
+}
+
+static int SDLCALL joystickEventWatch(void *userdata, SDL_Event *event)
+{
+	JoystickSnapshot *snapshot;
+	switch (event->type)
+	{
+		case SDL_JOYAXISMOTION:
+		case SDL_JOYBUTTONDOWN:
+		case SDL_JOYBUTTONUP:
+		case SDL_JOYHATMOTION:
+			SDL_AtomicLock(&g_joySnapshotsLock);
+			/* "which" is at the same offset in all joystick events */
+			if ((snapshot = findSnapshot(event->jaxis.which)))
+			{
+				beginSnapshotWrite(snapshot);
+				if (event->type == SDL_JOYAXISMOTION)
+				{
+					if (event->jaxis.axis < JOY_SNAPSHOT_AXES)
+						snapshot->axes[event->jaxis.axis] = event->jaxis.value;
+				}
+				else if (event->type == SDL_JOYHATMOTION)
+				{
+					if (event->jhat.hat == 0)
+						snapshot->hat = event->jhat.value;
+				}
+				else if (event->jbutton.button < 32)
+				{
+					const uint32_t mask = 1u << event->jbutton.button;
+					if (event->jbutton.state)
+						snapshot->buttons |= mask;
+					else
+						snapshot->buttons &= ~mask;
+				}
+				endSnapshotWrite(snapshot);
+			}
+			SDL_AtomicUnlock(&g_joySnapshotsLock);
+			break;
+		case SDL_JOYDEVICEADDED:
+		case SDL_JOYDEVICEREMOVED:
+			SDL_AtomicIncRef(&g_joyDevicesGeneration);
+			break;
+	}
+	return 0;
+}
+
 static void ensureJoyOpen(DirectInputDevice *dev)
 {
 	int32_t joyIdx = dev->guid.b;
@@ -207,6 +345,7 @@ static void ensureJoyOpen(DirectInputDevice *dev)
 			dev->effects[i]->effect_idx = -1;
 		}
 
+		closeSnapshot(joyIdx);
 		SDL_JoystickClose(joy);
 		dev->joy = joy = NULL;
 
@@ -242,6 +381,7 @@ static void ensureJoyOpen(DirectInputDevice *dev)
 			dev->joy = joy = SDL_JoystickOpen(i);
 			if (dev->joy)
 			{
+				openSnapshot(joyIdx, dev->joy);
 				g_joyPaths[joyIdx] = path;
 				printf("Joystick \"%s\" opened at system index: %d at index: %d at: %s\n", SDL_JoystickName(joy), i, joyIdx, path); fflush(stdout);
 			}
@@ -545,7 +685,10 @@ MAYBE_STATIC REALIGN STDCALL uint32_t Release(void **this)
 				SDL_HapticClose(dinputDev->haptic);
 
 			if (dinputDev->joy)
+			{
+				closeSnapshot(joyIdx);
 				SDL_JoystickClose(dinputDev->joy);
+			}
 
 			g_joyPaths[joyIdx] = NULL;
 		}
@@ -637,30 +780,34 @@ MAYBE_STATIC REALIGN STDCALL uint32_t GetDeviceState(DirectInputDevice **this, u
 	SDL_memset4(joyState->axes, 0x8000, 8);
 	memset(joyState->buttons, 0, sizeof joyState->buttons);
 
-	SDL_Joystick *joy = (*this)->joy;
-	if (!joy)
+	if (!(*this)->joy)
 		return 0;
 
 	int32_t joyIdx = (*this)->guid.b;
 
-	int32_t numButtons = SDL_min(SDL_JoystickNumButtons(joy), 32);
-	int32_t numAxes = SDL_min(SDL_JoystickNumAxes(joy), 6);
-	int32_t numHats = SDL_JoystickNumHats(joy);
+	JoystickSnapshot joy;
+	readSnapshot(joyIdx, &joy);
+	if (joy.instanceId < 0)
+		return 0;
+
+	int32_t numButtons = joy.numButtons;
+	int32_t numAxes = joy.numAxes;
+	int32_t numHats = joy.numHats;
 
 	int32_t i;
 
 	if (joystickEscButton[joyIdx] >= 0 && joystickEscButton[joyIdx] < numButtons)
 	{
-		simulateKey(SDLK_ESCAPE, SDL_SCANCODE_ESCAPE, SDL_JoystickGetButton(joy, joystickEscButton[joyIdx]), &(*this)->escPressed);
+		simulateKey(SDLK_ESCAPE, SDL_SCANCODE_ESCAPE, getSnapshotButton(&joy, joystickEscButton[joyIdx]), &(*this)->escPressed);
 	}
 	if (joystickResetButton[joyIdx] >= 0 && joystickResetButton[joyIdx] < numButtons)
 	{
-		simulateKey(SDLK_F11 + joyIdx, SDL_SCANCODE_F11 + joyIdx, SDL_JoystickGetButton(joy, joystickResetButton[joyIdx]), &(*this)->resetPressed);
+		simulateKey(SDLK_F11 + joyIdx, SDL_SCANCODE_F11 + joyIdx, getSnapshotButton(&joy, joystickResetButton[joyIdx]), &(*this)->resetPressed);
 	}
 	if (numHats > 0)
 	{
 		uint8_t pressed[4] = {0};
-		switch (SDL_JoystickGetHat(joy, 0))
+		switch (joy.hat)
 		{
 			case SDL_HAT_CENTERED:
 				break;
@@ -693,7 +840,7 @@ MAYBE_STATIC REALIGN STDCALL uint32_t GetDeviceState(DirectInputDevice **this, u
 	{
 		if (joystickDPadButtons[joyIdx][i] >= 0 && joystickDPadButtons[joyIdx][i] < numButtons)
 		{
-			simulateKey(SDLK_RIGHT + i, SDL_SCANCODE_RIGHT + i, SDL_JoystickGetButton(joy, joystickDPadButtons[joyIdx][i]), &(*this)->dpadPressed[i]);
+			simulateKey(SDLK_RIGHT + i, SDL_SCANCODE_RIGHT + i, getSnapshotButton(&joy, joystickDPadButtons[joyIdx][i]), &(*this)->dpadPressed[i]);
 		}
 	}
 
@@ -716,7 +863,7 @@ MAYBE_STATIC REALIGN STDCALL uint32_t GetDeviceState(DirectInputDevice **this, u
 		if (!ignore) //Skip joystick button assigned as keyboard keys
 		{
 			const uint8_t maxPressedCount = 50;
-			uint8_t pressed = SDL_JoystickGetButton(joy, i);
+			uint8_t pressed = getSnapshotButton(&joy, i);
 			uint8_t *pressedCount = &g_buttonsPressedCount[joyIdx][i];
 			if (pressed)
 			{
@@ -743,7 +890,7 @@ MAYBE_STATIC REALIGN STDCALL uint32_t GetDeviceState(DirectInputDevice **this, u
 				continue;
 
 			int32_t *axis = &joyState->axes[i < 3 ? i : i + 2];
-			*axis = (uint16_t)SDL_JoystickGetAxis(joy, joystickAxes[joyIdx][i]) ^ 0x8000;
+			*axis = (uint16_t)getSnapshotAxis(&joy, joystickAxes[joyIdx][i]) ^ 0x8000;
 			if (joystickAxes[joyIdx][i + 6] > 0)
 				*axis = (*axis >> 1) + 32768;
 			else if (joystickAxes[joyIdx][i + 6] < 0)
@@ -892,11 +1039,13 @@ MAYBE_STATIC REALIGN STDCALL uint32_t SendForceFeedbackCommand(DirectInputDevice
 }
 MAYBE_STATIC REALIGN STDCALL uint32_t Poll(DirectInputDevice **this)
 {
-	/* Joystick only */
-
-	SDL_JoystickUpdate();
-
-	ensureJoyOpen(*this);
+	/* Joystick only, the state is updated by joystick events */
+	const int32_t generation = SDL_AtomicGet(&g_joyDevicesGeneration);
+	if (!(*this)->joy || (*this)->joyGeneration != generation)
+	{
+		(*this)->joyGeneration = generation;
+		ensureJoyOpen(*this);
+	}
 
 	return 0;
 }
@@ -987,6 +1136,14 @@ REALIGN STDCALL uint32_t DirectInputCreateA_wrap(MAYBE_THIS void *hInstance, uin
 	if (SDL_Init(SDL_INIT_JOYSTICK | SDL_INIT_HAPTIC) < 0)
 		fprintf(stderr, "SDL joystick and haptic init failed: %s\n", SDL_GetError());
 
+	static BOOL eventWatchAdded;
+	if (!eventWatchAdded)
+	{
+		SDL_JoystickEventState(SDL_ENABLE);
+		SDL_AddEventWatch(joystickEventWatch, NULL);
+		eventWatchAdded = true;
+	}
+
 	g_mainThread = SDL_ThreadID();
 
 	return 0;
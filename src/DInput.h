@@ -252,6 +252,7 @@ typedef struct DirectInputDevice
 	uint32_t lastX, lastY;
 	uint8_t escPressed, resetPressed, dpadPressed[4];
 	SDL_Joystick *joy;
+	int32_t joyGeneration; // Joystick devices generation seen by the last "Poll()"
 	BOOL rumble;
 	BOOL useCartesian;
 	uint8_t gain;
@@ -1,8 +1,10 @@
 // SPDX-License-Identifier: MIT
 
 #include "Wrapper.h"
+#include "Scheduler.h"
 
 extern BOOL linearSoundInterpolation;
+extern int32_t soundResampler;
 
 static void (REGPARM *getSamples)(void *samples, uint32_t num_samples_per_chn);
 
@@ -21,57 +23,278 @@ typedef void (*FadeInOut)(MAYBE_THIS_SINGLE);
 static FadeInOut fadeInOut;
 
 #include <SDL2/SDL_audio.h>
+#include <SDL2/SDL_atomic.h>
+#include <SDL2/SDL_thread.h>
+#include <SDL2/SDL_mutex.h>
+#include <SDL2/SDL_cpuinfo.h>
+#include <math.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+	#define RESAMPLER_SSE
+	#include <xmmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define RESAMPLER_NEON
+	#include <arm_neon.h>
+#endif
 
 #define CHN_CNT 2
+#define FRAME_SIZE (CHN_CNT * sizeof(int16_t))
+#define GAME_FRAMES 256 // Frames mixed by one "getSamples()" call
+#define GAME_FREQ 22050
+
+extern int32_t audioLatency;
 
 static SDL_AudioDeviceID audioDevice;
 static BOOL unPaused, canGetSamples;
-static uint32_t buffer_pos;
-static uint8_t *buffer;
+static uint8_t *buffer; // Used only without audio device
 
-static void audioCallback(void *userdata, uint8_t *stream, int32_t len)
+/*
+ * The game mixes into a single-producer/single-consumer ring on its own
+ * thread and the SDL callback only copies out of it, so slow mixing doesn't
+ * cause underruns. Positions are in frames, "ring_frames" is a power of two.
+ */
+static int16_t *ring;
+static uint32_t ring_frames, ring_target, ring_write;
+static SDL_atomic_t ring_write_pos, ring_read_pos, producer_running;
+static SDL_sem *producer_sem;
+static SDL_Thread *producer_thread;
+static BOOL callback_scheduled; // Callback runs on SDL audio thread
+
+/*
+ * Converts the game stream directly to the device rate, so SDL doesn't have
+ * to resample it again. Input is kept per channel as float with "MAX_TAPS"
+ * frames of history before the current block, output is delayed by about
+ * half of it. Sinc kernels use a polyphase table interpolated between phases.
+ */
+enum
 {
-	if (!buffer)
-	{
-		int32_t i;
-		for (i = 0; i < len; i += 256 * CHN_CNT * sizeof(int16_t))
-			getSamplesFunc(stream + i, 256);
-	}
-	else
+	ResamplerNone,
+	ResamplerLinear,
+	ResamplerCubic,
+	ResamplerSinc,
+	ResamplerSincHigh
+};
+
+#define MAX_TAPS 32
+#define SINC_PHASES 128
+
+static int32_t resampler;
+static uint32_t resampler_taps;
+static uint64_t resampler_pos, resampler_step; // 32.32 fixed point in input frames
+static float resampler_hist[CHN_CNT][MAX_TAPS + GAME_FRAMES];
+static float *sinc_table; // [SINC_PHASES + 1][resampler_taps]
+static int16_t *mix_block;
+static uint32_t mix_block_frames;
+
+static float resampleDotScalar(const float *a, const float *b, uint32_t count)
+{
+	float sum = 0.0f;
+	uint32_t i;
+	for (i = 0; i < count; ++i)
+		sum += a[i] * b[i];
+	return sum;
+}
+#ifdef RESAMPLER_SSE
+__attribute__((target("sse")))
+static float resampleDotSSE(const float *a, const float *b, uint32_t count)
+{
+	__m128 sum = _mm_setzero_ps();
+	uint32_t i;
+	for (i = 0; i < count; i += 4)
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum);
+}
+#endif
+#ifdef RESAMPLER_NEON
+static float resampleDotNEON(const float *a, const float *b, uint32_t count)
+{
+	float32x4_t sum = vdupq_n_f32(0.0f);
+	uint32_t i;
+	for (i = 0; i < count; i += 4)
+		sum = vmlaq_f32(sum, vld1q_f32(a + i), vld1q_f32(b + i));
+	float32x2_t half = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+	return vget_lane_f32(vpadd_f32(half, half), 0);
+}
+#endif
+static float (*resampleDot)(const float *a, const float *b, uint32_t count) = resampleDotScalar; // "count" is a multiple of 4
+
+static void initResampler(uint32_t freq)
+{
+	uint32_t p, k;
+
+	resampler_pos = 0;
+	resampler_step = ((uint64_t)GAME_FREQ << 32) / freq;
+	memset(resampler_hist, 0, sizeof resampler_hist);
+
+	resampler_taps = (resampler == ResamplerSincHigh) ? 32 : 16;
+	if (resampler < ResamplerSinc)
+		return;
+
+#if defined(RESAMPLER_SSE)
+	if (SDL_HasSSE())
+		resampleDot = resampleDotSSE;
+#elif defined(RESAMPLER_NEON)
+	if (SDL_HasNEON())
+		resampleDot = resampleDotNEON;
+#endif
+
+	// Blackman windowed sinc, cutoff is lowered when the device rate is lower than game rate
+	const double cutoff = SDL_min(1.0, (double)freq / GAME_FREQ) * 0.95;
+	const double halfTaps = resampler_taps / 2;
+	sinc_table = (float *)malloc((SINC_PHASES + 1) * resampler_taps * sizeof(float));
+	for (p = 0; p <= SINC_PHASES; ++p)
 	{
-		while (buffer_pos < len)
+		float *coeffs = sinc_table + p * resampler_taps;
+		double sum = 0.0;
+		for (k = 0; k < resampler_taps; ++k)
 		{
-			getSamplesFunc(buffer + buffer_pos, 256);
-			buffer_pos += 256 * CHN_CNT * sizeof(int16_t);
+			const double x = (double)k - (halfTaps - 1.0) - (double)p / SINC_PHASES;
+			const double w = 0.42 + 0.5 * cos(M_PI * x / halfTaps) + 0.08 * cos(2.0 * M_PI * x / halfTaps);
+			const double y = (x == 0.0) ? cutoff : sin(M_PI * x * cutoff) / (M_PI * x);
+			coeffs[k] = w * y;
+			sum += coeffs[k];
 		}
-		memcpy(stream, buffer, len);
-		memcpy(buffer, buffer + len, buffer_pos -= len);
+		for (k = 0; k < resampler_taps; ++k)
+			coeffs[k] /= sum;
 	}
 }
-static void audioCallbackInterp(void *userdata, uint8_t *stream, int32_t len)
+
+static inline int16_t clampSample(float value)
+{
+	return (int16_t)SDL_max(-32768.0f, SDL_min(value, 32767.0f));
+}
+
+static uint32_t mixBlock(int16_t *out)
 {
-	int16_t samples[256 * CHN_CNT];
-	int16_t *buffer_16b;
-	uint32_t i, c;
-	while (buffer_pos < len)
+	int16_t samples[GAME_FRAMES * CHN_CNT];
+	uint32_t frames = 0, i, c;
+
+	if (resampler == ResamplerNone)
 	{
-		buffer_16b = (int16_t *)(buffer + buffer_pos);
-		getSamplesFunc(samples, 256);
-		for (i = 0; i < (256 - 1) * CHN_CNT; i += CHN_CNT)
+		getSamplesFunc(out, GAME_FRAMES);
+		return GAME_FRAMES;
+	}
+
+	getSamplesFunc(samples, GAME_FRAMES);
+	for (c = 0; c < CHN_CNT; ++c)
+		for (i = 0; i < GAME_FRAMES; ++i)
+			resampler_hist[c][MAX_TAPS + i] = samples[i * CHN_CNT + c];
+
+	for (; (resampler_pos >> 32) < GAME_FRAMES; resampler_pos += resampler_step, ++frames)
+	{
+		const uint32_t center = (uint32_t)(resampler_pos >> 32) + MAX_TAPS / 2 - 1;
+		const uint32_t frac = (uint32_t)resampler_pos;
+		const float t = frac * (1.0f / 4294967296.0f);
+
+		for (c = 0; c < CHN_CNT; ++c)
 		{
-			for (c = 0; c < CHN_CNT; ++c)
+			const float *in = resampler_hist[c] + center;
+			float value;
+			switch (resampler)
 			{
-				buffer_16b[c] = samples[i + c];
-				buffer_16b[c + CHN_CNT] = (samples[i + c] + samples[i + c + CHN_CNT]) >> 1;
+				case ResamplerLinear:
+					value = in[0] + (in[1] - in[0]) * t;
+					break;
+				case ResamplerCubic:
+					// Catmull-Rom spline
+					value = in[0] + 0.5f * t * (in[1] - in[-1] + t * (2.0f * in[-1] - 5.0f * in[0] + 4.0f * in[1] - in[2] + t * (3.0f * (in[0] - in[1]) + in[2] - in[-1])));
+					break;
+				default:
+				{
+					const uint64_t phase = (uint64_t)frac * SINC_PHASES;
+					const float *coeffs = sinc_table + (phase >> 32) * resampler_taps;
+					const float phaseT = (uint32_t)phase * (1.0f / 4294967296.0f);
+					in -= resampler_taps / 2 - 1;
+					const float a = resampleDot(coeffs, in, resampler_taps);
+					const float b = resampleDot(coeffs + resampler_taps, in, resampler_taps);
+					value = a + (b - a) * phaseT;
+					break;
+				}
 			}
-			buffer_16b += CHN_CNT << 1;
+			out[frames * CHN_CNT + c] = clampSample(value);
 		}
-		for (c = 0; c < CHN_CNT; ++c)
-			buffer_16b[c] = buffer_16b[c + CHN_CNT] = samples[i + c];
-		buffer_pos += 512 * CHN_CNT * sizeof(int16_t);
 	}
-	memcpy(stream, buffer, len);
-	memcpy(buffer, buffer + len, buffer_pos -= len);
+	resampler_pos -= (uint64_t)GAME_FRAMES << 32;
+
+	for (c = 0; c < CHN_CNT; ++c)
+		memmove(resampler_hist[c], resampler_hist[c] + GAME_FRAMES, MAX_TAPS * sizeof(float));
+
+	return frames;
+}
+
+/* Mixes until at least "target" frames are queued, producer only */
+static void fillRing(uint32_t target)
+{
+	int16_t *block = mix_block;
+	while (ring_write - (uint32_t)SDL_AtomicGet(&ring_read_pos) < target)
+	{
+		const uint32_t frames = mixBlock(block);
+		const uint32_t offset = ring_write & (ring_frames - 1);
+		const uint32_t first = SDL_min(frames, ring_frames - offset);
+		memcpy(ring + offset * CHN_CNT, block, first * FRAME_SIZE);
+		memcpy(ring, block + first * CHN_CNT, (frames - first) * FRAME_SIZE);
+		ring_write += frames;
+		SDL_AtomicSet(&ring_write_pos, ring_write);
+	}
+}
+
+static int producerMain(void *userdata)
+{
+	SchedulerSetRole(SchedulerAudio);
+	while (SDL_AtomicGet(&producer_running))
+	{
+		fillRing(ring_target);
+		SDL_SemWait(producer_sem);
+	}
+	return 0;
+}
+
+static void audioCallback(void *userdata, uint8_t *stream, int32_t len)
+{
+	const uint32_t frames = len / FRAME_SIZE;
+
+	if (!callback_scheduled)
+	{
+		SchedulerSetAudioCallbackRole(SchedulerAudio);
+		callback_scheduled = true;
+	}
+
+	if (!producer_thread)
+		fillRing(frames); // Thread couldn't be created, mix here as before
+
+	const uint32_t read = SDL_AtomicGet(&ring_read_pos);
+	const uint32_t count = SDL_min(frames, (uint32_t)SDL_AtomicGet(&ring_write_pos) - read);
+	const uint32_t offset = read & (ring_frames - 1);
+	const uint32_t first = SDL_min(count, ring_frames - offset);
+
+	memcpy(stream, ring + offset * CHN_CNT, first * FRAME_SIZE);
+	memcpy(stream + first * FRAME_SIZE, ring, (count - first) * FRAME_SIZE);
+	if (count < frames)
+		memset(stream + count * FRAME_SIZE, 0, (frames - count) * FRAME_SIZE); // Underrun
+
+	SDL_AtomicSet(&ring_read_pos, read + count);
+	if (producer_thread && SDL_SemValue(producer_sem) == 0)
+		SDL_SemPost(producer_sem);
+}
+
+static void startProducer()
+{
+	SDL_AtomicSet(&producer_running, 1);
+	producer_thread = SDL_CreateThread(producerMain, "Audio", NULL);
+	if (!producer_thread)
+		fprintf(stderr, "Can't create audio thread: %s\n", SDL_GetError());
+}
+static void stopProducer()
+{
+	if (producer_thread)
+	{
+		SDL_AtomicSet(&producer_running, 0);
+		SDL_SemPost(producer_sem);
+		SDL_WaitThread(producer_thread, NULL);
+		producer_thread = NULL;
+	}
 }
 
 /**/
@@ -96,31 +319,54 @@ REALIGN REGPARM uint32_t iSNDdirectstart_(uint32_t arg1, void *hWnd)
 	if (canGetSamples)
 		return 0;
 
+	resampler = soundResampler;
+	if (resampler < 0)
+		resampler = linearSoundInterpolation ? ResamplerLinear : ResamplerNone;
+
+	uint32_t freq = (resampler == ResamplerNone) ? GAME_FREQ : 48000;
+	uint32_t latencyFrames = freq * SDL_max(audioLatency, 10) / 1000;
+	uint32_t samples = 256;
+	while (samples < 4096 && samples * 4 <= latencyFrames)
+		samples <<= 1; // About half of the latency is in device buffer
+
 	SDL_AudioSpec audioSpecIn =
 	{
-		linearSoundInterpolation ? 44100 : 22050,
+		freq,
 		AUDIO_S16,
 		CHN_CNT,
 		0,
-		1024,
+		samples,
 		0,
 		0,
-		linearSoundInterpolation ? audioCallbackInterp : audioCallback,
+		audioCallback,
 		NULL
 	};
 	SDL_AudioSpec audioSpecOut;
-	audioDevice = SDL_OpenAudioDevice(NULL, 0, &audioSpecIn, &audioSpecOut, 0);
+	callback_scheduled = false;
+	audioDevice = SDL_OpenAudioDevice(NULL, 0, &audioSpecIn, &audioSpecOut, (resampler == ResamplerNone) ? 0 : SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
 	if (!audioDevice)
-		buffer = (uint8_t *)malloc(256 * CHN_CNT * sizeof(int16_t));
+		buffer = (uint8_t *)malloc(GAME_FRAMES * FRAME_SIZE);
 	else
 	{
-		uint32_t bufferSize = (audioSpecOut.samples + 255) & ~255; //Aligned to 256
-		if (linearSoundInterpolation || bufferSize != audioSpecOut.samples)
+		if (resampler != ResamplerNone)
 		{
-			bufferSize += linearSoundInterpolation ? 512 : 256;
-			bufferSize *= CHN_CNT * sizeof(int16_t);
-			buffer = (uint8_t *)malloc(bufferSize);
+			freq = audioSpecOut.freq;
+			latencyFrames = freq * SDL_max(audioLatency, 10) / 1000;
+			initResampler(freq);
 		}
+		mix_block_frames = (uint32_t)(((uint64_t)GAME_FRAMES * freq + GAME_FREQ - 1) / GAME_FREQ) + 1;
+		mix_block = (int16_t *)malloc(mix_block_frames * FRAME_SIZE);
+
+		// Callback needs at least one device buffer queued
+		ring_target = SDL_max(latencyFrames > audioSpecOut.samples ? latencyFrames - audioSpecOut.samples : 0, audioSpecOut.samples);
+		ring_frames = GAME_FRAMES;
+		while (ring_frames < ring_target + 2 * mix_block_frames)
+			ring_frames <<= 1;
+		ring = (int16_t *)malloc(ring_frames * FRAME_SIZE);
+		ring_write = 0;
+		SDL_AtomicSet(&ring_write_pos, 0);
+		SDL_AtomicSet(&ring_read_pos, 0);
+		producer_sem = SDL_CreateSemaphore(0);
 	}
 	canGetSamples = true;
 	return 0;
@@ -131,6 +377,7 @@ REALIGN void iSNDdirectserve_(MAYBE_THIS_SINGLE)
 	{
 		if (!unPaused && audioDevice)
 		{
+			startProducer();
 			SDL_PauseAudioDevice(audioDevice, 0);
 			unPaused = true;
 		}
@@ -140,7 +387,7 @@ REALIGN void iSNDdirectserve_(MAYBE_THIS_SINGLE)
 		fadeInOut();
 #endif
 		if (!audioDevice)
-			getSamplesFunc(buffer, 256);
+			getSamplesFunc(buffer, GAME_FRAMES);
 	}
 }
 REALIGN uint32_t iSNDdirectstop_(void)
@@ -152,7 +399,18 @@ REALIGN uint32_t iSNDdirectstop_(void)
 		unPaused = false;
 		audioDevice = 0;
 	}
-	buffer_pos = 0;
+	stopProducer();
+	if (producer_sem)
+	{
+		SDL_DestroySemaphore(producer_sem);
+		producer_sem = NULL;
+	}
+	free(ring);
+	ring = NULL;
+	free(mix_block);
+	mix_block = NULL;
+	free(sinc_table);
+	sinc_table = NULL;
 	free(buffer);
 	buffer = NULL;
 	return 0;
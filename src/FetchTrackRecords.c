@@ -26,10 +26,8 @@ typedef struct
 
 REALIGN REGPARM FILE *fopen_wrap(const char *fileName, const char *p)
 {
-	char *tmpFileName = convertFilePath(fileName, true);
-	FILE *f = fopen(tmpFileName, p);
-	free(tmpFileName);
-	return f;
+	char tmpFileName[MAX_NATIVE_PATH];
+	return fopen(convertFilePath(fileName, tmpFileName, true), p);
 }
 
 static void readEntry(FILE *f, StfEntry *stfEntry)
@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef GLSTATE_H
+#define GLSTATE_H
+
+#include <stdint.h>
+
+/*
+ * Shadow copy of the GL context state, implemented by the Glide backend
+ * ("Glide2x/GLState.c"). Calls which don't change the state aren't sent to
+ * GL, so the tracked state must not be changed directly while the context
+ * is in use by the backend. Arguments are GL types (GLenum, GLuint, GLint).
+ */
+
+/* Context was created and made current, GL defaults apply again */
+void GLStateReset(void);
+
+/* Tracks GL_BLEND, GL_DEPTH_TEST, GL_SCISSOR_TEST (and GL_TEXTURE_2D, GL_FOG on OpenGL 1.x), other caps are passed through */
+void GLStateEnable(uint32_t cap, int enabled);
+void GLStateBlendFunc(uint32_t sfactor, uint32_t dfactor);
+void GLStateDepthMask(int mask);
+void GLStateViewport(int32_t x, int32_t y, int32_t w, int32_t h);
+void GLStateScissor(int32_t x, int32_t y, int32_t w, int32_t h);
+const int32_t *GLStateGetScissor(void);
+
+/* GL_TEXTURE_2D binding of texture unit 0 */
+void GLStateBindTexture(uint32_t texture);
+/* Call after "glDeleteTextures()", GL unbinds deleted textures */
+void GLStateTextureDeleted(uint32_t texture);
+
+#ifndef OPENGL1X
+void GLStateUseProgram(uint32_t program);
+void GLStateBindArrayBuffer(uint32_t buffer);
+void GLStateBindFramebuffer(uint32_t framebuffer);
+/* Bit per attribute location, arrays which aren't in the mask are disabled */
+void GLStateEnableAttribs(uint32_t mask);
+#endif
+
+#endif // GLSTATE_H
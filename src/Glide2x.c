@@ -5,6 +5,7 @@
 static inline void handleDpr();
 static inline BOOL clearUnusedArea(int32_t xOffset, int32_t yOffset, int32_t visibleWidth, int32_t visibleHeight);
 static inline void convertColor(GrColor_t color, uint8_t *alpha, float *r, float *g, float *b, float *a);
+static void statsFillRect(int32_t x, int32_t y, int32_t w, int32_t h, uint32_t color);
 
 #ifdef OPENGL1X
 	#include "Glide2x/OpenGL1.c"
@@ -29,20 +30,20 @@ static inline BOOL clearUnusedArea(int32_t xOffset, int32_t yOffset, int32_t vis
 		glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 		if (xOffset > 0)
 		{
-			glScissor(0, 0, xOffset, winHeight);
+			GLStateScissor(0, 0, xOffset, winHeight);
 			glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
 
-			glScissor(xOffset + visibleWidth, 0, winWidth - visibleWidth - xOffset, winHeight);
+			GLStateScissor(xOffset + visibleWidth, 0, winWidth - visibleWidth - xOffset, winHeight);
 			glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
 		}
 		if (yOffset > 0)
 		{
 			// Y starts from bottom
 
-			glScissor(0, 0, winWidth, winHeight - visibleHeight - yOffset);
+			GLStateScissor(0, 0, winWidth, winHeight - visibleHeight - yOffset);
 			glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
 
-			glScissor(0, yOffset + visibleHeight, winWidth, yOffset + 1);
+			GLStateScissor(0, yOffset + visibleHeight, winWidth, yOffset + 1);
 			glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
 		}
 		return true;
@@ -64,8 +65,26 @@ static inline void convertColor(GrColor_t color, uint8_t *alpha, float *r, float
 	}
 }
 
+static void statsFillRect(int32_t x, int32_t y, int32_t w, int32_t h, uint32_t color)
+{
+	uint8_t alpha = color >> 24;
+	float r, g, b, a;
+	convertColor(color, &alpha, &r, &g, &b, &a);
+	GLStateScissor(x, winHeight - y - h, w, h); // Y starts from bottom
+	glClearColor(r, g, b, a);
+	glClear(GL_COLOR_BUFFER_BIT);
+}
+
 REALIGN STDCALL void grFogTable(const GrFog_t ft[GR_FOG_TABLE_SIZE])
 {
+#ifndef OPENGL1X
+	if (renderThreadRecording())
+	{
+		recordCommandData(CmdFogTable, ft, GR_FOG_TABLE_SIZE * sizeof(GrFog_t));
+		return;
+	}
+#endif
+
 	/* Copied from OpenGLIDE */
 
 	static const uint32_t intStartEnd[GR_FOG_TABLE_SIZE + 1] =
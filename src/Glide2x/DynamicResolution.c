@@ -0,0 +1,271 @@
+// SPDX-License-Identifier: MIT
+
+/* Included by OpenGL2.c */
+
+/*
+ * Adaptive rendering scale of the game framebuffer. GPU time of every frame
+ * is the sum of timer queries around each submitted draw list and the
+ * display pass, so the GPU waiting for the game isn't counted. The queries
+ * are read a few frames later, so they never stall. When the average leaves
+ * the budget (display refresh period) for a while, the scale is changed
+ * within "DynamicResolution" bounds, assuming the cost is proportional to
+ * the pixel count. Without timer queries the highest scale is used.
+ */
+
+#ifndef GL_TIME_ELAPSED
+# define GL_TIME_ELAPSED 0x88BF
+#endif
+#ifndef GL_QUERY_RESULT
+# define GL_QUERY_RESULT 0x8866
+#endif
+#ifndef GL_QUERY_RESULT_AVAILABLE
+# define GL_QUERY_RESULT_AVAILABLE 0x8867
+#endif
+#ifndef GL_GPU_DISJOINT_EXT
+# define GL_GPU_DISJOINT_EXT 0x8FBB
+#endif
+
+#define DynResFrames     4     // Frames in flight before a result is expected
+#define DynResSpans      16    // Timed submissions per frame, time of the rest is extrapolated
+#define DynResStep       0.05f // Scales are multiples of the step
+#define DynResHigh       0.90f // Of the budget, scale down above
+#define DynResLow        0.70f // Of the budget, scale up below
+#define DynResTarget     0.80f // Of the budget, GPU time the new scale aims at
+#define DynResDownFrames 8
+#define DynResUpFrames   90
+#define DynResCooldown   30    // Frames ignored after a change, the framebuffer is recreated
+
+#ifdef GLES2
+static PFNGLGENQUERIESEXTPROC dynResGenQueries;
+static PFNGLDELETEQUERIESEXTPROC dynResDeleteQueries;
+static PFNGLBEGINQUERYEXTPROC dynResBeginQuery;
+static PFNGLENDQUERYEXTPROC dynResEndQuery;
+static PFNGLGETQUERYOBJECTUIVEXTPROC dynResGetQueryObjectuiv;
+static PFNGLGETQUERYOBJECTUI64VEXTPROC dynResGetQueryObjectui64v;
+#else
+static PFNGLGENQUERIESPROC dynResGenQueries;
+static PFNGLDELETEQUERIESPROC dynResDeleteQueries;
+static PFNGLBEGINQUERYPROC dynResBeginQuery;
+static PFNGLENDQUERYPROC dynResEndQuery;
+static PFNGLGETQUERYOBJECTUIVPROC dynResGetQueryObjectuiv;
+static PFNGLGETQUERYOBJECTUI64VPROC dynResGetQueryObjectui64v;
+#endif
+
+extern int32_t dynamicResolutionMin, dynamicResolutionMax;
+
+static GLuint g_dynResQueries[DynResFrames][DynResSpans];
+static uint32_t g_dynResSpans[DynResFrames], g_dynResSubmits[DynResFrames];
+static uint32_t g_dynResBegun, g_dynResRead; // Frames
+static BOOL g_dynResTimer, g_dynResFrameActive, g_dynResQueryActive, g_dynResChanged;
+static float g_dynResScale, g_dynResMin, g_dynResMax, g_dynResBudgetMs, g_dynResGpuMs;
+static uint32_t g_dynResOver, g_dynResUnder, g_dynResCooldown;
+static int32_t g_dynResMaxHeight;
+
+static inline BOOL dynResEnabled()
+{
+	return (dynamicResolutionMin > 0);
+}
+
+/* Call with current context, the scale is kept when the context is recreated */
+static void dynResInit()
+{
+	GLint maxTextureSize = 0;
+	SDL_DisplayMode mode;
+
+	g_dynResTimer = false;
+	g_dynResFrameActive = false;
+	g_dynResQueryActive = false;
+	g_dynResBegun = g_dynResRead = 0;
+
+	if (!dynResEnabled())
+	{
+		g_dynResScale = 1.0f;
+		return;
+	}
+
+	g_dynResMin = dynamicResolutionMin / 100.0f;
+	g_dynResMax = SDL_max(dynamicResolutionMax, dynamicResolutionMin) / 100.0f;
+	if (g_dynResScale < g_dynResMin || g_dynResScale > g_dynResMax)
+		g_dynResScale = g_dynResMax;
+
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	g_dynResMaxHeight = maxTextureSize * 3 / 4;
+
+	g_dynResBudgetMs = 1000.0f / 60.0f;
+	if (SDL_GetWindowDisplayMode(sdlWin, &mode) == 0 && mode.refresh_rate > 0)
+		g_dynResBudgetMs = 1000.0f / mode.refresh_rate;
+
+#ifdef GLES2
+	if (SDL_GL_ExtensionSupported("GL_EXT_disjoint_timer_query"))
+	{
+		dynResGenQueries = SDL_GL_GetProcAddress("glGenQueriesEXT");
+		dynResDeleteQueries = SDL_GL_GetProcAddress("glDeleteQueriesEXT");
+		dynResBeginQuery = SDL_GL_GetProcAddress("glBeginQueryEXT");
+		dynResEndQuery = SDL_GL_GetProcAddress("glEndQueryEXT");
+		dynResGetQueryObjectuiv = SDL_GL_GetProcAddress("glGetQueryObjectuivEXT");
+		dynResGetQueryObjectui64v = SDL_GL_GetProcAddress("glGetQueryObjectui64vEXT");
+	}
+#else
+	if (SDL_GL_ExtensionSupported("GL_ARB_timer_query") || SDL_GL_ExtensionSupported("GL_EXT_timer_query"))
+	{
+		dynResGenQueries = SDL_GL_GetProcAddress("glGenQueries");
+		dynResDeleteQueries = SDL_GL_GetProcAddress("glDeleteQueries");
+		dynResBeginQuery = SDL_GL_GetProcAddress("glBeginQuery");
+		dynResEndQuery = SDL_GL_GetProcAddress("glEndQuery");
+		dynResGetQueryObjectuiv = SDL_GL_GetProcAddress("glGetQueryObjectuiv");
+		dynResGetQueryObjectui64v = SDL_GL_GetProcAddress("glGetQueryObjectui64v");
+		if (!dynResGetQueryObjectui64v)
+			dynResGetQueryObjectui64v = SDL_GL_GetProcAddress("glGetQueryObjectui64vEXT");
+	}
+#endif
+	g_dynResTimer = (dynResGenQueries && dynResDeleteQueries && dynResBeginQuery && dynResEndQuery && dynResGetQueryObjectuiv && dynResGetQueryObjectui64v);
+
+	if (g_dynResTimer)
+		dynResGenQueries(DynResFrames * DynResSpans, &g_dynResQueries[0][0]);
+	else
+		fprintf(stderr, "GPU timer queries are not supported, dynamic resolution uses the highest scale\n");
+}
+static void dynResDestroy()
+{
+	if (!g_dynResTimer)
+		return;
+	if (g_dynResQueryActive)
+		dynResEndQuery(GL_TIME_ELAPSED);
+	dynResDeleteQueries(DynResFrames * DynResSpans, &g_dynResQueries[0][0]);
+	g_dynResTimer = false;
+	g_dynResFrameActive = false;
+	g_dynResQueryActive = false;
+}
+
+/* Framebuffer height for the shorter edge of the window */
+static int32_t dynResHeight(int32_t shorterEdge)
+{
+	if (!dynResEnabled())
+		return shorterEdge;
+	int32_t h = (int32_t)(shorterEdge * g_dynResScale + 0.5f) & ~1;
+	if (g_dynResMaxHeight > 0)
+		h = SDL_min(h, g_dynResMaxHeight);
+	return SDL_max(h, 2);
+}
+
+static void dynResUpdate(float gpuMs)
+{
+	g_dynResGpuMs = (g_dynResGpuMs > 0.0f) ? (g_dynResGpuMs * 0.9f + gpuMs * 0.1f) : gpuMs;
+
+	if (g_dynResCooldown > 0)
+	{
+		--g_dynResCooldown;
+		g_dynResGpuMs = 0.0f; // Measure the new size from scratch
+		return;
+	}
+
+	if (g_dynResGpuMs > g_dynResBudgetMs * DynResHigh)
+	{
+		g_dynResUnder = 0;
+		if (++g_dynResOver < DynResDownFrames || g_dynResScale <= g_dynResMin)
+			return;
+	}
+	else if (g_dynResGpuMs < g_dynResBudgetMs * DynResLow)
+	{
+		g_dynResOver = 0;
+		if (++g_dynResUnder < DynResUpFrames || g_dynResScale >= g_dynResMax)
+			return;
+	}
+	else
+	{
+		g_dynResOver = g_dynResUnder = 0;
+		return;
+	}
+
+	float scale = g_dynResScale * SDL_sqrtf(g_dynResBudgetMs * DynResTarget / g_dynResGpuMs);
+	scale = SDL_min(scale, g_dynResScale + 2.0f * DynResStep); // Slowly up, fast down
+	scale = SDL_floorf(scale / DynResStep + 0.5f) * DynResStep;
+	scale = SDL_max(SDL_min(scale, g_dynResMax), g_dynResMin);
+
+	g_dynResOver = g_dynResUnder = 0;
+	if (SDL_fabsf(scale - g_dynResScale) < DynResStep * 0.5f)
+		return;
+
+	g_dynResScale = scale;
+	g_dynResChanged = true;
+	g_dynResCooldown = DynResCooldown;
+}
+
+/* Call when the game starts drawing next frame */
+static void dynResFrameBegin()
+{
+	if (!g_dynResTimer || g_dynResFrameActive || g_dynResBegun - g_dynResRead >= DynResFrames)
+		return;
+	const uint32_t frame = g_dynResBegun % DynResFrames;
+	g_dynResSpans[frame] = g_dynResSubmits[frame] = 0;
+	g_dynResFrameActive = true;
+}
+
+/* Call around GPU work of the frame, spans can't be nested */
+static void dynResSpanBegin()
+{
+	if (!g_dynResFrameActive || g_dynResQueryActive)
+		return;
+	const uint32_t frame = g_dynResBegun % DynResFrames;
+	++g_dynResSubmits[frame];
+	if (g_dynResSpans[frame] < DynResSpans)
+	{
+		dynResBeginQuery(GL_TIME_ELAPSED, g_dynResQueries[frame][g_dynResSpans[frame]]);
+		g_dynResQueryActive = true;
+	}
+}
+static void dynResSpanEnd()
+{
+	if (!g_dynResQueryActive)
+		return;
+	dynResEndQuery(GL_TIME_ELAPSED);
+	++g_dynResSpans[g_dynResBegun % DynResFrames];
+	g_dynResQueryActive = false;
+}
+
+/* Call before swap, after the display pass, reads finished queries */
+static void dynResFrameEnd()
+{
+	if (!g_dynResTimer)
+		return;
+
+	dynResSpanEnd();
+	if (g_dynResFrameActive)
+	{
+		g_dynResFrameActive = false;
+		++g_dynResBegun;
+	}
+
+#ifdef GLES2
+	GLint disjoint = 0;
+	glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+	if (disjoint)
+	{
+		// Results in flight are undefined (e.g. frequency change)
+		g_dynResRead = g_dynResBegun;
+		return;
+	}
+#endif
+
+	while (g_dynResRead != g_dynResBegun)
+	{
+		const uint32_t frame = g_dynResRead % DynResFrames, spans = g_dynResSpans[frame];
+		GLuint available = 1;
+		GLuint64 ns = 0, sum = 0;
+		uint32_t i;
+
+		for (i = 0; i < spans && available; ++i)
+			dynResGetQueryObjectuiv(g_dynResQueries[frame][i], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			break;
+		for (i = 0; i < spans; ++i)
+		{
+			dynResGetQueryObjectui64v(g_dynResQueries[frame][i], GL_QUERY_RESULT, &ns);
+			sum += ns;
+		}
+		if (spans > 0)
+			sum = sum * g_dynResSubmits[frame] / spans;
+		++g_dynResRead;
+		dynResUpdate(sum / 1000000.0f);
+	}
+}
@@ -0,0 +1,167 @@
+// SPDX-License-Identifier: MIT
+
+/* Included by OpenGL1.c and OpenGL2.c */
+
+#include "../GLState.h"
+
+#define GLStateBlend       (1 << 0)
+#define GLStateDepthTest   (1 << 1)
+#define GLStateScissorTest (1 << 2)
+#define GLStateTexture2D   (1 << 3)
+#define GLStateFog         (1 << 4)
+
+static struct
+{
+	uint32_t enabled;
+	GLenum blendSFactor, blendDFactor;
+	GLboolean depthMask;
+	GLint viewport[4], scissor[4];
+	GLuint texture;
+#ifndef OPENGL1X
+	GLuint program, arrayBuffer, framebuffer;
+	uint32_t attribs;
+#endif
+} g_glState;
+
+void GLStateReset(void)
+{
+	memset(&g_glState, 0, sizeof g_glState);
+	g_glState.blendSFactor = GL_ONE;
+	g_glState.blendDFactor = GL_ZERO;
+	g_glState.depthMask = GL_TRUE;
+	// Initially the window size, call with the new context current
+	glGetIntegerv(GL_VIEWPORT, g_glState.viewport);
+	glGetIntegerv(GL_SCISSOR_BOX, g_glState.scissor);
+}
+
+void GLStateEnable(uint32_t cap, int enabled)
+{
+	uint32_t bit;
+	switch (cap)
+	{
+		case GL_BLEND:
+			bit = GLStateBlend;
+			break;
+		case GL_DEPTH_TEST:
+			bit = GLStateDepthTest;
+			break;
+		case GL_SCISSOR_TEST:
+			bit = GLStateScissorTest;
+			break;
+#ifdef OPENGL1X
+		case GL_TEXTURE_2D:
+			bit = GLStateTexture2D;
+			break;
+		case GL_FOG:
+			bit = GLStateFog;
+			break;
+#endif
+		default:
+			bit = 0;
+			break;
+	}
+
+	if (bit)
+	{
+		if (!(g_glState.enabled & bit) == !enabled)
+			return;
+		g_glState.enabled ^= bit;
+	}
+
+	if (enabled)
+		glEnable(cap);
+	else
+		glDisable(cap);
+}
+void GLStateBlendFunc(uint32_t sfactor, uint32_t dfactor)
+{
+	if (g_glState.blendSFactor == sfactor && g_glState.blendDFactor == dfactor)
+		return;
+	g_glState.blendSFactor = sfactor;
+	g_glState.blendDFactor = dfactor;
+	glBlendFunc(sfactor, dfactor);
+}
+void GLStateDepthMask(int mask)
+{
+	if (g_glState.depthMask == !!mask)
+		return;
+	g_glState.depthMask = !!mask;
+	glDepthMask(g_glState.depthMask);
+}
+
+static inline BOOL setRect(GLint rect[4], int32_t x, int32_t y, int32_t w, int32_t h)
+{
+	if (rect[0] == x && rect[1] == y && rect[2] == w && rect[3] == h)
+		return false;
+	rect[0] = x;
+	rect[1] = y;
+	rect[2] = w;
+	rect[3] = h;
+	return true;
+}
+void GLStateViewport(int32_t x, int32_t y, int32_t w, int32_t h)
+{
+	if (setRect(g_glState.viewport, x, y, w, h))
+		glViewport(x, y, w, h);
+}
+void GLStateScissor(int32_t x, int32_t y, int32_t w, int32_t h)
+{
+	if (setRect(g_glState.scissor, x, y, w, h))
+		glScissor(x, y, w, h);
+}
+const int32_t *GLStateGetScissor(void)
+{
+	return g_glState.scissor;
+}
+
+void GLStateBindTexture(uint32_t texture)
+{
+	if (g_glState.texture == texture)
+		return;
+	g_glState.texture = texture;
+	glBindTexture(GL_TEXTURE_2D, texture);
+}
+void GLStateTextureDeleted(uint32_t texture)
+{
+	if (g_glState.texture == texture)
+		g_glState.texture = 0;
+}
+
+#ifndef OPENGL1X
+void GLStateUseProgram(uint32_t program)
+{
+	if (g_glState.program == program)
+		return;
+	g_glState.program = program;
+	glUseProgram(program);
+}
+void GLStateBindArrayBuffer(uint32_t buffer)
+{
+	if (g_glState.arrayBuffer == buffer)
+		return;
+	g_glState.arrayBuffer = buffer;
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+}
+void GLStateBindFramebuffer(uint32_t framebuffer)
+{
+	if (g_glState.framebuffer == framebuffer)
+		return;
+	g_glState.framebuffer = framebuffer;
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+}
+void GLStateEnableAttribs(uint32_t mask)
+{
+	uint32_t changed = g_glState.attribs ^ mask;
+	GLuint i;
+	g_glState.attribs = mask;
+	for (i = 0; changed; ++i, changed >>= 1)
+	{
+		if (!(changed & 1))
+			continue;
+		if (mask & (1u << i))
+			glEnableVertexAttribArray(i);
+		else
+			glDisableVertexAttribArray(i);
+	}
+}
+#endif
@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: MIT
+
+/* Included by OpenGL1.c and OpenGL2.c after the Glide functions */
+
+#include "../GlideTrace.h"
+
+REALIGN STDCALL void grFogTable(const GrFog_t ft[GR_FOG_TABLE_SIZE]);
+REALIGN STDCALL BOOL grLfbLock(GrLock_t type, GrBuffer_t buffer, GrLfbWriteMode_t writeMode, GrOriginLocation_t origin, BOOL pixelPipeline, GrLfbInfo_t *info);
+REALIGN STDCALL BOOL grLfbUnlock(GrLock_t type, GrBuffer_t buffer);
+
+void GlideTraceExecute(const CommandHeader *header)
+{
+	const uint32_t *args = (const uint32_t *)(header + 1);
+	const GrVertex *vertices = (const GrVertex *)(header + 1);
+	const TexCommand *tex = (const TexCommand *)(header + 1);
+	const LfbCommand *lfb = (const LfbCommand *)(header + 1);
+	GrLfbInfo_t lfbInfo;
+	GrTexInfo info;
+	uint32_t y;
+
+	switch (header->cmd)
+	{
+		case CmdAlphaBlendFunction:
+			grAlphaBlendFunction(args[0], args[1], args[2], args[3]);
+			break;
+		case CmdAlphaCombine:
+			grAlphaCombine(args[0], args[1], args[2], args[3], args[4]);
+			break;
+		case CmdClipWindow:
+			grClipWindow(args[0], args[1], args[2], args[3]);
+			break;
+		case CmdBufferClear:
+			grBufferClear(args[0], args[1], args[2]);
+			break;
+		case CmdBufferSwap:
+			grBufferSwap(args[0]);
+			break;
+		case CmdDepthMask:
+			grDepthMask(args[0]);
+			break;
+		case CmdDrawTriangle:
+			grDrawTriangle(&vertices[0], &vertices[1], &vertices[2]);
+			break;
+		case CmdDrawLine:
+			grDrawLine(&vertices[0], &vertices[1]);
+			break;
+		case CmdFogColorValue:
+			grFogColorValue(args[0]);
+			break;
+		case CmdFogMode:
+			grFogMode(args[0]);
+			break;
+		case CmdFogTable:
+			grFogTable((const GrFog_t *)args);
+			break;
+		case CmdGammaCorrectionValue:
+			grGammaCorrectionValue(*(const float *)args);
+			break;
+		case CmdGlideShutdown:
+			grGlideShutdown();
+			break;
+		case CmdSstWinOpen:
+			grSstWinOpen(0, 0, 0, 0, 0, 0, 0);
+			break;
+		case CmdTexDownloadMipMap:
+			info = tex->info;
+			info.data = (void *)(tex + 1);
+			grTexDownloadMipMap(tex->tmu, tex->startAddress, tex->evenOdd, &info);
+			break;
+		case CmdTexDownloadTable:
+			grTexDownloadTable(tex->tmu, tex->startAddress, (void *)(tex + 1));
+			break;
+		case CmdTexSource:
+			info = tex->info;
+			grTexSource(tex->tmu, tex->startAddress, tex->evenOdd, &info);
+			break;
+		case CmdLfbUnlock:
+			// Replayed as a lock, the strides can differ
+			lfbInfo.size = sizeof lfbInfo;
+			if (grLfbLock(GR_LFB_WRITE_ONLY, lfb->buffer, lfb->writeMode, lfb->origin, false, &lfbInfo))
+			{
+				const uint32_t rowSize = SDL_min(lfb->strideInBytes, lfbInfo.strideInBytes);
+				for (y = 0; y < 480; ++y)
+					memcpy((uint8_t *)lfbInfo.lfbPtr + y * lfbInfo.strideInBytes, (const uint8_t *)(lfb + 1) + y * lfb->strideInBytes, rowSize);
+				grLfbUnlock(GR_LFB_WRITE_ONLY, lfb->buffer);
+			}
+			break;
+	}
+}
@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: MIT
+
+/* Included by OpenGL1.c and OpenGL2.c */
+
+/* Pixels written since "grLfbLock()", pixels with key color weren't written */
+#define LfbKey16 0x0821
+#define LfbKey32 0x00080408
+
+typedef struct
+{
+	uint32_t pixels[640 * 480];
+	GrLfbWriteMode_t writeMode;
+	GrOriginLocation_t origin;
+	BOOL locked;
+} LfbStaging;
+
+static inline uint32_t lfbBytesPerPixel(GrLfbWriteMode_t writeMode)
+{
+	return (writeMode == GR_LFBWRITEMODE_888 || writeMode == GR_LFBWRITEMODE_8888) ? 4 : 2;
+}
+
+/* Staging buffer is filled with key color, so pixels which aren't written keep the rendered image */
+static BOOL lfbLock(LfbStaging *lfb, GrLfbWriteMode_t writeMode, GrOriginLocation_t origin, GrLfbInfo_t *info)
+{
+	uint32_t i, key, bytesPerPixel;
+
+	switch (writeMode)
+	{
+		case GR_LFBWRITEMODE_ANY:
+			writeMode = GR_LFBWRITEMODE_565;
+			break;
+		case GR_LFBWRITEMODE_565:
+		case GR_LFBWRITEMODE_555:
+		case GR_LFBWRITEMODE_1555:
+		case GR_LFBWRITEMODE_888:
+		case GR_LFBWRITEMODE_8888:
+			break;
+		default:
+			return false; // Depth isn't emulated
+	}
+
+	bytesPerPixel = lfbBytesPerPixel(writeMode);
+	key = (bytesPerPixel == 4) ? LfbKey32 : LfbKey16 * 0x00010001u;
+	for (i = 0; i < 640 * 480 * bytesPerPixel / 4; ++i)
+		lfb->pixels[i] = key;
+
+	lfb->writeMode = writeMode;
+	lfb->origin = (origin == GR_ORIGIN_LOWER_LEFT) ? GR_ORIGIN_LOWER_LEFT : GR_ORIGIN_UPPER_LEFT;
+	lfb->locked = true;
+
+	info->lfbPtr = lfb->pixels;
+	info->strideInBytes = 640 * bytesPerPixel;
+	info->writeMode = lfb->writeMode;
+	info->origin = lfb->origin;
+	return true;
+}
+
+static inline uint32_t lfbExpand5(uint32_t value)
+{
+	return (value << 3) | (value >> 2);
+}
+
+/* Converts the row to RGBA, key color becomes transparent and is discarded by the shader. Returns false if nothing was written. */
+static BOOL lfbConvertRow(uint32_t *out, const LfbStaging *lfb, uint32_t y)
+{
+	BOOL written = false;
+	uint32_t x;
+
+	if (lfbBytesPerPixel(lfb->writeMode) == 4)
+	{
+		const uint32_t *in = lfb->pixels + y * 640;
+		for (x = 0; x < 640; ++x)
+		{
+			const uint32_t value = in[x];
+			if (value == LfbKey32)
+			{
+				out[x] = 0;
+				continue;
+			}
+			out[x] = 0xFF000000 | ((value >> 16) & 0x000000FF) | (value & 0x0000FF00) | ((value << 16) & 0x00FF0000);
+			written = true;
+		}
+	}
+	else
+	{
+		const BOOL rgb565 = (lfb->writeMode == GR_LFBWRITEMODE_565);
+		const uint16_t *in = (const uint16_t *)lfb->pixels + y * 640;
+		for (x = 0; x < 640; ++x)
+		{
+			const uint32_t value = in[x];
+			uint32_t r, g, b;
+			if (value == LfbKey16)
+			{
+				out[x] = 0;
+				continue;
+			}
+			if (rgb565)
+			{
+				r = lfbExpand5(value >> 11);
+				g = ((value >> 3) & 0xFC) | ((value >> 9) & 0x03);
+			}
+			else
+			{
+				r = lfbExpand5((value >> 10) & 0x1F);
+				g = lfbExpand5((value >> 5) & 0x1F);
+			}
+			b = lfbExpand5(value & 0x1F);
+			out[x] = 0xFF000000 | (b << 16) | (g << 8) | r;
+			written = true;
+		}
+	}
+
+	return written;
+}
@@ -7,6 +7,8 @@
 	#include "../virtual_controls.h"
 // #endif
 
+#include "../Stats.h"
+
 #include <SDL2/SDL_stdinc.h>
 #include <SDL2/SDL_opengl.h>
 #include <SDL2/SDL_video.h>
@@ -30,12 +32,13 @@ typedef struct
 } TextureInfo;
 static TextureInfo textures[TextureMem >> 2];
 
-static uint8_t *lfb, textureMem[TextureMem], g_fogTable[0x10000];
-static uint32_t *palette, tmpTexture[0x400];
+static uint8_t textureMem[TextureMem], g_fogTable[0x10000];
+static uint32_t *palette, paletteHash, tmpTexture[0x400];
 
 static PFNGLFOGCOORDFPROC p_glFogCoordf;
 
 static int32_t xOffset, yOffset, visibleWidth, visibleHeight;
+static uint32_t clipWindow[4] = {0, 0, 640, 480};
 static SDL_GLContext glCtx;
 
 extern BOOL keepAspectRatio, windowResized, linearFiltering;
@@ -51,6 +54,103 @@ static void setTextureFiltering()
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 }
 
+#include "GLState.c"
+#include "PaletteCache.c"
+#include "TexelConvert.c"
+#include "LfbStaging.c"
+
+/* Power of two size, in case non power of two textures aren't supported */
+#define LfbTextureWidth  1024
+#define LfbTextureHeight 512
+
+static LfbStaging lfb;
+static uint32_t lfbTexels[640 * 480];
+static GLuint lfbTexture;
+
+REALIGN STDCALL void grClipWindow(uint32_t minX, uint32_t minY, uint32_t maxX, uint32_t maxY);
+
+/* Draws the written rows over the frame, the key color is rejected by the alpha test */
+static void lfbComposite()
+{
+	int32_t first = -1, last = -1, y;
+
+	for (y = 0; y < 480; ++y)
+	{
+		if (lfbConvertRow(lfbTexels + y * 640, &lfb, y))
+		{
+			if (first < 0)
+				first = y;
+			last = y;
+		}
+	}
+	if (first < 0)
+		return;
+
+	StatsAdd(StatLfbWrites, 1);
+
+	const GLuint texture = g_glState.texture; // Restored after the quad, like the state below
+	if (lfbTexture == 0)
+	{
+		glGenTextures(1, &lfbTexture);
+		GLStateBindTexture(lfbTexture);
+		setTextureFiltering();
+		// Transparent padding, filtering at the edges reads it
+		void *zero = calloc(LfbTextureWidth * LfbTextureHeight, 4);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, LfbTextureWidth, LfbTextureHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, zero);
+		free(zero);
+	}
+	else
+	{
+		GLStateBindTexture(lfbTexture);
+	}
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, 640, last + 1 - first, GL_RGBA, GL_UNSIGNED_BYTE, lfbTexels + first * 640);
+
+	const float s1 = 640.0f / LfbTextureWidth;
+	float y0 = first, y1 = last + 1, t0 = (float)first / LfbTextureHeight, t1 = (float)(last + 1) / LfbTextureHeight;
+	if (lfb.origin == GR_ORIGIN_LOWER_LEFT)
+	{
+		const float t = t0;
+		y0 = 480 - (last + 1);
+		y1 = 480 - first;
+		t0 = t1;
+		t1 = t;
+	}
+
+	// Game state is restored after the quad
+	const uint32_t enabled = g_glState.enabled;
+	const GLenum blendSFactor = g_glState.blendSFactor, blendDFactor = g_glState.blendDFactor;
+	const GLboolean depthMask = g_glState.depthMask;
+	uint32_t clip[4];
+	memcpy(clip, clipWindow, sizeof clip);
+
+	grClipWindow(0, 0, 640, 480);
+	GLStateEnable(GL_TEXTURE_2D, true);
+	GLStateEnable(GL_FOG, false);
+	GLStateEnable(GL_DEPTH_TEST, false);
+	GLStateDepthMask(false);
+	GLStateBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+	glBegin(GL_QUADS); {
+		glTexCoord2f(0.0f, t0);
+		glVertex3f(0.0f, y0, 0.5f);
+		glTexCoord2f(s1, t0);
+		glVertex3f(640.0f, y0, 0.5f);
+		glTexCoord2f(s1, t1);
+		glVertex3f(640.0f, y1, 0.5f);
+		glTexCoord2f(0.0f, t1);
+		glVertex3f(0.0f, y1, 0.5f);
+	} glEnd();
+
+	GLStateBlendFunc(blendSFactor, blendDFactor);
+	GLStateDepthMask(depthMask);
+	GLStateEnable(GL_DEPTH_TEST, enabled & GLStateDepthTest);
+	GLStateEnable(GL_FOG, enabled & GLStateFog);
+	GLStateEnable(GL_TEXTURE_2D, enabled & GLStateTexture2D);
+	GLStateBindTexture(texture);
+	grClipWindow(clip[0], clip[1], clip[2], clip[3]);
+}
+
 /**/
 
 REALIGN STDCALL void grAlphaBlendFunction(GrAlphaBlendFnc_t rgb_sf, GrAlphaBlendFnc_t rgb_df, GrAlphaBlendFnc_t alpha_sf, GrAlphaBlendFnc_t alpha_df)
@@ -58,20 +158,17 @@ REALIGN STDCALL void grAlphaBlendFunction(GrAlphaBlendFnc_t rgb_sf, GrAlphaBlend
 	switch (rgb_df)
 	{
 		case GR_BLEND_ONE:
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+			GLStateBlendFunc(GL_SRC_ALPHA, GL_ONE);
 			break;
 		case GR_BLEND_ONE_MINUS_SRC_ALPHA:
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			GLStateBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 			break;
 	}
 // 	printf("grAlphaBlendFunction: %d %d %d %d\n", rgb_sf, rgb_df, alpha_sf, alpha_df);
 }
 REALIGN STDCALL void grAlphaCombine(GrCombineFunction_t function, GrCombineFactor_t factor, GrCombineLocal_t local, GrCombineOther_t other, BOOL invert)
 {
-	if (other == GR_COMBINE_OTHER_TEXTURE)
-		glEnable(GL_TEXTURE_2D);
-	else
-		glDisable(GL_TEXTURE_2D);
+	GLStateEnable(GL_TEXTURE_2D, other == GR_COMBINE_OTHER_TEXTURE);
 // 	printf("grAlphaCombine: %d\n", (other == GR_COMBINE_OTHER_TEXTURE));
 }
 REALIGN STDCALL void grAlphaTestFunction(GrCmpFnc_t function)
@@ -101,6 +198,11 @@ REALIGN STDCALL void grClipWindow(uint32_t minX, uint32_t minY, uint32_t maxX, u
 		visibleHeight = 480 * heightRatio + 0.5f;
 	}
 
+	clipWindow[0] = minX;
+	clipWindow[1] = minY;
+	clipWindow[2] = maxX;
+	clipWindow[3] = maxY;
+
 	int32_t scaledMinX = minX * widthRatio;
 	int32_t scaledMinY = minY * heightRatio;
 	int32_t scaledMaxX = maxX * widthRatio  + 0.5f;
@@ -111,8 +213,8 @@ REALIGN STDCALL void grClipWindow(uint32_t minX, uint32_t minY, uint32_t maxX, u
 	glLoadIdentity();
 
 	glOrtho(scaledMinX, scaledMaxX, scaledMaxY, scaledMinY, Near, Far);
-	glViewport(scaledMinX + xOffset, winHeight - scaledMaxY - yOffset, scaledMaxX - scaledMinX, scaledMaxY - scaledMinY);
-	glScissor (scaledMinX + xOffset, winHeight - scaledMaxY - yOffset, scaledMaxX - scaledMinX, scaledMaxY - scaledMinY);
+	GLStateViewport(scaledMinX + xOffset, winHeight - scaledMaxY - yOffset, scaledMaxX - scaledMinX, scaledMaxY - scaledMinY);
+	GLStateScissor (scaledMinX + xOffset, winHeight - scaledMaxY - yOffset, scaledMaxX - scaledMinX, scaledMaxY - scaledMinY);
 
 	glScalef(widthRatio, heightRatio, 1.0f);
 	glLineWidth(widthRatio + heightRatio);
@@ -153,17 +255,26 @@ REALIGN STDCALL void grBufferSwap(int swap_interval)
 		windowResized = false;
 	}
 
-	GLint scissorBox[4] = {};
-	glGetIntegerv(GL_SCISSOR_BOX, scissorBox);
+	GLint scissorBox[4];
+	memcpy(scissorBox, GLStateGetScissor(), sizeof scissorBox);
 	if (clearUnusedArea(xOffset, yOffset, visibleWidth, visibleHeight))
-		glScissor(scissorBox[0], scissorBox[1], scissorBox[2], scissorBox[3]);
+		GLStateScissor(scissorBox[0], scissorBox[1], scissorBox[2], scissorBox[3]);
 
 	// kofred - virtual gamepad codes
 	#ifdef OPENGL1X
 	VirtualControls_Draw_GL1();
 	#endif
 
+	if (statsMode & StatsOverlay)
+	{
+		StatsDrawOverlay(winWidth, winHeight, statsFillRect);
+		GLStateScissor(scissorBox[0], scissorBox[1], scissorBox[2], scissorBox[3]);
+	}
+
+	const uint64_t swapStart = SDL_GetPerformanceCounter();
 	SDL_GL_SwapWindow(sdlWin);
+	if (statsMode)
+		StatsFrameEnd(SDL_GetPerformanceCounter() - swapStart);
 }
 REALIGN STDCALL void grColorCombine(GrCombineFunction_t function, GrCombineFactor_t factor, GrCombineLocal_t local, GrCombineOther_t other, BOOL invert)
 {
@@ -188,7 +299,7 @@ REALIGN STDCALL void grDepthBufferMode(GrDepthBufferMode_t mode)
 }
 REALIGN STDCALL void grDepthMask(BOOL mask)
 {
-	glDepthMask(mask);
+	GLStateDepthMask(mask);
 // 	printf("grDepthMask: %d [%d]\n", mask, trianglesCount);
 }
 REALIGN STDCALL void grDitherMode(GrDitherMode_t mode)
@@ -200,6 +311,8 @@ REALIGN STDCALL void grDrawTriangle(const GrVertex *a, const GrVertex *b, const
 // 	printf("grDrawTriangle\n");
 	const GrVertex *grVertices[3] = {a, b, c};
 	uint32_t i;
+	StatsAdd(StatTriangles, 1);
+	StatsAdd(StatDrawCalls, 1);
 	glBegin(GL_TRIANGLES);
 	for (i = 0; i < 3; ++i)
 	{
@@ -216,6 +329,8 @@ REALIGN STDCALL void grDrawTriangle(const GrVertex *a, const GrVertex *b, const
 REALIGN STDCALL void grDrawLine(const GrVertex *a, const GrVertex *b)
 {
 // 	printf("grDrawLine: [%d]\n", trianglesCount);
+	StatsAdd(StatLines, 1);
+	StatsAdd(StatDrawCalls, 1);
 	glBegin(GL_LINES); {
 		glColor4ub(a->r, a->g, a->b, a->a);
 		glVertex3f(a->x - VertexSnap, a->y - VertexSnap, a->oow);
@@ -236,10 +351,10 @@ REALIGN STDCALL void grFogMode(GrFogMode_t mode)
 	switch (mode)
 	{
 		case GR_FOG_DISABLE:
-			glDisable(GL_FOG);
+			GLStateEnable(GL_FOG, false);
 			break;
 		case GR_FOG_WITH_TABLE:
-			glEnable(GL_FOG);
+			GLStateEnable(GL_FOG, true);
 			glFogi(GL_FOG_COORDINATE_SOURCE, GL_FOG_COORDINATE);
 			glHint(GL_FOG_HINT, GL_FASTEST);
 			glFogf(GL_FOG_MODE, GL_LINEAR);
@@ -255,10 +370,18 @@ REALIGN STDCALL void grGammaCorrectionValue(float value)
 }
 REALIGN STDCALL void grGlideInit(void)
 {
+	texelConvertInit();
 // 	printf("grGlideInit\n");
 }
 REALIGN STDCALL void grGlideShutdown(void)
 {
+	paletteCacheClear();
+	if (lfbTexture != 0)
+	{
+		glDeleteTextures(1, &lfbTexture);
+		GLStateTextureDeleted(lfbTexture);
+		lfbTexture = 0;
+	}
 	SDL_GL_DeleteContext(glCtx);
 	palette = NULL;
 	glCtx = NULL;
@@ -267,21 +390,19 @@ REALIGN STDCALL void grGlideShutdown(void)
 }
 REALIGN STDCALL BOOL grLfbLock(GrLock_t type, GrBuffer_t buffer, GrLfbWriteMode_t writeMode, GrOriginLocation_t origin, BOOL pixelPipeline, GrLfbInfo_t *info)
 {
-	//TODO Remove this
 	memset(info, 0, sizeof(GrLfbInfo_t));
-	if (type == GR_LFB_WRITE_ONLY)
-	{
-		info->lfbPtr = lfb = (uint8_t *)malloc(640*480*2);
-		info->strideInBytes = 2;
-		return true;
-	}
-	return false;
+
+	// Framebuffer can't be read back
+	if (!(type & GR_LFB_WRITE_ONLY) || (buffer != GR_BUFFER_FRONTBUFFER && buffer != GR_BUFFER_BACKBUFFER))
+		return false;
+
+	return lfbLock(&lfb, writeMode, origin, info);
 }
 REALIGN STDCALL BOOL grLfbUnlock(GrLock_t type, GrBuffer_t buffer)
 {
-	//TODO Remove this
-	free(lfb);
-	lfb = NULL;
+	if (lfb.locked)
+		lfbComposite();
+	lfb.locked = false;
 	return true;
 }
 REALIGN STDCALL void grRenderBuffer(GrBuffer_t buffer)
@@ -322,17 +443,18 @@ REALIGN STDCALL BOOL grSstWinOpen(uint32_t hWnd, GrScreenResolution_t screen_res
 		contextError = true;
 		raise(SIGABRT);
 	}
+	GLStateReset();
 
 	handleDpr();
 
 	if (vSync >= 0)
 		SDL_GL_SetSwapInterval(vSync);
 
-	glEnable(GL_SCISSOR_TEST);
+	GLStateEnable(GL_SCISSOR_TEST, true);
 	glEnable(GL_ALPHA_TEST);
-	glEnable(GL_DEPTH_TEST);
+	GLStateEnable(GL_DEPTH_TEST, true);
 	glDisable(GL_DITHER);
-	glEnable(GL_BLEND);
+	GLStateEnable(GL_BLEND, true);
 
 	glAlphaFunc(GL_GREATER, 16.0f / 255.0f);
 	glDepthFunc(GL_LEQUAL);
@@ -381,17 +503,21 @@ REALIGN STDCALL void grTexDownloadMipMap(GrChipID_t tmu, uint32_t startAddress,
 		glGenTextures(1, &ti->id);
 
 	if (newTexture || info->format != GR_TEXFMT_P_8)
-		glBindTexture(GL_TEXTURE_2D, ti->id);
+		GLStateBindTexture(ti->id);
 
 	if (newTexture)
 		setTextureFiltering();
 
+	StatsAdd(StatTextureUploads, 1);
+	StatsAdd(StatTextureBytes, size * size * (info->format == GR_TEXFMT_P_8 ? 1 : 2));
+
 	switch (info->format)
 	{
 		case GR_TEXFMT_P_8:
 			ti->data = &textureMem[startAddress];
 			ti->palette = NULL;
 			memcpy(ti->data, info->data, size * size);
+			paletteCacheRemoveSlot(startAddress >> 2);
 			break;
 		case GR_TEXFMT_RGB_565:
 			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, size, size, 0, GL_RGB, GL_UNSIGNED_SHORT_5_6_5, data);
@@ -408,7 +534,11 @@ REALIGN STDCALL void grTexDownloadMipMap(GrChipID_t tmu, uint32_t startAddress,
 REALIGN STDCALL void grTexDownloadTable(GrChipID_t tmu, GrTexTable_t type, void *data)
 {
 	if (type == GR_TEXTABLE_PALETTE)
+	{
 		palette = (uint32_t *)data;
+		if (paletteCacheSize > 0)
+			paletteHash = paletteCacheHash(palette);
+	}
 }
 REALIGN STDCALL void grTexFilterMode(GrChipID_t tmu, GrTextureFilterMode_t minfilter_mode, GrTextureFilterMode_t magfilter_mode)
 {
@@ -430,17 +560,37 @@ REALIGN STDCALL void grTexMipMapMode(GrChipID_t tmu, GrMipMapMode_t mode, BOOL l
 REALIGN STDCALL void grTexSource(GrChipID_t tmu, uint32_t startAddress, uint32_t evenOdd, GrTexInfo *info)
 {
 	TextureInfo *ti = &textures[startAddress >> 2];
-	glBindTexture(GL_TEXTURE_2D, ti->id);
+	if (info->format == GR_TEXFMT_P_8 && palette && paletteCacheSize > 0)
+	{
+		GLuint id = paletteCacheFind(startAddress >> 2, paletteHash);
+		if (id == 0)
+		{
+			uint32_t size = 256 >> info->largeLod;
+			uint32_t sqrSize = size * size;
+			texelExpandPalette(tmpTexture, ti->data, palette, sqrSize);
+			StatsAdd(StatPaletteExpansions, 1);
+			id = paletteCacheAdd(startAddress >> 2, paletteHash, sqrSize * 4);
+			GLStateBindTexture(id);
+			setTextureFiltering();
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size, size, 0, GL_BGRA, GL_UNSIGNED_BYTE, tmpTexture);
+		}
+		else
+		{
+			GLStateBindTexture(id);
+		}
+		return;
+	}
+	GLStateBindTexture(ti->id);
 	if (info->format == GR_TEXFMT_P_8 && palette && ti->palette != palette)
 	{
 		// Update only when palette or texture changes (let's assume every palette has different pointer)
 		// When texture changes, palette is NULL
-		uint8_t *data = ti->data;
 		uint32_t size = 256 >> info->largeLod;
-		uint32_t sqrSize = size * size, i;
-		for (i = 0; i < sqrSize; ++i)
-			tmpTexture[i] = palette[data[i]];
+		texelExpandPalette(tmpTexture, ti->data, palette, size * size);
+		StatsAdd(StatPaletteExpansions, 1);
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size, size, 0, GL_BGRA, GL_UNSIGNED_BYTE, tmpTexture);
 		ti->palette = palette;
 	}
 }
+
+#include "GlideTrace.c"
@@ -7,6 +7,8 @@
 	#include "../virtual_controls.h"
 // #endif
 
+#include "../Stats.h"
+
 #include <SDL2/SDL_stdinc.h>
 #include <SDL2/SDL_video.h>
 
@@ -26,6 +28,7 @@ static PFNGLCREATEPROGRAMPROC glCreateProgram;
 static PFNGLDELETEPROGRAMPROC glDeleteProgram;
 static PFNGLATTACHSHADERPROC glAttachShader;
 static PFNGLLINKPROGRAMPROC glLinkProgram;
+static PFNGLBINDATTRIBLOCATIONPROC glBindAttribLocation;
 static PFNGLGETATTRIBLOCATIONPROC glGetAttribLocation;
 static PFNGLGETUNIFORMLOCATIONPROC glGetUniformLocation;
 static PFNGLUSEPROGRAMPROC glUseProgram;
@@ -34,6 +37,7 @@ static PFNGLUNIFORMMATRIX4FVPROC glUniformMatrix4fv;
 static PFNGLVERTEXATTRIBPOINTERPROC glVertexAttribPointer;
 static PFNGLUNIFORM3FPROC glUniform3f;
 static PFNGLUNIFORM1FPROC glUniform1f;
+static PFNGLUNIFORM2FPROC glUniform2f;
 static PFNGLENABLEVERTEXATTRIBARRAYPROC glEnableVertexAttribArray;
 static PFNGLDISABLEVERTEXATTRIBARRAYPROC glDisableVertexAttribArray;
 static PFNGLGENFRAMEBUFFERSPROC glGenFramebuffers;
@@ -46,8 +50,32 @@ static PFNGLFRAMEBUFFERRENDERBUFFERPROC glFramebufferRenderbuffer;
 static PFNGLCHECKFRAMEBUFFERSTATUSPROC glCheckFramebufferStatus;
 static PFNGLDELETERENDERBUFFERSPROC glDeleteRenderbuffers;
 static PFNGLDELETEFRAMEBUFFERSPROC glDeleteFramebuffers;
+static PFNGLGENBUFFERSPROC glGenBuffers;
+static PFNGLBINDBUFFERPROC glBindBuffer;
+static PFNGLBUFFERDATAPROC glBufferData;
+static PFNGLBUFFERSUBDATAPROC glBufferSubData;
+static PFNGLDELETEBUFFERSPROC glDeleteBuffers;
+static PFNGLMAPBUFFERRANGEPROC glMapBufferRange;
+static PFNGLUNMAPBUFFERPROC glUnmapBuffer;
+static PFNGLACTIVETEXTUREPROC activeTexture; // Declared in "gl.h", but not exported on Windows
+#endif
+
+#ifdef GLES2
+# define activeTexture glActiveTexture
+static PFNGLMAPBUFFERRANGEEXTPROC glMapBufferRange;
+static PFNGLUNMAPBUFFEROESPROC glUnmapBuffer;
+# ifndef GL_MAP_WRITE_BIT
+#  define GL_MAP_WRITE_BIT GL_MAP_WRITE_BIT_EXT
+# endif
+# ifndef GL_MAP_INVALIDATE_RANGE_BIT
+#  define GL_MAP_INVALIDATE_RANGE_BIT GL_MAP_INVALIDATE_RANGE_BIT_EXT
+# endif
+# ifndef GL_MAP_UNSYNCHRONIZED_BIT
+#  define GL_MAP_UNSYNCHRONIZED_BIT GL_MAP_UNSYNCHRONIZED_BIT_EXT
+# endif
 #endif
 
+#include <stddef.h>
 #include <signal.h>
 
 BOOL contextError = false;
@@ -102,10 +130,12 @@ const char g_vShaderSrc[] =
 
 	"attribute vec4 aPosition;"
 	"attribute vec4 aTexCoord;"
+	"attribute vec4 aTexRect;"
 	"attribute vec4 aColor;"
 	"attribute float aFog;"
 
 	"varying vec4 vTexCoord;"
+	"varying vec4 vTexRect;"
 	"varying vec4 vColor;"
 	"varying float vFog;"
 
@@ -114,6 +144,7 @@ const char g_vShaderSrc[] =
 	"void main()"
 	"{"
 		"vTexCoord = aTexCoord;"
+		"vTexRect = aTexRect;"
 		"vColor = aColor;"
 		"vFog = aFog;"
 		"gl_Position = uMatrix * aPosition;"
@@ -121,23 +152,64 @@ const char g_vShaderSrc[] =
 ;
 const char g_fShaderSrc[] =
 #ifdef GLES2
-	"precision mediump float;"
+	"precision mediump float;\n"
+	// Atlas coordinates need more precision than mediump can give
+	"#ifdef GL_FRAGMENT_PRECISION_HIGH\n"
+	"#define texPrecision highp\n"
+	"#else\n"
+	"#define texPrecision mediump\n"
+	"#endif\n"
 #else
 	"#version 110\n"
+	"#define texPrecision\n"
 #endif
 
-	"varying vec4 vTexCoord;"
+	"varying texPrecision vec4 vTexCoord;"
+	"varying texPrecision vec4 vTexRect;" // xy - offset, z - scale, w - texels per side / 65535 or 0
 	"varying vec4 vColor;"
 	"varying float vFog;"
 
 	"uniform sampler2D uTextureSampler;"
+	"uniform sampler2D uPaletteSampler;"
 	"uniform float uTextureEnabled;"
+	"uniform float uPaletted;" // 0 - no, 1 - nearest, 2 - bilinear
 	"uniform float uFogEnabled;"
 	"uniform vec3 uFogColor;"
 
+	"vec4 paletteTexel(texPrecision vec2 uv)"
+	"{"
+		"return texture2D(uPaletteSampler, vec2(texture2D(uTextureSampler, uv).r * (255.0 / 256.0) + (0.5 / 256.0), 0.5));"
+	"}"
+
 	"void main()"
 	"{"
-		"vec4 texture = uTextureEnabled * texture2D(uTextureSampler, vTexCoord.st / vTexCoord.q);"
+		// Rounded, so the exact texel count survives the normalization and low precision
+		"texPrecision float size = floor(vTexRect.w * 65535.0 + 0.5);"
+		"texPrecision float halfTexel = (size > 0.0) ? 0.5 / size : 0.0;"
+		"texPrecision vec2 st = clamp(vTexCoord.st / vTexCoord.q, halfTexel, 1.0 - halfTexel);"
+		"vec4 texture;"
+		"if (uPaletted < 0.5)"
+		"{"
+			"texture = texture2D(uTextureSampler, vTexRect.xy + st * vTexRect.z);"
+		"}"
+		"else if (uPaletted < 1.5)"
+		"{"
+			"texture = paletteTexel(st);"
+		"}"
+		"else"
+		"{"
+			// Indices can't be filtered, so filter the palette colors
+			"texPrecision float d = 1.0 / size;"
+			"texPrecision vec2 p = st * size - 0.5;"
+			"texPrecision vec2 f = fract(p);"
+			"texPrecision vec2 c = (floor(p) + 0.5) * d;"
+			"texture = mix("
+				"mix(paletteTexel(c), paletteTexel(c + vec2(d, 0.0)), f.x),"
+				"mix(paletteTexel(c + vec2(0.0, d)), paletteTexel(c + vec2(d, d)), f.x),"
+				"f.y"
+			");"
+		"}"
+		"texture *= uTextureEnabled;"
 		"vec4 ret = vColor * ((1.0 - uTextureEnabled) + texture);"
 
 		"if (ret.a <= 16.0 / 255.0)"
@@ -178,10 +250,23 @@ const char g_fShaderDispSrc[] =
 
 	"uniform sampler2D uTextureSampler;"
 	"uniform float uGamma;"
+	"uniform float uSharpness;"
+	"uniform vec2 uTexelSize;"
 
 	"void main()"
 	"{"
 		"vec4 texture = texture2D(uTextureSampler, vTexCoord);"
+		"if (uSharpness > 0.0)"
+		"{"
+			// Unsharp mask with the 4 neighbours
+			"vec3 blur = ("
+				"texture2D(uTextureSampler, vTexCoord + vec2(uTexelSize.x, 0.0)).rgb +"
+				"texture2D(uTextureSampler, vTexCoord - vec2(uTexelSize.x, 0.0)).rgb +"
+				"texture2D(uTextureSampler, vTexCoord + vec2(0.0, uTexelSize.y)).rgb +"
+				"texture2D(uTextureSampler, vTexCoord - vec2(0.0, uTexelSize.y)).rgb"
+			") * 0.25;"
+			"texture.rgb = clamp(texture.rgb + (texture.rgb - blur) * uSharpness, 0.0, 1.0);"
+		"}"
 		"texture.rgb = pow(texture.rgb, vec3(1.0 / uGamma));"
 		"gl_FragColor = texture;"
 	"}"
@@ -193,35 +278,58 @@ const char g_fShaderDispSrc[] =
 #define Near        -1.0f
 #define Far          0.0f
 
+#define VertexBufferCount    4
+#define VertexBufferVertices (MaxTriangles * 3 * 16)
+#define MaxDrawRuns          0x001000
+#define MergeDepth           32
+
+/* Interleaved vertex, streamed into VBO ring or used as client array */
 typedef struct
 {
+	float x, y, z;
+	float s, t, r, q;
+	uint16_t texRect[4];
 	struct
 	{
 		uint8_t r, g, b, a;
-	} vertex[3];
-} ColorValues;
+	} color;
+	uint8_t fog, padding[3];
+} Vertex;
+static Vertex g_vertices[VertexBufferVertices], g_drawVertices[VertexBufferVertices];
+
+/* Everything which used to force the batch to be flushed */
 typedef struct
 {
-	uint8_t vertex[3];
-} FogCoord;
+	GLuint texture;
+	GLenum blendFuncDFactor;
+	GrColor_t fogColor;
+	uint16_t clip[4];
+	uint8_t depthMask, textureEnabled, fogEnabled, paletted;
+} DrawState;
+
+/* Triangles or lines recorded with the same state, in game order */
 typedef struct
 {
-	struct
-	{
-		float s, t, r, q;
-	} vertex[3];
-} TextureCoord;
+	DrawState state;
+	float bounds[4];
+	uint32_t first, count;
+	int32_t next;
+	BOOL lines;
+} DrawRun;
+
+/* Runs which can be drawn together after reordering */
 typedef struct
 {
-	struct
-	{
-		float x, y, z;
-	} vertex[3];
-} Vertices;
-static ColorValues g_colorValues[MaxTriangles];
-static FogCoord g_fogCoord[MaxTriangles];
-static TextureCoord g_textureCoord[MaxTriangles];
-static Vertices g_vertices[MaxTriangles];
+	DrawState state;
+	float bounds[4];
+	int32_t firstRun, lastRun;
+	uint32_t first, count;
+	BOOL lines;
+} DrawGroup;
+
+static DrawRun g_drawRuns[MaxDrawRuns];
+static DrawGroup g_drawGroups[MaxDrawRuns];
+static uint32_t g_drawRunsCount, g_verticesCount, g_drawList = 1;
 
 static float g_textureCoordDisp[4][2] = {
 	{0.0f, 1.0f},
@@ -243,26 +351,53 @@ typedef struct
 	GrTextureFormat_t fmt;
 	uint32_t size;
 	uint32_t id;
+	uint32_t drawList;
+	uint16_t rect[4];
+	uint16_t atlasPos[2];
+	uint16_t atlasNode;
+	uint8_t atlasPage;
+	uint16_t storageSize; // Allocated storage of "id", see "texImage()"
+	GLenum storageFormat, storageType;
 } TextureInfo;
 static TextureInfo g_textures[TextureMem >> 2];
 
-static uint8_t *g_lfb, g_textureMem[TextureMem], g_fogTable[0x10000];
-static uint32_t *g_palette, g_tmpTexture[0x400];
-static uint32_t g_trianglesCount;
+#include "LfbStaging.c"
+
+static LfbStaging g_lfb; // Executed on the render thread, see "g_lfbRecord"
+static uint32_t g_lfbTexels[640 * 480];
+static GLuint g_lfbTexture;
+static uint32_t g_lfbDrawList;
+
+/* Whole texture, clamped to edges */
+static const uint16_t g_fullTexRect[4] = {0, 0, 0xFFFF, 0};
+static uint16_t g_drawTexRect[4] = {0, 0, 0xFFFF, 0};
+
+static uint8_t g_textureMem[TextureMem], g_fogTable[0x10000];
+static uint32_t *g_palette, g_paletteHash, g_rgbaPalette[256], g_tmpTexture[0x400];
+
+/* Palette lookup in shader */
+static GLuint g_paletteTexture;
+static BOOL g_paletteChanged;
+static uint32_t g_paletteDrawList;
 
 static SDL_GLContext g_glCtx;
 
-extern BOOL keepAspectRatio, needRecreateGl, windowResized, linearFiltering, fixedFramebufferSize, framebufferLinearFiltering;
-extern int32_t vSync, winWidth, winHeight, initialWinWidth, initialWinHeight;
+#ifdef GLES2
+# define textureShadowCopy true // Context is lost on Android and 16-bit textures need conversion
+#else
+extern BOOL textureShadowCopy;
+#endif
+extern BOOL keepAspectRatio, needRecreateGl, windowResized, linearFiltering, fixedFramebufferSize, framebufferLinearFiltering, textureAtlas, gpuPaletteLookup;
+extern int32_t vSync, winWidth, winHeight, initialWinWidth, initialWinHeight, displaySharpening;
 extern SDL_Window *sdlWin;
 
 /* GLSL game */
-static GLuint g_vShader, g_fShader, g_shaderProgram;
-static GLint g_aPositionLoc, g_aTexCoordLoc, g_aColorLoc, g_aFogLoc, g_uMatrixLoc, g_uTextureEnabledLoc, g_uFogEnabledLoc, g_uFogColorLoc;
+static GLuint g_shaderProgram;
+static GLint g_aPositionLoc, g_aTexCoordLoc, g_aTexRectLoc, g_aColorLoc, g_aFogLoc, g_uMatrixLoc, g_uTextureEnabledLoc, g_uPalettedLoc, g_uFogEnabledLoc, g_uFogColorLoc;
 
 /* GLSL display */
-static GLuint g_vShaderDisp, g_fShaderDisp, g_shaderProgramDisp;
-static GLint g_aPositionLocDisp, g_aTexCoordLocDisp, g_uGammaLocDisp;
+static GLuint g_shaderProgramDisp;
+static GLint g_aPositionLocDisp, g_aTexCoordLocDisp, g_uGammaLocDisp, g_uTexelSizeLocDisp;
 
 /* Framebuffer */
 static uint32_t g_framebuffer;
@@ -271,14 +406,68 @@ static uint32_t g_framebufferDepth;
 static int32_t  g_framebufferHeight;
 
 /* GLSL config */
-static BOOL g_textureEnabled;
-static BOOL g_fogEnabled;
-static float g_fogColor[3];
 static float g_gammaValue;
 
-/* GL config */
-static BOOL g_depthMask;
-static GLenum g_blendFuncDFactor;
+/* Vertex buffers ring */
+static GLuint g_vertexBuffers[VertexBufferCount];
+static uint32_t g_vertexBufferIdx, g_vertexBufferPos;
+static BOOL g_useVertexBuffers, g_useMapBufferRange;
+
+/* State for recorded triangles and state of the GL context */
+static DrawState g_drawState, g_appliedState;
+static BOOL g_drawStateChanged, g_appliedStateValid;
+static GLint g_clipViewport[4]; // Viewport and scissor box of the applied clip window
+
+static inline void bindTexture(GLuint id);
+static void setTextureFiltering();
+static void submitDrawList(uint32_t reason);
+
+/* Returns false for paletted textures */
+static BOOL textureFormat(GrTextureFormat_t fmt, GLenum *internalFormat, GLenum *format, GLenum *type)
+{
+	switch (fmt)
+	{
+		case GR_TEXFMT_RGB_565:
+			*internalFormat = *format = GL_RGB;
+			*type = GL_UNSIGNED_SHORT_5_6_5;
+			return true;
+#ifdef GLES2
+		// Converted to RGBA in shadow copy
+		case GR_TEXFMT_ARGB_1555:
+			*internalFormat = *format = GL_RGBA;
+			*type = GL_UNSIGNED_SHORT_5_5_5_1;
+			return true;
+		case GR_TEXFMT_ARGB_4444:
+			*internalFormat = *format = GL_RGBA;
+			*type = GL_UNSIGNED_SHORT_4_4_4_4;
+			return true;
+#else
+		case GR_TEXFMT_ARGB_1555:
+			*internalFormat = GL_RGBA;
+			*format = GL_BGRA;
+			*type = GL_UNSIGNED_SHORT_1_5_5_5_REV;
+			return true;
+		case GR_TEXFMT_ARGB_4444:
+			*internalFormat = GL_RGBA;
+			*format = GL_BGRA;
+			*type = GL_UNSIGNED_SHORT_4_4_4_4_REV;
+			return true;
+#endif
+	}
+	return false;
+}
+
+#include "GLState.c"
+#include "DynamicResolution.c"
+#include "PixelUpload.c"
+#include "TextureAtlas.c"
+#include "TexelConvert.c"
+#include "VertexConvert.c"
+#include "RenderThread.c"
+
+#define paletteCacheSerial() g_drawList
+#define paletteCacheFlush() submitDrawList(StatFlushTexture)
+#include "PaletteCache.c"
 
 static BOOL checkShaderCompilation(GLuint shader)
 {
@@ -321,89 +510,46 @@ static BOOL checkShaderProgram(GLuint program)
 	return true;
 }
 
+#include "ShaderCache.c"
+
 static inline BOOL loadShaders()
 {
 	{
-		const GLint vShaderLen = sizeof(g_vShaderSrc) - 1;
-		const GLint fShaderLen = sizeof(g_fShaderSrc) - 1;
-
-		const GLchar *vShaderSrc = g_vShaderSrc;
-		const GLchar *fShaderSrc = g_fShaderSrc;
-
-		g_vShader = glCreateShader(GL_VERTEX_SHADER);
-		g_fShader = glCreateShader(GL_FRAGMENT_SHADER);
-
-		glShaderSource(g_vShader, 1, &vShaderSrc, &vShaderLen);
-		glShaderSource(g_fShader, 1, &fShaderSrc, &fShaderLen);
-
-		glCompileShader(g_vShader);
-		if (!checkShaderCompilation(g_vShader))
-			return false;
-		glCompileShader(g_fShader);
-		if (!checkShaderCompilation(g_fShader))
-			return false;
-
-		g_shaderProgram = glCreateProgram();
-
-		glAttachShader(g_shaderProgram, g_vShader);
-		glAttachShader(g_shaderProgram, g_fShader);
-
-		glLinkProgram(g_shaderProgram);
-		if (!checkShaderProgram(g_shaderProgram))
+		g_shaderProgram = ShaderCacheProgram("game", g_vShaderSrc, g_fShaderSrc, NULL);
+		if (!g_shaderProgram)
 			return false;
 
 		g_aPositionLoc = glGetAttribLocation(g_shaderProgram, "aPosition");
 		g_aTexCoordLoc = glGetAttribLocation(g_shaderProgram, "aTexCoord");
+		g_aTexRectLoc = glGetAttribLocation(g_shaderProgram, "aTexRect");
 		g_aColorLoc = glGetAttribLocation(g_shaderProgram, "aColor");
 		g_aFogLoc = glGetAttribLocation(g_shaderProgram, "aFog");
 		g_uMatrixLoc = glGetUniformLocation(g_shaderProgram, "uMatrix");
 
 		g_uTextureEnabledLoc = glGetUniformLocation(g_shaderProgram, "uTextureEnabled");
+		g_uPalettedLoc = glGetUniformLocation(g_shaderProgram, "uPaletted");
 		g_uFogEnabledLoc = glGetUniformLocation(g_shaderProgram, "uFogEnabled");
 		g_uFogColorLoc = glGetUniformLocation(g_shaderProgram, "uFogColor");
 
-		glUseProgram(g_shaderProgram);
+		GLStateUseProgram(g_shaderProgram);
 		glUniform1i(glGetUniformLocation(g_shaderProgram, "uTextureSampler"), 0);
-		glUseProgram(0);
+		glUniform1i(glGetUniformLocation(g_shaderProgram, "uPaletteSampler"), 1);
 	}
 
 	{
-		const GLint vShaderLen = sizeof(g_vShaderDispSrc) - 1;
-		const GLint fShaderLen = sizeof(g_fShaderDispSrc) - 1;
-
-		const GLchar *vShaderSrc = g_vShaderDispSrc;
-		const GLchar *fShaderSrc = g_fShaderDispSrc;
-
-		g_vShaderDisp = glCreateShader(GL_VERTEX_SHADER);
-		g_fShaderDisp = glCreateShader(GL_FRAGMENT_SHADER);
-
-		glShaderSource(g_vShaderDisp, 1, &vShaderSrc, &vShaderLen);
-		glShaderSource(g_fShaderDisp, 1, &fShaderSrc, &fShaderLen);
-
-		glCompileShader(g_vShaderDisp);
-		if (!checkShaderCompilation(g_vShaderDisp))
-			return false;
-		glCompileShader(g_fShaderDisp);
-		if (!checkShaderCompilation(g_fShaderDisp))
-			return false;
-
-		g_shaderProgramDisp = glCreateProgram();
-
-		glAttachShader(g_shaderProgramDisp, g_vShaderDisp);
-		glAttachShader(g_shaderProgramDisp, g_fShaderDisp);
-
-		glLinkProgram(g_shaderProgramDisp);
-		if (!checkShaderProgram(g_shaderProgramDisp))
+		g_shaderProgramDisp = ShaderCacheProgram("display", g_vShaderDispSrc, g_fShaderDispSrc, NULL);
+		if (!g_shaderProgramDisp)
 			return false;
 
 		g_aPositionLocDisp = glGetAttribLocation(g_shaderProgramDisp, "aPosition");
 		g_aTexCoordLocDisp = glGetAttribLocation(g_shaderProgramDisp, "aTexCoord");
 
 		g_uGammaLocDisp = glGetUniformLocation(g_shaderProgramDisp, "uGamma");
+		g_uTexelSizeLocDisp = glGetUniformLocation(g_shaderProgramDisp, "uTexelSize");
 
-		glUseProgram(g_shaderProgramDisp);
+		GLStateUseProgram(g_shaderProgramDisp);
 		glUniform1i(glGetUniformLocation(g_shaderProgramDisp, "uTextureSampler"), 0);
-		glUseProgram(0);
+		glUniform1f(glGetUniformLocation(g_shaderProgramDisp, "uSharpness"), displaySharpening / 100.0f);
 	}
 
 	return true;
@@ -419,10 +565,12 @@ static void destroyFrameBuffer()
 	if (g_framebufferTexture != 0)
 	{
 		glDeleteTextures(1, &g_framebufferTexture);
+		GLStateTextureDeleted(g_framebufferTexture);
 		g_framebufferTexture = 0;
 	}
 	if (g_framebuffer != 0)
 	{
+		GLStateBindFramebuffer(0);
 		glDeleteFramebuffers(1, &g_framebuffer);
 		g_framebuffer = 0;
 	}
@@ -431,26 +579,26 @@ static void destroyFrameBuffer()
 static void createFrameBuffer()
 {
 	int32_t shorterEdge = fixedFramebufferSize ? SDL_min(initialWinWidth, initialWinHeight) : SDL_min(winWidth, winHeight);
-	if (g_framebufferHeight == shorterEdge)
-		return;
+	int32_t h = dynResHeight(shorterEdge);
+	int32_t w = h * 4 / 3;
 
-	int32_t w = shorterEdge * 4 / 3;
-	int32_t h = shorterEdge;
+	g_dynResChanged = false;
+	if (g_framebufferHeight == h)
+		return;
 
 	destroyFrameBuffer();
 
 	glGenFramebuffers(1, &g_framebuffer);
-	glBindFramebuffer(GL_FRAMEBUFFER, g_framebuffer);
+	GLStateBindFramebuffer(g_framebuffer);
 
 	glGenTextures(1, &g_framebufferTexture);
-	glBindTexture(GL_TEXTURE_2D, g_framebufferTexture);
+	GLStateBindTexture(g_framebufferTexture);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, (!fixedFramebufferSize || !framebufferLinearFiltering) ? GL_NEAREST : GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, ((!fixedFramebufferSize && !dynResEnabled()) || !framebufferLinearFiltering) ? GL_NEAREST : GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, g_framebufferTexture, 0);
-	glBindTexture(GL_TEXTURE_2D, 0);
 
 	glGenRenderbuffers(1, &g_framebufferDepth);
 	glBindRenderbuffer(GL_RENDERBUFFER, g_framebufferDepth);
@@ -471,51 +619,131 @@ static void createFrameBuffer()
 		raise(SIGABRT);
 	}
 
-	g_framebufferHeight = shorterEdge;
+	g_framebufferHeight = h;
+
+	GLStateUseProgram(g_shaderProgramDisp);
+	glUniform2f(g_uTexelSizeLocDisp, 1.0f / w, 1.0f / h);
 }
 
-static void useGameProgram(BOOL gameProgram)
+static void createVertexBuffers()
 {
-	if (gameProgram)
+	uint32_t i;
+
+	g_vertexBufferIdx = 0;
+	g_vertexBufferPos = 0;
+
+#ifndef GLES2
+	if (!glGenBuffers || !glBindBuffer || !glBufferData || !glBufferSubData || !glDeleteBuffers)
 	{
-		// glEnable(GL_DEPTH_TEST);
-		// glEnable(GL_BLEND);
-		glDisable(GL_DEPTH_TEST);
-		glDisable(GL_BLEND);
+		// Old driver, draw from client arrays
+		g_useVertexBuffers = false;
+		return;
+	}
+#endif
 
-		glBindFramebuffer(GL_FRAMEBUFFER, g_framebuffer);
+	glGenBuffers(VertexBufferCount, g_vertexBuffers);
+	for (i = 0; i < VertexBufferCount; ++i)
+	{
+		GLStateBindArrayBuffer(g_vertexBuffers[i]);
+		glBufferData(GL_ARRAY_BUFFER, VertexBufferVertices * sizeof(Vertex), NULL, GL_STREAM_DRAW);
+	}
 
-		glDisableVertexAttribArray(g_aPositionLocDisp);
-		glDisableVertexAttribArray(g_aTexCoordLocDisp);
+	g_useVertexBuffers = true;
+}
+static void destroyVertexBuffers()
+{
+	if (!g_useVertexBuffers)
+		return;
 
-		glUseProgram(g_shaderProgram);
+	GLStateBindArrayBuffer(0);
+	glDeleteBuffers(VertexBufferCount, g_vertexBuffers);
+	memset(g_vertexBuffers, 0, sizeof g_vertexBuffers);
 
-		glEnableVertexAttribArray(g_aPositionLoc);
-		glEnableVertexAttribArray(g_aTexCoordLoc);
-		glEnableVertexAttribArray(g_aColorLoc);
-		glEnableVertexAttribArray(g_aFogLoc);
+	g_useVertexBuffers = false;
+}
 
-		glVertexAttribPointer(g_aPositionLoc, 3, GL_FLOAT, GL_FALSE, 0, g_vertices);
-		glVertexAttribPointer(g_aTexCoordLoc, 4, GL_FLOAT, GL_FALSE, 0, g_textureCoord);
-		glVertexAttribPointer(g_aColorLoc, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, g_colorValues);
-		glVertexAttribPointer(g_aFogLoc, 1, GL_UNSIGNED_BYTE, GL_TRUE, 0, g_fogCoord);
+static void setVertexPointers()
+{
+	const uint8_t *base = NULL;
+
+	if (g_useVertexBuffers)
+		GLStateBindArrayBuffer(g_vertexBuffers[g_vertexBufferIdx]);
+	else
+		base = (const uint8_t *)g_drawVertices;
+
+	glVertexAttribPointer(g_aPositionLoc, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), base + offsetof(Vertex, x));
+	glVertexAttribPointer(g_aTexCoordLoc, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), base + offsetof(Vertex, s));
+	glVertexAttribPointer(g_aTexRectLoc, 4, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(Vertex), base + offsetof(Vertex, texRect));
+	glVertexAttribPointer(g_aColorLoc, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), base + offsetof(Vertex, color));
+	glVertexAttribPointer(g_aFogLoc, 1, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), base + offsetof(Vertex, fog));
+}
+
+/* Returns the first vertex index for glDrawArrays() */
+static uint32_t streamVertices(const Vertex *vertices, uint32_t count)
+{
+	if (!g_useVertexBuffers)
+		return vertices - g_drawVertices;
+
+	if (g_vertexBufferPos + count > VertexBufferVertices)
+	{
+		// Go to the next buffer and orphan its storage, so we never wait for the GPU
+		g_vertexBufferIdx = (g_vertexBufferIdx + 1) % VertexBufferCount;
+		g_vertexBufferPos = 0;
+		setVertexPointers();
+		glBufferData(GL_ARRAY_BUFFER, VertexBufferVertices * sizeof(Vertex), NULL, GL_STREAM_DRAW);
+	}
+
+	const GLintptr offset = g_vertexBufferPos * sizeof(Vertex);
+	const GLsizeiptr size = count * sizeof(Vertex);
+	void *ptr = NULL;
+
+	// Range was never written since last orphaning, so it can be mapped unsynchronized
+	if (g_useMapBufferRange)
+		ptr = glMapBufferRange(GL_ARRAY_BUFFER, offset, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	if (ptr)
+	{
+		memcpy(ptr, vertices, size);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
 	}
 	else
 	{
-		glDisable(GL_DEPTH_TEST);
-		glDisable(GL_BLEND);
+		glBufferSubData(GL_ARRAY_BUFFER, offset, size, vertices);
+	}
 
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	const uint32_t first = g_vertexBufferPos;
+	g_vertexBufferPos += count;
+	return first;
+}
 
-		glDisableVertexAttribArray(g_aPositionLoc);
-		glDisableVertexAttribArray(g_aTexCoordLoc);
-		glDisableVertexAttribArray(g_aColorLoc);
-		glDisableVertexAttribArray(g_aFogLoc);
+static inline uint32_t attribBit(GLint location)
+{
+	return (location >= 0) ? (1u << location) : 0; // Unused attributes have no location
+}
 
-		glUseProgram(g_shaderProgramDisp);
+static void useGameProgram(BOOL gameProgram)
+{
+	// GLStateEnable(GL_DEPTH_TEST, true);
+	// GLStateEnable(GL_BLEND, true);
+	GLStateEnable(GL_DEPTH_TEST, false);
+	GLStateEnable(GL_BLEND, false);
 
-		glEnableVertexAttribArray(g_aPositionLocDisp);
-		glEnableVertexAttribArray(g_aTexCoordLocDisp);
+	if (gameProgram)
+	{
+		GLStateBindFramebuffer(g_framebuffer);
+		GLStateUseProgram(g_shaderProgram);
+		GLStateEnableAttribs(attribBit(g_aPositionLoc) | attribBit(g_aTexCoordLoc) | attribBit(g_aTexRectLoc) | attribBit(g_aColorLoc) | attribBit(g_aFogLoc));
+
+		// Attribute arrays aren't tracked, the display pass uses the same locations
+		setVertexPointers();
+	}
+	else
+	{
+		GLStateBindFramebuffer(0);
+		GLStateUseProgram(g_shaderProgramDisp);
+		GLStateEnableAttribs(attribBit(g_aPositionLocDisp) | attribBit(g_aTexCoordLocDisp));
+
+		if (g_useVertexBuffers)
+			GLStateBindArrayBuffer(0);
 
 		glVertexAttribPointer(g_aPositionLocDisp, 2, GL_FLOAT, GL_FALSE, 0, g_verticesDisp);
 		glVertexAttribPointer(g_aTexCoordLocDisp, 2, GL_FLOAT, GL_FALSE, 0, g_textureCoordDisp);
@@ -530,6 +758,7 @@ static void createContext()
 		contextError = true;
 		raise(SIGABRT);
 	}
+	GLStateReset();
 
 #ifndef GLES2
 	glGetShaderiv = SDL_GL_GetProcAddress("glGetShaderiv");
@@ -544,6 +773,7 @@ static void createContext()
 	glDeleteProgram = SDL_GL_GetProcAddress("glDeleteProgram");
 	glAttachShader = SDL_GL_GetProcAddress("glAttachShader");
 	glLinkProgram = SDL_GL_GetProcAddress("glLinkProgram");
+	glBindAttribLocation = SDL_GL_GetProcAddress("glBindAttribLocation");
 	glGetAttribLocation = SDL_GL_GetProcAddress("glGetAttribLocation");
 	glGetUniformLocation = SDL_GL_GetProcAddress("glGetUniformLocation");
 	glUseProgram = SDL_GL_GetProcAddress("glUseProgram");
@@ -552,6 +782,7 @@ static void createContext()
 	glVertexAttribPointer = SDL_GL_GetProcAddress("glVertexAttribPointer");
 	glUniform3f = SDL_GL_GetProcAddress("glUniform3f");
 	glUniform1f = SDL_GL_GetProcAddress("glUniform1f");
+	glUniform2f = SDL_GL_GetProcAddress("glUniform2f");
 	glEnableVertexAttribArray = SDL_GL_GetProcAddress("glEnableVertexAttribArray");
 	glDisableVertexAttribArray = SDL_GL_GetProcAddress("glDisableVertexAttribArray");
 	glGenFramebuffers = SDL_GL_GetProcAddress("glGenFramebuffers");
@@ -564,6 +795,12 @@ static void createContext()
 	glCheckFramebufferStatus = SDL_GL_GetProcAddress("glCheckFramebufferStatus");
 	glDeleteFramebuffers = SDL_GL_GetProcAddress("glDeleteFramebuffers");
 	glDeleteRenderbuffers = SDL_GL_GetProcAddress("glDeleteRenderbuffers");
+	glGenBuffers = SDL_GL_GetProcAddress("glGenBuffers");
+	glBindBuffer = SDL_GL_GetProcAddress("glBindBuffer");
+	glBufferData = SDL_GL_GetProcAddress("glBufferData");
+	glBufferSubData = SDL_GL_GetProcAddress("glBufferSubData");
+	glDeleteBuffers = SDL_GL_GetProcAddress("glDeleteBuffers");
+	activeTexture = SDL_GL_GetProcAddress("glActiveTexture");
 
 	BOOL ok = true;
 	ok &= !!glGetShaderiv;
@@ -578,6 +815,7 @@ static void createContext()
 	ok &= !!glDeleteProgram;
 	ok &= !!glAttachShader;
 	ok &= !!glLinkProgram;
+	ok &= !!glBindAttribLocation;
 	ok &= !!glGetAttribLocation;
 	ok &= !!glGetUniformLocation;
 	ok &= !!glUseProgram;
@@ -586,6 +824,7 @@ static void createContext()
 	ok &= !!glVertexAttribPointer;
 	ok &= !!glUniform3f;
 	ok &= !!glUniform1f;
+	ok &= !!glUniform2f;
 	ok &= !!glEnableVertexAttribArray;
 	ok &= !!glDisableVertexAttribArray;
 	ok &= !!glGenFramebuffers;
@@ -598,6 +837,7 @@ static void createContext()
 	ok &= !!glCheckFramebufferStatus;
 	ok &= !!glDeleteRenderbuffers;
 	ok &= !!glDeleteFramebuffers;
+	ok &= !!activeTexture;
 	if (!ok)
 	{
 		contextError = true;
@@ -608,44 +848,109 @@ static void createContext()
 	if (vSync >= 0)
 		SDL_GL_SetSwapInterval(vSync);
 
-	glEnable(GL_SCISSOR_TEST);
+	GLStateEnable(GL_SCISSOR_TEST, true);
 	glDisable(GL_DITHER);
 
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
 	glDepthFunc(GL_LEQUAL);
 
+	shaderCacheInit();
 	if (!loadShaders())
 	{
 		shaderError = true;
 		raise(SIGABRT);
 	}
+
+	// Optional, buffers are streamed with glBufferSubData() without it
+#ifdef GLES2
+	if (SDL_GL_ExtensionSupported("GL_EXT_map_buffer_range"))
+	{
+		glMapBufferRange = SDL_GL_GetProcAddress("glMapBufferRangeEXT");
+		glUnmapBuffer = SDL_GL_GetProcAddress("glUnmapBufferOES");
+	}
+#else
+	if (SDL_GL_ExtensionSupported("GL_ARB_map_buffer_range"))
+	{
+		glMapBufferRange = SDL_GL_GetProcAddress("glMapBufferRange");
+		glUnmapBuffer = SDL_GL_GetProcAddress("glUnmapBuffer");
+	}
+#endif
+	g_useMapBufferRange = (glMapBufferRange && glUnmapBuffer);
+
+	pixelUploadInit();
+	createVertexBuffers();
+	dynResInit();
+
+	if (gpuPaletteLookup)
+	{
+		activeTexture(GL_TEXTURE1);
+		glGenTextures(1, &g_paletteTexture);
+		glBindTexture(GL_TEXTURE_2D, g_paletteTexture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 256, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		activeTexture(GL_TEXTURE0);
+		g_paletteChanged = true;
+	}
+
+	if (textureAtlas)
+	{
+		GLint maxTextureSize = 0;
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+		if (maxTextureSize < AtlasSize)
+			textureAtlas = false;
+	}
 }
 static void destroyContext()
 {
 	uint32_t i;
 
-	glUseProgram(0);
+	GLStateUseProgram(0);
 
+	dynResDestroy();
+	destroyVertexBuffers();
+	pixelUploadDestroy();
 	destroyFrameBuffer();
 
 	for (i = 0; i < (TextureMem >> 2); ++i)
 	{
 		TextureInfo *ti = &g_textures[i];
-		if (ti->id != 0)
+		if (ti->id != 0 && ti->atlasPage == 0)
 			glDeleteTextures(1, &ti->id);
 	}
+	atlasDestroyTextures();
+	paletteCacheClear();
 
-	glDeleteProgram(g_shaderProgram);
-	glDeleteShader(g_fShader);
-	glDeleteShader(g_vShader);
+	if (g_paletteTexture != 0)
+	{
+		glDeleteTextures(1, &g_paletteTexture);
+		g_paletteTexture = 0;
+	}
+	if (g_lfbTexture != 0)
+	{
+		glDeleteTextures(1, &g_lfbTexture);
+		g_lfbTexture = 0;
+	}
 
+	glDeleteProgram(g_shaderProgram);
 	glDeleteProgram(g_shaderProgramDisp);
-	glDeleteShader(g_fShaderDisp);
-	glDeleteShader(g_vShaderDisp);
+
+	VirtualControls_Shutdown(); // Created again on next draw
 
 	SDL_GL_DeleteContext(g_glCtx);
 	g_glCtx = NULL;
 
-	g_trianglesCount = 0;
+	g_drawRunsCount = 0;
+	g_verticesCount = 0;
+	g_appliedStateValid = false;
+}
+
+static inline void bindTexture(GLuint id)
+{
+	GLStateBindTexture(id);
 }
 
 static void setTextureFiltering()
@@ -657,33 +962,120 @@ static void setTextureFiltering()
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 }
 
-static void uploadTexture(TextureInfo *ti)
+/* Uploads the bound texture, its storage is allocated again only when "ti" (if any) had different size or format */
+static void texImage(TextureInfo *ti, uint32_t size, GLenum internalFormat, GLenum format, GLenum type, const void *data, uint32_t bytes)
 {
+	const void *pixels = pixelUploadBegin(data, bytes);
+	if (ti && ti->storageSize == size && ti->storageFormat == internalFormat && ti->storageType == type)
+	{
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, size, size, format, type, pixels);
+	}
+	else
+	{
+		glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, size, size, 0, format, type, pixels);
+		if (ti)
+		{
+			ti->storageSize = size;
+			ti->storageFormat = internalFormat;
+			ti->storageType = type;
+		}
+	}
+	pixelUploadEnd();
+}
+
+/* Removes the texture from atlas, it will be allocated again on upload */
+static void releaseAtlasTexture(TextureInfo *ti)
+{
+	if (ti->atlasPage == 0)
+		return;
+
+	// Recorded triangles still need the region
+	if (ti->drawList == g_drawList)
+		submitDrawList(StatFlushTexture);
+
+	atlasFree(ti->atlasPage, ti->atlasNode);
+	ti->atlasPage = 0;
+	ti->id = 0;
+}
+
+static BOOL uploadAtlasTexture(TextureInfo *ti, const void *data)
+{
+	if (ti->atlasPage == 0)
+	{
+		uint16_t node, *pos = ti->atlasPos;
+		uint32_t page = atlasAlloc(ti->fmt, ti->size, &node, pos);
+		if (page == 0)
+			return false;
+
+		if (ti->id != 0)
+		{
+			// Texture was uploaded as separate GL texture before
+			glDeleteTextures(1, &ti->id);
+			GLStateTextureDeleted(ti->id);
+		}
+
+		ti->atlasPage = page;
+		ti->atlasNode = node;
+		ti->rect[0] = pos[0] * 0xFFFF / AtlasSize;
+		ti->rect[1] = pos[1] * 0xFFFF / AtlasSize;
+		ti->rect[2] = ti->size * 0xFFFF / AtlasSize;
+		ti->rect[3] = ti->size;
+	}
+
+	atlasUpload(ti->atlasPage, ti->atlasPos, ti->size, data);
+	ti->id = g_atlasPages[ti->atlasPage - 1]->id;
+	return true;
+}
+
+static void uploadTexture(TextureInfo *ti, const void *data)
+{
+	GLenum internalFormat, format, type;
+
+	StatsAdd(StatTextureUploads, 1);
+	StatsAdd(StatTextureBytes, ti->size * ti->size * (ti->fmt == GR_TEXFMT_P_8 ? 1 : 2));
+
+	if (textureAtlas && ti->fmt != GR_TEXFMT_P_8 && uploadAtlasTexture(ti, data))
+		return;
+
 	BOOL newTexture = (ti->id == 0);
+	BOOL paletteIndices = (ti->fmt == GR_TEXFMT_P_8 && gpuPaletteLookup);
+
+	memcpy(ti->rect, g_fullTexRect, sizeof ti->rect);
 
 	if (newTexture)
+	{
 		glGenTextures(1, &ti->id);
+		ti->storageSize = 0;
+	}
 
-	if (newTexture || ti->fmt != GR_TEXFMT_P_8)
-		glBindTexture(GL_TEXTURE_2D, ti->id);
+	if (newTexture || ti->fmt != GR_TEXFMT_P_8 || paletteIndices)
+		bindTexture(ti->id);
 
-	if (newTexture)
+	if (paletteIndices)
+	{
+		/* Indices must not be filtered, the shader does bilinear filtering of palette colors */
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		ti->rect[3] = ti->size;
+	}
+	else if (newTexture)
+	{
 		setTextureFiltering();
+	}
 
-	switch (ti->fmt)
+	if (textureFormat(ti->fmt, &internalFormat, &format, &type))
 	{
-		case GR_TEXFMT_P_8:
-			ti->palette = NULL;
-			break;
-		case GR_TEXFMT_RGB_565:
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, ti->size, ti->size, 0, GL_RGB, GL_UNSIGNED_SHORT_5_6_5, ti->data);
-			break;
-		case GR_TEXFMT_ARGB_1555:
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, ti->size, ti->size, 0, GL_RGBA, GL_UNSIGNED_SHORT_5_5_5_1, ti->data);
-			break;
-		case GR_TEXFMT_ARGB_4444:
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, ti->size, ti->size, 0, GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4, ti->data);
-			break;
+		texImage(ti, ti->size, internalFormat, format, type, data, ti->size * ti->size * 2);
+	}
+	else
+	{
+		if (paletteIndices)
+			texImage(ti, ti->size, GL_LUMINANCE, GL_LUMINANCE, GL_UNSIGNED_BYTE, data, ti->size * ti->size);
+		else
+			paletteCacheRemoveSlot(ti - g_textures);
+		ti->palette = NULL;
 	}
 }
 
@@ -703,60 +1095,313 @@ static void recreateContext()
 			continue;
 
 		ti->id = 0;
-		uploadTexture(ti);
+		if (ti->data) // No shadow copy, texture is lost until the game downloads it again
+			uploadTexture(ti, ti->data);
 	}
 
-	// Restore config
+	// Restore config, game state is applied with next draw
 	{
-		glDepthMask(g_depthMask);
-		glBlendFunc(GL_SRC_ALPHA, g_blendFuncDFactor);
+		GLStateUseProgram(g_shaderProgramDisp);
+		glUniform1f(g_uGammaLocDisp, g_gammaValue);
+	}
+}
 
-		glUseProgram(g_shaderProgram);
-		glUniform1f(g_uTextureEnabledLoc, g_textureEnabled);
-		glUniform1f(g_uFogEnabledLoc, g_fogEnabled);
-		glUniform3f(g_uFogColorLoc, g_fogColor[0], g_fogColor[1], g_fogColor[2]);
-		glUseProgram(0);
+static void setClipWindow(const uint16_t clip[4])
+{
+	float ratio = g_framebufferHeight / 480.0f;
 
-		glUseProgram(g_shaderProgramDisp);
-		glUniform1f(g_uGammaLocDisp, g_gammaValue);
-		glUseProgram(0);
+	int32_t scaledMinX = clip[0] * ratio;
+	int32_t scaledMinY = clip[1] * ratio;
+	int32_t scaledMaxX = clip[2] * ratio + 0.5f;
+	int32_t scaledMaxY = clip[3] * ratio + 0.5f;
+
+	g_clipViewport[0] = scaledMinX;
+	g_clipViewport[1] = g_framebufferHeight - scaledMaxY;
+	g_clipViewport[2] = scaledMaxX - scaledMinX;
+	g_clipViewport[3] = scaledMaxY - scaledMinY;
+
+	glLineWidth(2.0f * ratio);
+
+	matrixLoadIdentity();
+	matrixOrtho(scaledMinX, scaledMaxX, scaledMaxY, scaledMinY, Near, Far);
+	matrixScale2(ratio, ratio);
+	glUniformMatrix4fv(g_uMatrixLoc, 1, GL_FALSE, g_matrix);
+}
+
+/*
+ * Sets only the state which differs from the GL context, game program must be in use.
+ * Uniforms are compared with the last applied state, the rest is skipped by "GLState".
+ */
+static void applyDrawState(const DrawState *state)
+{
+	const BOOL all = !g_appliedStateValid;
+	DrawState *applied = &g_appliedState;
+
+	GLStateBindTexture(state->texture);
+	GLStateBlendFunc(GL_SRC_ALPHA, state->blendFuncDFactor);
+	GLStateDepthMask(state->depthMask);
+	if (all || applied->textureEnabled != state->textureEnabled)
+		glUniform1f(g_uTextureEnabledLoc, state->textureEnabled);
+	if (all || applied->paletted != state->paletted)
+		glUniform1f(g_uPalettedLoc, state->paletted);
+	if (all || applied->fogEnabled != state->fogEnabled)
+		glUniform1f(g_uFogEnabledLoc, state->fogEnabled);
+	if (all || applied->fogColor != state->fogColor)
+	{
+		float r, g, b;
+		convertColor(state->fogColor, NULL, &r, &g, &b, NULL);
+		glUniform3f(g_uFogColorLoc, r, g, b);
 	}
+	if (all || memcmp(applied->clip, state->clip, sizeof state->clip) != 0)
+		setClipWindow(state->clip);
+	GLStateViewport(g_clipViewport[0], g_clipViewport[1], g_clipViewport[2], g_clipViewport[3]);
+	GLStateScissor(g_clipViewport[0], g_clipViewport[1], g_clipViewport[2], g_clipViewport[3]);
+
+	*applied = *state;
+	g_appliedStateValid = true;
+}
+
+static inline BOOL boundsOverlap(const float a[4], const float b[4])
+{
+	return (a[0] <= b[2] && b[0] <= a[2] && a[1] <= b[3] && b[1] <= a[3]);
+}
+static inline void boundsUnion(float a[4], const float b[4])
+{
+	a[0] = SDL_min(a[0], b[0]);
+	a[1] = SDL_min(a[1], b[1]);
+	a[2] = SDL_max(a[2], b[2]);
+	a[3] = SDL_max(a[3], b[3]);
 }
 
-static inline void drawTriangles()
+/* Depth test and blending are off, so only runs which don't overlap on screen can be reordered */
+static void submitDrawList(uint32_t reason)
 {
-	if (g_trianglesCount == 0)
+	uint32_t i, groupsCount = 0, count = 0;
+
+	if (g_drawRunsCount == 0)
 		return;
 
-	glDrawArrays(GL_TRIANGLES, 0, g_trianglesCount * 3);
-	g_trianglesCount = 0;
+	StatsAdd(reason, 1);
+	StatsAdd(StatRuns, g_drawRunsCount);
+	dynResSpanBegin();
+
+	for (i = 0; i < g_drawRunsCount; ++i)
+	{
+		DrawRun *run = &g_drawRuns[i];
+		DrawGroup *group = NULL;
+		int32_t g, depth;
+
+		for (g = groupsCount - 1, depth = 0; g >= 0 && depth < MergeDepth; --g, ++depth)
+		{
+			if (g_drawGroups[g].lines == run->lines && memcmp(&g_drawGroups[g].state, &run->state, sizeof(DrawState)) == 0)
+			{
+				group = &g_drawGroups[g];
+				break;
+			}
+			if (boundsOverlap(g_drawGroups[g].bounds, run->bounds))
+				break;
+		}
+
+		run->next = -1;
+		if (group)
+		{
+			g_drawRuns[group->lastRun].next = i;
+			group->lastRun = i;
+			boundsUnion(group->bounds, run->bounds);
+		}
+		else
+		{
+			group = &g_drawGroups[groupsCount++];
+			group->state = run->state;
+			group->lines = run->lines;
+			memcpy(group->bounds, run->bounds, sizeof run->bounds);
+			group->firstRun = group->lastRun = i;
+		}
+	}
+
+	for (i = 0; i < groupsCount; ++i)
+	{
+		DrawGroup *group = &g_drawGroups[i];
+		int32_t r;
+
+		group->first = count;
+		for (r = group->firstRun; r >= 0; r = g_drawRuns[r].next)
+		{
+			memcpy(g_drawVertices + count, g_vertices + g_drawRuns[r].first, g_drawRuns[r].count * sizeof(Vertex));
+			count += g_drawRuns[r].count;
+		}
+		group->count = count - group->first;
+	}
+
+	StatsAdd(StatDrawCalls, groupsCount);
+
+	const uint32_t first = streamVertices(g_drawVertices, count);
+	for (i = 0; i < groupsCount; ++i)
+	{
+		const DrawGroup *group = &g_drawGroups[i];
+		applyDrawState(&group->state);
+		glDrawArrays(group->lines ? GL_LINES : GL_TRIANGLES, first + group->first, group->count);
+	}
+	dynResSpanEnd();
+
+	g_drawRunsCount = 0;
+	g_verticesCount = 0;
+	++g_drawList;
+}
+
+/* Adds converted vertices at the end of "g_vertices" to the draw list */
+static void recordVertices(uint32_t count, BOOL lines, const float bounds[4])
+{
+	// Continue the last run also when the state has been set back to the same values
+	DrawRun *run = (g_drawRunsCount > 0) ? &g_drawRuns[g_drawRunsCount - 1] : NULL;
+	if (!run || run->lines != lines || (g_drawStateChanged && memcmp(&run->state, &g_drawState, sizeof(DrawState)) != 0))
+	{
+		if (!run)
+			;
+		else if (run->state.texture != g_drawState.texture)
+			StatsAdd(StatRunBreakTexture, 1);
+		else if (run->state.blendFuncDFactor != g_drawState.blendFuncDFactor)
+			StatsAdd(StatRunBreakBlend, 1);
+		else if (memcmp(run->state.clip, g_drawState.clip, sizeof g_drawState.clip) != 0)
+			StatsAdd(StatRunBreakClip, 1);
+		else
+			StatsAdd(StatRunBreakOther, 1);
+
+		run = &g_drawRuns[g_drawRunsCount++];
+		run->state = g_drawState;
+		run->lines = lines;
+		memcpy(run->bounds, bounds, 4 * sizeof(float));
+		run->first = g_verticesCount;
+		run->count = 0;
+	}
+	g_drawStateChanged = false;
+	boundsUnion(run->bounds, bounds);
+	run->count += count;
+
+	g_verticesCount += count;
+}
+
+/* Draws the written rows over the triangles recorded so far */
+static void lfbComposite(const LfbStaging *lfb)
+{
+	int32_t first = -1, last = -1, y;
+
+	for (y = 0; y < 480; ++y)
+	{
+		if (lfbConvertRow(g_lfbTexels + y * 640, lfb, y))
+		{
+			if (first < 0)
+				first = y;
+			last = y;
+		}
+	}
+	if (first < 0)
+		return;
+
+	StatsAdd(StatLfbWrites, 1);
+
+	// Recorded triangles still need the old pixels
+	if (g_lfbDrawList == g_drawList)
+		submitDrawList(StatFlushTexture);
+
+	const uint32_t rows = last + 1 - first;
+	if (g_lfbTexture == 0)
+	{
+		glGenTextures(1, &g_lfbTexture);
+		bindTexture(g_lfbTexture);
+		setTextureFiltering();
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 640, 480, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	}
+	else
+	{
+		bindTexture(g_lfbTexture);
+	}
+	const void *pixels = pixelUploadBegin(g_lfbTexels + first * 640, rows * 640 * 4);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, 640, rows, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	pixelUploadEnd();
+
+	// Quad over the written rows, drawn with the game program the same way as textured triangles
+	const DrawState drawState = g_drawState;
+	const float t0 = first / 480.0f, t1 = (last + 1) / 480.0f;
+	float y0 = first, y1 = last + 1, s[4] = {0.0f, 1.0f, 0.0f, 1.0f}, t[4] = {t0, t0, t1, t1};
+	static const uint8_t corners[6] = {0, 1, 2, 2, 1, 3};
+	uint32_t i;
+
+	if (lfb->origin == GR_ORIGIN_LOWER_LEFT)
+	{
+		y0 = 480 - (last + 1);
+		y1 = 480 - first;
+		t[0] = t[1] = t1;
+		t[2] = t[3] = t0;
+	}
+
+	g_drawState.texture = g_lfbTexture;
+	g_drawState.textureEnabled = true;
+	g_drawState.fogEnabled = false;
+	g_drawState.paletted = 0;
+	g_drawState.clip[0] = 0;
+	g_drawState.clip[1] = 0;
+	g_drawState.clip[2] = 640;
+	g_drawState.clip[3] = 480;
+	g_drawStateChanged = true;
+
+	if (g_verticesCount + 6 > VertexBufferVertices || g_drawRunsCount == MaxDrawRuns)
+		submitDrawList(StatFlushFull);
+
+	const float bounds[4] = {0.0f, y0, 640.0f, y1};
+	Vertex *vertices = &g_vertices[g_verticesCount];
+	memset(vertices, 0, 6 * sizeof(Vertex));
+	for (i = 0; i < 6; ++i)
+	{
+		const uint32_t c = corners[i];
+		vertices[i].x = (c & 1) ? 640.0f : 0.0f;
+		vertices[i].y = (c & 2) ? y1 : y0;
+		vertices[i].z = 0.5f;
+		vertices[i].s = s[c];
+		vertices[i].t = t[c];
+		vertices[i].q = 1.0f;
+		memcpy(vertices[i].texRect, g_fullTexRect, sizeof vertices[i].texRect);
+		vertices[i].color.r = vertices[i].color.g = vertices[i].color.b = vertices[i].color.a = 0xFF;
+	}
+	recordVertices(6, false, bounds);
+	g_lfbDrawList = g_drawList;
+
+	g_drawState = drawState;
+	g_drawStateChanged = true;
 }
 
 /**/
 
 REALIGN STDCALL void grAlphaBlendFunction(GrAlphaBlendFnc_t rgb_sf, GrAlphaBlendFnc_t rgb_df, GrAlphaBlendFnc_t alpha_sf, GrAlphaBlendFnc_t alpha_df)
 {
-	drawTriangles();
+	if (renderThreadRecording())
+	{
+		recordCommand(CmdAlphaBlendFunction, 4, rgb_sf, rgb_df, alpha_sf, alpha_df);
+		return;
+	}
+
 	switch (rgb_df)
 	{
 		case GR_BLEND_ONE:
-			g_blendFuncDFactor = GL_ONE;
+			g_drawState.blendFuncDFactor = GL_ONE;
 			break;
 		case GR_BLEND_ONE_MINUS_SRC_ALPHA:
-			g_blendFuncDFactor = GL_ONE_MINUS_SRC_ALPHA;
+			g_drawState.blendFuncDFactor = GL_ONE_MINUS_SRC_ALPHA;
 			break;
 	}
-	glBlendFunc(GL_SRC_ALPHA, g_blendFuncDFactor);
+	g_drawStateChanged = true;
 // 	fprintf(stderr, "grAlphaBlendFunction: %d %d %d %d\n", rgb_sf, rgb_df, alpha_sf, alpha_df);
 }
 REALIGN STDCALL void grAlphaCombine(GrCombineFunction_t function, GrCombineFactor_t factor, GrCombineLocal_t local, GrCombineOther_t other, BOOL invert)
 {
-	drawTriangles();
-	if (other == GR_COMBINE_OTHER_TEXTURE)
-		g_textureEnabled = 1.0f;
-	else
-		g_textureEnabled = 0.0f;
-	glUniform1f(g_uTextureEnabledLoc, g_textureEnabled);
+	if (renderThreadRecording())
+	{
+		recordCommand(CmdAlphaCombine, 5, function, factor, local, other, invert);
+		return;
+	}
+
+	g_drawState.textureEnabled = (other == GR_COMBINE_OTHER_TEXTURE);
+	g_drawStateChanged = true;
 // 	fprintf(stderr, "grAlphaCombine: %d\n", (other == GR_COMBINE_OTHER_TEXTURE));
 }
 REALIGN STDCALL void grAlphaTestFunction(GrCmpFnc_t function)
@@ -769,35 +1414,35 @@ REALIGN STDCALL void grAlphaTestReferenceValue(GrAlpha_t value)
 }
 REALIGN STDCALL void grClipWindow(uint32_t minX, uint32_t minY, uint32_t maxX, uint32_t maxY)
 {
-	float ratio = g_framebufferHeight / 480.0f;
-
-	int32_t scaledMinX = minX * ratio;
-	int32_t scaledMinY = minY * ratio;
-	int32_t scaledMaxX = maxX * ratio + 0.5f;
-	int32_t scaledMaxY = maxY * ratio + 0.5f;
-
-// 	fprintf(stderr, "grClipWindow: %d %d %d %d [%d]\n", minX, minY, maxX, maxY, g_trianglesCount);
-
-	drawTriangles();
+	if (renderThreadRecording())
+	{
+		recordCommand(CmdClipWindow, 4, minX, minY, maxX, maxY);
+		return;
+	}
 
-	glViewport(scaledMinX, g_framebufferHeight - scaledMaxY, scaledMaxX - scaledMinX, scaledMaxY - scaledMinY);
-	glScissor (scaledMinX, g_framebufferHeight - scaledMaxY, scaledMaxX - scaledMinX, scaledMaxY - scaledMinY);
+// 	fprintf(stderr, "grClipWindow: %d %d %d %d [%d]\n", minX, minY, maxX, maxY, g_drawRunsCount);
 
-	glLineWidth(2.0f * ratio);
-
-	matrixLoadIdentity();
-	matrixOrtho(scaledMinX, scaledMaxX, scaledMaxY, scaledMinY, Near, Far);
-	matrixScale2(ratio, ratio);
-	glUniformMatrix4fv(g_uMatrixLoc, 1, GL_FALSE, g_matrix);
+	g_drawState.clip[0] = minX;
+	g_drawState.clip[1] = minY;
+	g_drawState.clip[2] = maxX;
+	g_drawState.clip[3] = maxY;
+	g_drawStateChanged = true;
 }
 REALIGN STDCALL void grBufferClear(GrColor_t color, GrAlpha_t alpha, uint16_t depth)
 {
+	if (renderThreadRecording())
+	{
+		recordCommand(CmdBufferClear, 3, color, alpha, depth);
+		return;
+	}
+
 	float r, g , b, a;
 	convertColor(color, &alpha, &r, &g, &b, &a);
 
-// 	fprintf(stderr, "grBufferClear: %X %X %X [%d]\n", color, alpha, depth, g_trianglesCount);
+// 	fprintf(stderr, "grBufferClear: %X %X %X [%d]\n", color, alpha, depth, g_drawRunsCount);
 
-	drawTriangles();
+	submitDrawList(StatFlushOther);
+	applyDrawState(&g_drawState); // Clear is limited by the scissor box
 
 	glClearColor(r, g, b, a);
 #ifdef GLES2
@@ -820,17 +1465,19 @@ REALIGN STDCALL void grChromakeyValue(GrColor_t value)
 }
 REALIGN STDCALL void grBufferSwap(int swap_interval)
 {
-// 	fprintf(stderr, "grBufferSwap: [%d]\n", g_trianglesCount);
-
-	drawTriangles();
+	if (renderThreadRecording())
+	{
+		recordCommand(CmdBufferSwap, 1, swap_interval);
+		renderThreadThrottle();
+		return;
+	}
 
-	useGameProgram(false);
+// 	fprintf(stderr, "grBufferSwap: [%d]\n", g_drawRunsCount);
 
-	GLint viewportSize[4] = {};
-	glGetIntegerv(GL_VIEWPORT, viewportSize);
+	submitDrawList(StatFlushSwap);
 
-	GLint scissorBox[4] = {};
-	glGetIntegerv(GL_SCISSOR_BOX, scissorBox);
+	useGameProgram(false);
+	dynResSpanBegin(); // Display pass, ended by "dynResFrameEnd()"
 
 	int32_t xOffset = 0, yOffset = 0;
 	int32_t visibleWidth = 0, visibleHeight = 0;
@@ -855,17 +1502,24 @@ REALIGN STDCALL void grBufferSwap(int swap_interval)
 
 	int32_t scaledMaxX = 640.0f * widthRatio  + 0.5f;
 	int32_t scaledMaxY = 480.0f * heightRatio + 0.5f;
-	glViewport(xOffset, winHeight - scaledMaxY - yOffset, scaledMaxX, scaledMaxY);
-	glScissor (xOffset, winHeight - scaledMaxY - yOffset, scaledMaxX, scaledMaxY);
+	GLStateViewport(xOffset, winHeight - scaledMaxY - yOffset, scaledMaxX, scaledMaxY);
+	GLStateScissor (xOffset, winHeight - scaledMaxY - yOffset, scaledMaxX, scaledMaxY);
 
-	glBindTexture(GL_TEXTURE_2D, g_framebufferTexture);
+	GLStateBindTexture(g_framebufferTexture);
 	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	glBindTexture(GL_TEXTURE_2D, 0);
 
 	// kofred- virtual gamepad code
 	VirtualControls_Draw();
 
+	if (statsMode & StatsOverlay)
+		StatsDrawOverlay(winWidth, winHeight, statsFillRect);
+
+	dynResFrameEnd();
+
+	const uint64_t swapStart = SDL_GetPerformanceCounter();
 	SDL_GL_SwapWindow(sdlWin);
+	if (statsMode)
+		StatsFrameEnd(SDL_GetPerformanceCounter() - swapStart);
 
 	if (needRecreateGl)
 	{
@@ -876,6 +1530,9 @@ REALIGN STDCALL void grBufferSwap(int swap_interval)
 
 	if (windowResized)
 	{
+		// Clip window depends on the framebuffer size
+		g_appliedStateValid = false;
+
 		createFrameBuffer();
 		useGameProgram(true);
 		grClipWindow(0, 0, 640, 480);
@@ -887,10 +1544,15 @@ REALIGN STDCALL void grBufferSwap(int swap_interval)
 	}
 	else
 	{
+		if (g_dynResChanged)
+		{
+			g_appliedStateValid = false;
+			createFrameBuffer();
+		}
 		useGameProgram(true);
-		glViewport(viewportSize[0], viewportSize[1], viewportSize[2], viewportSize[3]);
-		glScissor(scissorBox[0], scissorBox[1], scissorBox[2], scissorBox[3]);
 	}
+
+	dynResFrameBegin();
 }
 REALIGN STDCALL void grColorCombine(GrCombineFunction_t function, GrCombineFactor_t factor, GrCombineLocal_t local, GrCombineOther_t other, BOOL invert)
 {
@@ -916,11 +1578,15 @@ REALIGN STDCALL void grDepthBufferMode(GrDepthBufferMode_t mode)
 }
 REALIGN STDCALL void grDepthMask(BOOL mask)
 {
-	drawTriangles();
+	if (renderThreadRecording())
+	{
+		recordCommand(CmdDepthMask, 1, mask);
+		return;
+	}
 
-	g_depthMask = mask;
-	glDepthMask(g_depthMask);
-// 	fprintf(stderr, "grDepthMask: %d [%d]\n", mask, g_trianglesCount);
+	g_drawState.depthMask = mask;
+	g_drawStateChanged = true;
+// 	fprintf(stderr, "grDepthMask: %d [%d]\n", mask, g_drawRunsCount);
 }
 REALIGN STDCALL void grDitherMode(GrDitherMode_t mode)
 {
@@ -928,79 +1594,98 @@ REALIGN STDCALL void grDitherMode(GrDitherMode_t mode)
 }
 REALIGN STDCALL void grDrawTriangle(const GrVertex *a, const GrVertex *b, const GrVertex *c)
 {
-// 	fprintf(stderr, "grDrawTriangle\n");
-	const GrVertex *grVertices[3] = {a, b, c};
-	uint32_t i;
-	for (i = 0; i < 3; ++i)
+	if (renderThreadRecording())
 	{
-		const GrVertex *grVertex = grVertices[i];
+		GrVertex *vertices = (GrVertex *)commandBegin(CmdDrawTriangle, 3 * sizeof(GrVertex));
+		vertices[0] = *a;
+		vertices[1] = *b;
+		vertices[2] = *c;
+		commandEnd();
+		return;
+	}
 
-		g_colorValues[g_trianglesCount].vertex[i].r = grVertex->r;
-		g_colorValues[g_trianglesCount].vertex[i].g = grVertex->g;
-		g_colorValues[g_trianglesCount].vertex[i].b = grVertex->b;
-		g_colorValues[g_trianglesCount].vertex[i].a = grVertex->a;
+// 	fprintf(stderr, "grDrawTriangle\n");
+	const GrVertex *grVertices[3] = {a, b, c};
+	float bounds[4];
 
-		g_fogCoord[g_trianglesCount].vertex[i] = 255 - g_fogTable[(uint16_t)(1.0f / grVertex->oow)];
+	StatsAdd(StatTriangles, 1);
 
-		g_textureCoord[g_trianglesCount].vertex[i].s = grVertex->tmuvtx[0].sow / 256.0f;
-		g_textureCoord[g_trianglesCount].vertex[i].t = grVertex->tmuvtx[0].tow / 256.0f;
-		g_textureCoord[g_trianglesCount].vertex[i].q = grVertex->oow;
+	if (g_verticesCount + 3 > VertexBufferVertices || g_drawRunsCount == MaxDrawRuns)
+		submitDrawList(StatFlushFull);
 
-		g_vertices[g_trianglesCount].vertex[i].x = grVertex->x - VertexSnap;
-		g_vertices[g_trianglesCount].vertex[i].y = grVertex->y - VertexSnap;
-		g_vertices[g_trianglesCount].vertex[i].z = grVertex->oow;
-	}
-	if (++g_trianglesCount >= MaxTriangles)
-	{
-		drawTriangles();
-// 		fprintf(stderr, "Too many triangles!\n");
-	}
+	vertexConvert(&g_vertices[g_verticesCount], grVertices, 3, g_drawTexRect, g_fogTable, bounds);
+	recordVertices(3, false, bounds);
 }
 REALIGN STDCALL void grDrawLine(const GrVertex *a, const GrVertex *b)
 {
-//	fprintf(stderr, "grDrawLine: [%d]\n", g_trianglesCount);
-	drawTriangles();
+	if (renderThreadRecording())
+	{
+		GrVertex *vertices = (GrVertex *)commandBegin(CmdDrawLine, 2 * sizeof(GrVertex));
+		vertices[0] = *a;
+		vertices[1] = *b;
+		commandEnd();
+		return;
+	}
 
+//	fprintf(stderr, "grDrawLine: [%d]\n", g_drawRunsCount);
 	const GrVertex *grVertices[2] = {a, b};
-	uint32_t i;
-	for (i = 0; i < 2; ++i)
-	{
-		g_colorValues->vertex[i].r = grVertices[i]->r;
-		g_colorValues->vertex[i].g = grVertices[i]->g;
-		g_colorValues->vertex[i].b = grVertices[i]->b;
-		g_colorValues->vertex[i].a = grVertices[i]->a;
+	float bounds[4];
 
-		g_vertices->vertex[i].x = grVertices[i]->x - VertexSnap;
-		g_vertices->vertex[i].y = grVertices[i]->y - VertexSnap;
-		g_vertices->vertex[i].z = grVertices[i]->oow;
-	}
-	glDrawArrays(GL_LINES, 0, 2);
+	StatsAdd(StatLines, 1);
+
+	if (g_verticesCount + 2 > VertexBufferVertices || g_drawRunsCount == MaxDrawRuns)
+		submitDrawList(StatFlushFull);
+
+	vertexConvert(&g_vertices[g_verticesCount], grVertices, 2, g_drawTexRect, g_fogTable, bounds);
+
+	// Line width is 2 game pixels, see "setClipWindow()"
+	bounds[0] -= 1.0f;
+	bounds[1] -= 1.0f;
+	bounds[2] += 1.0f;
+	bounds[3] += 1.0f;
+	recordVertices(2, true, bounds);
 }
 REALIGN STDCALL void grFogColorValue(GrColor_t fogcolor)
 {
-	drawTriangles();
+	if (renderThreadRecording())
+	{
+		recordCommand(CmdFogColorValue, 1, fogcolor);
+		return;
+	}
 
-	convertColor(fogcolor, NULL, &g_fogColor[0], &g_fogColor[1], &g_fogColor[2], NULL);
-	glUniform3f(g_uFogColorLoc, g_fogColor[0], g_fogColor[1], g_fogColor[2]);
+	g_drawState.fogColor = fogcolor;
+	g_drawStateChanged = true;
 
-// 	fprintf(stderr, "grFogColorValue: 0x%.8X [%d]\n", fogcolor, g_trianglesCount);
+// 	fprintf(stderr, "grFogColorValue: 0x%.8X [%d]\n", fogcolor, g_drawRunsCount);
 }
 REALIGN STDCALL void grFogMode(GrFogMode_t mode)
 {
+	if (renderThreadRecording())
+	{
+		recordCommand(CmdFogMode, 1, mode);
+		return;
+	}
+
 	switch (mode)
 	{
 		case GR_FOG_DISABLE:
-			g_fogEnabled = 0.0f;
+			g_drawState.fogEnabled = false;
 			break;
 		case GR_FOG_WITH_TABLE:
-			g_fogEnabled = 1.0f;
+			g_drawState.fogEnabled = true;
 			break;
 	}
-	glUniform1f(g_uFogEnabledLoc, g_fogEnabled);
+	g_drawStateChanged = true;
 // 	fprintf(stderr, "grFogMode: %X\n", mode);
 }
 REALIGN STDCALL void grGammaCorrectionValue(float value)
 {
+	if (renderThreadRecording())
+	{
+		recordCommandData(CmdGammaCorrectionValue, &value, sizeof value);
+		return;
+	}
+
 	if (g_gammaValue == value)
 		return;
 
@@ -1012,32 +1697,50 @@ REALIGN STDCALL void grGammaCorrectionValue(float value)
 }
 REALIGN STDCALL void grGlideInit(void)
 {
+	texelConvertInit();
+	vertexConvertInit();
 // 	fprintf(stderr, "grGlideInit\n");
 }
 REALIGN STDCALL void grGlideShutdown(void)
 {
+	if (renderThreadRecording())
+	{
+		recordCommand(CmdGlideShutdown, 0);
+		renderThreadStop();
+		return;
+	}
+
 	destroyContext();
+	atlasDestroy();
+	memset(g_textures, 0, sizeof g_textures);
 	g_palette = NULL;
 
 // 	fprintf(stderr, "grGlideShutdown\n");
 }
 REALIGN STDCALL BOOL grLfbLock(GrLock_t type, GrBuffer_t buffer, GrLfbWriteMode_t writeMode, GrOriginLocation_t origin, BOOL pixelPipeline, GrLfbInfo_t *info)
 {
-	//TODO Remove this
 	memset(info, 0, sizeof(GrLfbInfo_t));
-	if (type == GR_LFB_WRITE_ONLY)
-	{
-		info->lfbPtr = g_lfb = (uint8_t *)malloc(640*480*2);
-		info->strideInBytes = 2;
-		return true;
-	}
-	return false;
+
+	// Framebuffer can't be read back
+	if (!(type & GR_LFB_WRITE_ONLY) || (buffer != GR_BUFFER_FRONTBUFFER && buffer != GR_BUFFER_BACKBUFFER))
+		return false;
+
+	// Pixels are recorded on unlock
+	return lfbLock(renderThreadRecording() ? &g_lfbRecord : &g_lfb, writeMode, origin, info);
 }
 REALIGN STDCALL BOOL grLfbUnlock(GrLock_t type, GrBuffer_t buffer)
 {
-	//TODO Remove this
-	free(g_lfb);
-	g_lfb = NULL;
+	if (renderThreadRecording())
+	{
+		if (g_lfbRecord.locked)
+			recordLfbCommand(buffer, &g_lfbRecord);
+		g_lfbRecord.locked = false;
+		return true;
+	}
+
+	if (g_lfb.locked)
+		lfbComposite(&g_lfb);
+	g_lfb.locked = false;
 	return true;
 }
 REALIGN STDCALL void grRenderBuffer(GrBuffer_t buffer)
@@ -1072,9 +1775,18 @@ REALIGN STDCALL void grSstWinClose(void)
 }
 REALIGN STDCALL BOOL grSstWinOpen(uint32_t hWnd, GrScreenResolution_t screen_resolution, GrScreenRefresh_t refresh_rate, GrColorFormat_t color_format, GrOriginLocation_t origin_location, int nColBuffers, int nAuxBuffers)
 {
+	// GL context is created on render thread
+	renderThreadStart();
+	if (renderThreadRecording())
+	{
+		recordCommand(CmdSstWinOpen, 0);
+		return true;
+	}
+
 	createContext();
 	createFrameBuffer();
 	useGameProgram(true);
+	dynResFrameBegin();
 
 	handleDpr();
 
@@ -1111,50 +1823,82 @@ REALIGN STDCALL void grTexCombineFunction(GrChipID_t tmu, GrTextureCombineFnc_t
 }
 REALIGN STDCALL void grTexDownloadMipMap(GrChipID_t tmu, uint32_t startAddress, uint32_t evenOdd, GrTexInfo *info)
 {
+	if (renderThreadRecording())
+	{
+		recordTexCommand(CmdTexDownloadMipMap, tmu, startAddress, evenOdd, info, info->data, grTexCalcMemRequired(info->smallLod, info->largeLod, info->aspectRatio, info->format));
+		return;
+	}
+
 	TextureInfo *ti = &g_textures[startAddress >> 2];
-	ti->data = &g_textureMem[startAddress];
+
+	if (textureAtlas)
+	{
+		// Free also all atlas regions of textures which are overwritten in Glide memory
+		const uint32_t endAddress = SDL_min(startAddress + grTexCalcMemRequired(info->smallLod, info->largeLod, info->aspectRatio, info->format), TextureMem);
+		uint32_t address;
+		for (address = startAddress; address < endAddress; address += 4)
+			releaseAtlasTexture(&g_textures[address >> 2]);
+	}
+
 	ti->palette = NULL;
 	ti->fmt = info->format;
 	ti->size = 256 >> info->largeLod;
 
-	uint16_t *dataIn  = (uint16_t *)info->data;
-	uint16_t *dataOut = (uint16_t *)ti->data;
-
-	drawTriangles();
+	// Recorded triangles still need the old texture
+	if (ti->drawList == g_drawList)
+		submitDrawList(StatFlushTexture);
 
-	// ARGB -> RGBA conversion or copy
-	uint32_t sqrSize = ti->size * ti->size, i;
-	switch (ti->fmt)
+	// Palette indices are always needed for palette changes
+	if (ti->fmt == GR_TEXFMT_P_8 || textureShadowCopy)
 	{
-		case GR_TEXFMT_ARGB_1555:
+		uint16_t *dataIn  = (uint16_t *)info->data;
+		uint16_t *dataOut = (uint16_t *)&g_textureMem[startAddress];
+		uint32_t sqrSize = ti->size * ti->size;
+
+		// ARGB -> RGBA conversion or copy
+		switch (ti->fmt)
 		{
-			for (i = 0; i < sqrSize; ++i)
-			{
-				uint16_t value = dataIn[i];
-				dataOut[i] = (value << 1) | (value >> 15);
-			}
-			break;
+#ifdef GLES2
+			case GR_TEXFMT_ARGB_1555:
+				texelRotate16(dataOut, dataIn, sqrSize, 1);
+				break;
+			case GR_TEXFMT_ARGB_4444:
+				texelRotate16(dataOut, dataIn, sqrSize, 4);
+				break;
+#endif
+			default:
+				memcpy(dataOut, dataIn, sqrSize * (ti->fmt == GR_TEXFMT_P_8 ? 1 : 2));
+				break;
 		}
-		case GR_TEXFMT_ARGB_4444:
-			for (i = 0; i < sqrSize; ++i)
-			{
-				uint16_t value = dataIn[i];
-				dataOut[i] = (value << 4) | (value >> 12);
-			}
-			break;
-		default:
-			memcpy(dataOut, dataIn, ti->size * ti->size * (ti->fmt == GR_TEXFMT_P_8 ? 1 : 2));
-			break;
+
+		ti->data = dataOut;
+	}
+	else
+	{
+		ti->data = NULL;
 	}
 
-	uploadTexture(ti);
+	uploadTexture(ti, ti->data ? ti->data : info->data);
 
 //	fprintf(stderr, "grTexDownloadMipMap: 0x%.8X %d %u %u\n", startAddress, ti->fmt, ti->size, ti->id);
 }
 REALIGN STDCALL void grTexDownloadTable(GrChipID_t tmu, GrTexTable_t type, void *data)
 {
+	if (renderThreadRecording())
+	{
+		if (type == GR_TEXTABLE_PALETTE)
+			recordTexCommand(CmdTexDownloadTable, tmu, type, 0, NULL, data, 256 * sizeof(uint32_t));
+		return;
+	}
+
 	if (type == GR_TEXTABLE_PALETTE)
+	{
 		g_palette = (uint32_t *)data;
+		g_paletteChanged = true;
+		texelSwapRB(g_rgbaPalette, g_palette, 256); // BGRA -> RGBA
+		if (paletteCacheSize > 0 && !gpuPaletteLookup)
+			g_paletteHash = paletteCacheHash(g_palette);
+	}
 }
 REALIGN STDCALL void grTexFilterMode(GrChipID_t tmu, GrTextureFilterMode_t minfilter_mode, GrTextureFilterMode_t magfilter_mode)
 {
@@ -1175,22 +1919,66 @@ REALIGN STDCALL void grTexMipMapMode(GrChipID_t tmu, GrMipMapMode_t mode, BOOL l
 }
 REALIGN STDCALL void grTexSource(GrChipID_t tmu, uint32_t startAddress, uint32_t evenOdd, GrTexInfo *info)
 {
+	if (renderThreadRecording())
+	{
+		recordTexCommand(CmdTexSource, tmu, startAddress, evenOdd, info, NULL, 0);
+		return;
+	}
+
 	TextureInfo *ti = &g_textures[startAddress >> 2];
-	drawTriangles();
-	glBindTexture(GL_TEXTURE_2D, ti->id);
-	if (info->format == GR_TEXFMT_P_8 && g_palette && ti->palette != g_palette)
+	GLuint id = ti->id;
+	uint8_t paletted = 0;
+	if (info->format == GR_TEXFMT_P_8 && g_paletteTexture != 0)
 	{
+		if (g_palette && g_paletteChanged)
+		{
+			if (g_paletteDrawList == g_drawList)
+				submitDrawList(StatFlushTexture);
+			activeTexture(GL_TEXTURE1);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 256, 1, GL_RGBA, GL_UNSIGNED_BYTE, g_rgbaPalette);
+			StatsAdd(StatPaletteUploads, 1);
+			activeTexture(GL_TEXTURE0);
+			g_paletteChanged = false;
+		}
+		g_paletteDrawList = g_drawList;
+		paletted = linearFiltering ? 2 : 1;
+	}
+	else if (info->format == GR_TEXFMT_P_8 && g_palette && paletteCacheSize > 0)
+	{
+		id = paletteCacheFind(startAddress >> 2, g_paletteHash);
+		if (id == 0)
+		{
+			uint32_t size = 256 >> info->largeLod;
+			texelExpandPalette(g_tmpTexture, ti->data, g_rgbaPalette, size * size);
+			StatsAdd(StatPaletteExpansions, 1);
+			id = paletteCacheAdd(startAddress >> 2, g_paletteHash, size * size * 4);
+			bindTexture(id);
+			setTextureFiltering();
+			texImage(NULL, size, GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE, g_tmpTexture, size * size * 4);
+		}
+	}
+	else if (info->format == GR_TEXFMT_P_8 && g_palette && ti->palette != g_palette)
+	{
+		if (ti->drawList == g_drawList)
+			submitDrawList(StatFlushTexture);
+		bindTexture(ti->id);
+
 		// Update only when palette or texture changes (let's assume every palette has different pointer)
 		// When texture changes, palette is NULL
-		uint8_t *data = ti->data;
 		uint32_t size = 256 >> info->largeLod;
-		uint32_t sqrSize = size * size, i;
-		for (i = 0; i < sqrSize; ++i)
-		{
-			uint32_t value = g_palette[data[i]];
-			g_tmpTexture[i] = ((value >> 16) & 0x000000FF) | ((value << 16) & 0x00FF0000) | (value & 0xFF00FF00);
-		}
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, g_tmpTexture);
+		texelExpandPalette(g_tmpTexture, ti->data, g_rgbaPalette, size * size);
+		StatsAdd(StatPaletteExpansions, 1);
+		texImage(ti, size, GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE, g_tmpTexture, size * size * 4);
 		ti->palette = g_palette;
 	}
+	ti->drawList = g_drawList;
+	memcpy(g_drawTexRect, ti->rect, sizeof g_drawTexRect);
+	if (g_drawState.texture != id || g_drawState.paletted != paletted)
+	{
+		g_drawState.texture = id;
+		g_drawState.paletted = paletted;
+		g_drawStateChanged = true;
+	}
 }
+
+#include "GlideTrace.c"
@@ -0,0 +1,196 @@
+// SPDX-License-Identifier: MIT
+
+/* Included by OpenGL1.c and OpenGL2.c */
+
+/*
+ * Palette-expanded 8-bit textures, keyed by texture slot and palette content,
+ * so switching palettes on the same texture doesn't upload it again. Least
+ * recently used textures are deleted when the memory budget is exceeded.
+ *
+ * The backend can define "paletteCacheSerial()" which returns a non-zero
+ * value identifying textures that are still in use by pending draws and
+ * "paletteCacheFlush()" which submits them before such texture is deleted.
+ */
+
+#ifndef paletteCacheSerial
+# define paletteCacheSerial() 0
+#endif
+#ifndef paletteCacheFlush
+# define paletteCacheFlush()
+#endif
+
+#define PaletteCacheEntries  0x400
+#define PaletteCacheBuckets  0x800
+#define PaletteCacheNone     0xFFFF
+
+typedef struct
+{
+	uint32_t slot, hash, bytes, serial;
+	GLuint id;
+	uint16_t older, newer, bucketNext;
+} PaletteCacheEntry;
+static PaletteCacheEntry g_paletteCache[PaletteCacheEntries];
+static uint16_t g_paletteCacheBuckets[PaletteCacheBuckets];
+static uint16_t g_paletteCacheFree, g_paletteCacheOldest, g_paletteCacheNewest;
+static uint32_t g_paletteCacheBytes;
+static BOOL g_paletteCacheReady;
+
+extern int32_t paletteCacheSize;
+
+static uint32_t paletteCacheHash(const uint32_t *palette)
+{
+	uint32_t hash = 2166136261u, i;
+	for (i = 0; i < 256; ++i)
+		hash = (hash ^ palette[i]) * 16777619u;
+	return hash;
+}
+
+static inline uint32_t paletteCacheBucket(uint32_t slot, uint32_t hash)
+{
+	return ((slot * 2654435761u) ^ hash) & (PaletteCacheBuckets - 1);
+}
+
+static void paletteCacheInit()
+{
+	uint32_t i;
+	memset(g_paletteCacheBuckets, 0xFF, sizeof g_paletteCacheBuckets);
+	for (i = 0; i < PaletteCacheEntries; ++i)
+		g_paletteCache[i].newer = (i + 1 < PaletteCacheEntries) ? i + 1 : PaletteCacheNone;
+	g_paletteCacheFree = 0;
+	g_paletteCacheOldest = g_paletteCacheNewest = PaletteCacheNone;
+	g_paletteCacheBytes = 0;
+	g_paletteCacheReady = true;
+}
+
+static void paletteCacheUnlink(uint16_t idx)
+{
+	PaletteCacheEntry *entry = &g_paletteCache[idx];
+
+	if (entry->older != PaletteCacheNone)
+		g_paletteCache[entry->older].newer = entry->newer;
+	else
+		g_paletteCacheOldest = entry->newer;
+
+	if (entry->newer != PaletteCacheNone)
+		g_paletteCache[entry->newer].older = entry->older;
+	else
+		g_paletteCacheNewest = entry->older;
+}
+static void paletteCacheLinkNewest(uint16_t idx)
+{
+	PaletteCacheEntry *entry = &g_paletteCache[idx];
+
+	entry->older = g_paletteCacheNewest;
+	entry->newer = PaletteCacheNone;
+	if (g_paletteCacheNewest != PaletteCacheNone)
+		g_paletteCache[g_paletteCacheNewest].newer = idx;
+	else
+		g_paletteCacheOldest = idx;
+	g_paletteCacheNewest = idx;
+}
+
+static void paletteCacheDelete(uint16_t idx)
+{
+	PaletteCacheEntry *entry = &g_paletteCache[idx];
+	uint16_t *link = &g_paletteCacheBuckets[paletteCacheBucket(entry->slot, entry->hash)];
+
+	if (entry->serial != 0 && entry->serial == paletteCacheSerial())
+		paletteCacheFlush();
+
+	while (*link != idx)
+		link = &g_paletteCache[*link].bucketNext;
+	*link = entry->bucketNext;
+
+	paletteCacheUnlink(idx);
+	glDeleteTextures(1, &entry->id);
+	GLStateTextureDeleted(entry->id);
+	g_paletteCacheBytes -= entry->bytes;
+
+	entry->newer = g_paletteCacheFree;
+	g_paletteCacheFree = idx;
+}
+
+/* Returns cached texture or 0 */
+static GLuint paletteCacheFind(uint32_t slot, uint32_t hash)
+{
+	if (!g_paletteCacheReady)
+		return 0;
+
+	uint16_t idx = g_paletteCacheBuckets[paletteCacheBucket(slot, hash)];
+	while (idx != PaletteCacheNone)
+	{
+		PaletteCacheEntry *entry = &g_paletteCache[idx];
+		if (entry->slot == slot && entry->hash == hash)
+		{
+			if (idx != g_paletteCacheNewest)
+			{
+				paletteCacheUnlink(idx);
+				paletteCacheLinkNewest(idx);
+			}
+			entry->serial = paletteCacheSerial();
+			return entry->id;
+		}
+		idx = entry->bucketNext;
+	}
+	return 0;
+}
+
+/* Returns a new texture for the entry, caller must bind and fill it */
+static GLuint paletteCacheAdd(uint32_t slot, uint32_t hash, uint32_t bytes)
+{
+	const uint32_t budget = paletteCacheSize * 1024;
+
+	if (!g_paletteCacheReady)
+		paletteCacheInit();
+
+	while (g_paletteCacheOldest != PaletteCacheNone && (g_paletteCacheFree == PaletteCacheNone || g_paletteCacheBytes + bytes > budget))
+		paletteCacheDelete(g_paletteCacheOldest);
+
+	const uint16_t idx = g_paletteCacheFree;
+	PaletteCacheEntry *entry = &g_paletteCache[idx];
+	uint16_t *bucket = &g_paletteCacheBuckets[paletteCacheBucket(slot, hash)];
+
+	g_paletteCacheFree = entry->newer;
+
+	entry->slot = slot;
+	entry->hash = hash;
+	entry->bytes = bytes;
+	entry->serial = paletteCacheSerial();
+	glGenTextures(1, &entry->id);
+
+	entry->bucketNext = *bucket;
+	*bucket = idx;
+	paletteCacheLinkNewest(idx);
+	g_paletteCacheBytes += bytes;
+
+	return entry->id;
+}
+
+/* Texture data in the slot has changed */
+static void paletteCacheRemoveSlot(uint32_t slot)
+{
+	uint16_t idx = g_paletteCacheReady ? g_paletteCacheOldest : PaletteCacheNone;
+	while (idx != PaletteCacheNone)
+	{
+		const uint16_t newer = g_paletteCache[idx].newer;
+		if (g_paletteCache[idx].slot == slot)
+			paletteCacheDelete(idx);
+		idx = newer;
+	}
+}
+
+/* Deletes all textures, must be called while the context is still valid */
+static void paletteCacheClear()
+{
+	if (!g_paletteCacheReady)
+		return;
+
+	uint16_t idx = g_paletteCacheOldest;
+	while (idx != PaletteCacheNone)
+	{
+		glDeleteTextures(1, &g_paletteCache[idx].id);
+		GLStateTextureDeleted(g_paletteCache[idx].id);
+		idx = g_paletteCache[idx].newer;
+	}
+	paletteCacheInit();
+}
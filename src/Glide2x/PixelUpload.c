@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: MIT
+
+/* Included by OpenGL2.c */
+
+/*
+ * Texture and LFB pixels are copied into a ring of pixel unpack buffers, so
+ * "glTex(Sub)Image2D()" returns without waiting for the driver to copy them.
+ * A buffer is written again only after the fence inserted when it was left
+ * has been signaled, or after orphaning its storage when there are no fences.
+ * Without pixel buffer objects the pixels are passed directly.
+ */
+
+#ifndef GL_PIXEL_UNPACK_BUFFER
+# define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+
+#ifdef GLES2
+typedef PFNGLFENCESYNCAPPLEPROC PixelUploadFenceSync;
+typedef PFNGLCLIENTWAITSYNCAPPLEPROC PixelUploadClientWaitSync;
+typedef PFNGLDELETESYNCAPPLEPROC PixelUploadDeleteSync;
+# ifndef GL_SYNC_GPU_COMMANDS_COMPLETE
+#  define GL_SYNC_GPU_COMMANDS_COMPLETE GL_SYNC_GPU_COMMANDS_COMPLETE_APPLE
+# endif
+# ifndef GL_SYNC_FLUSH_COMMANDS_BIT
+#  define GL_SYNC_FLUSH_COMMANDS_BIT GL_SYNC_FLUSH_COMMANDS_BIT_APPLE
+# endif
+# ifndef GL_ALREADY_SIGNALED
+#  define GL_ALREADY_SIGNALED GL_ALREADY_SIGNALED_APPLE
+# endif
+# ifndef GL_CONDITION_SATISFIED
+#  define GL_CONDITION_SATISFIED GL_CONDITION_SATISFIED_APPLE
+# endif
+#else
+typedef PFNGLFENCESYNCPROC PixelUploadFenceSync;
+typedef PFNGLCLIENTWAITSYNCPROC PixelUploadClientWaitSync;
+typedef PFNGLDELETESYNCPROC PixelUploadDeleteSync;
+#endif
+
+#define PixelUploadBufferCount 4
+#define PixelUploadBufferSize  0x200000 // Whole LFB fits
+#define PixelUploadTimeout     1000000000ull // 1 s in ns, the buffer is orphaned after that
+
+static PixelUploadFenceSync pixelUploadFenceSync;
+static PixelUploadClientWaitSync pixelUploadClientWaitSync;
+static PixelUploadDeleteSync pixelUploadDeleteSync;
+
+extern BOOL pixelBufferUpload;
+
+static GLuint g_pixelUploadBuffers[PixelUploadBufferCount];
+static GLsync g_pixelUploadFences[PixelUploadBufferCount];
+static uint32_t g_pixelUploadIdx, g_pixelUploadPos;
+static BOOL g_pixelUploadEnabled, g_pixelUploadBound;
+
+/* Call with current context, after vertex buffers functions are loaded */
+static void pixelUploadInit()
+{
+	int32_t major = 0, minor = 0;
+	uint32_t i;
+
+	g_pixelUploadEnabled = false;
+	g_pixelUploadBound = false;
+	g_pixelUploadIdx = 0;
+	g_pixelUploadPos = 0;
+	memset(g_pixelUploadFences, 0, sizeof g_pixelUploadFences);
+	pixelUploadFenceSync = NULL;
+	pixelUploadClientWaitSync = NULL;
+	pixelUploadDeleteSync = NULL;
+
+	if (!pixelBufferUpload)
+		return;
+
+#ifdef GLES2
+	sscanf((const char *)glGetString(GL_VERSION), "OpenGL ES %d.%d", &major, &minor);
+	if (major < 3)
+		return;
+	if (!g_useMapBufferRange)
+	{
+		// Core since GLES 3.0, the extension is not always advertised
+		glMapBufferRange = SDL_GL_GetProcAddress("glMapBufferRange");
+		glUnmapBuffer = SDL_GL_GetProcAddress("glUnmapBuffer");
+		g_useMapBufferRange = (glMapBufferRange && glUnmapBuffer);
+	}
+	pixelUploadFenceSync = SDL_GL_GetProcAddress("glFenceSync");
+	pixelUploadClientWaitSync = SDL_GL_GetProcAddress("glClientWaitSync");
+	pixelUploadDeleteSync = SDL_GL_GetProcAddress("glDeleteSync");
+#else
+	sscanf((const char *)glGetString(GL_VERSION), "%d.%d", &major, &minor);
+	if (!glGenBuffers || !glBindBuffer || !glBufferData || !glBufferSubData || !glDeleteBuffers)
+		return;
+	if (major < 2 || (major == 2 && minor < 1))
+	{
+		if (!SDL_GL_ExtensionSupported("GL_ARB_pixel_buffer_object"))
+			return;
+	}
+	if (major > 3 || (major == 3 && minor >= 2) || SDL_GL_ExtensionSupported("GL_ARB_sync"))
+	{
+		pixelUploadFenceSync = SDL_GL_GetProcAddress("glFenceSync");
+		pixelUploadClientWaitSync = SDL_GL_GetProcAddress("glClientWaitSync");
+		pixelUploadDeleteSync = SDL_GL_GetProcAddress("glDeleteSync");
+	}
+#endif
+	if (!pixelUploadFenceSync || !pixelUploadClientWaitSync || !pixelUploadDeleteSync)
+	{
+		// Buffers are orphaned instead
+		pixelUploadFenceSync = NULL;
+		pixelUploadClientWaitSync = NULL;
+		pixelUploadDeleteSync = NULL;
+	}
+
+	glGenBuffers(PixelUploadBufferCount, g_pixelUploadBuffers);
+	for (i = 0; i < PixelUploadBufferCount; ++i)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, g_pixelUploadBuffers[i]);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, PixelUploadBufferSize, NULL, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	g_pixelUploadEnabled = true;
+}
+static void pixelUploadDestroy()
+{
+	uint32_t i;
+
+	if (!g_pixelUploadEnabled)
+		return;
+
+	for (i = 0; i < PixelUploadBufferCount; ++i)
+	{
+		if (g_pixelUploadFences[i])
+		{
+			pixelUploadDeleteSync(g_pixelUploadFences[i]);
+			g_pixelUploadFences[i] = NULL;
+		}
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glDeleteBuffers(PixelUploadBufferCount, g_pixelUploadBuffers);
+	memset(g_pixelUploadBuffers, 0, sizeof g_pixelUploadBuffers);
+
+	g_pixelUploadEnabled = false;
+	g_pixelUploadBound = false;
+}
+
+/* Leaves the current buffer and makes sure the next one isn't read by the GPU anymore */
+static void pixelUploadNextBuffer()
+{
+	const uint32_t idx = (g_pixelUploadIdx + 1) % PixelUploadBufferCount;
+	BOOL orphan = !pixelUploadFenceSync;
+
+	if (pixelUploadFenceSync)
+		g_pixelUploadFences[g_pixelUploadIdx] = pixelUploadFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	if (g_pixelUploadFences[idx])
+	{
+		GLenum result = pixelUploadClientWaitSync(g_pixelUploadFences[idx], 0, 0);
+		if (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED)
+		{
+			StatsAdd(StatUploadWaits, 1);
+			result = pixelUploadClientWaitSync(g_pixelUploadFences[idx], GL_SYNC_FLUSH_COMMANDS_BIT, PixelUploadTimeout);
+			orphan = (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED);
+		}
+		pixelUploadDeleteSync(g_pixelUploadFences[idx]);
+		g_pixelUploadFences[idx] = NULL;
+	}
+
+	g_pixelUploadIdx = idx;
+	g_pixelUploadPos = 0;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, g_pixelUploadBuffers[idx]);
+	if (orphan)
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, PixelUploadBufferSize, NULL, GL_STREAM_DRAW);
+}
+
+/* Returns "pixels" argument for "glTex(Sub)Image2D()", call "pixelUploadEnd()" after it */
+static const void *pixelUploadBegin(const void *data, uint32_t size)
+{
+	if (!g_pixelUploadEnabled || !data || size > PixelUploadBufferSize)
+		return data;
+
+	if (g_pixelUploadPos + size > PixelUploadBufferSize)
+		pixelUploadNextBuffer();
+	else
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, g_pixelUploadBuffers[g_pixelUploadIdx]);
+	g_pixelUploadBound = true;
+
+	const GLintptr offset = g_pixelUploadPos;
+	void *ptr = NULL;
+
+	// Range isn't used by any pending upload, see "pixelUploadNextBuffer()"
+	if (g_useMapBufferRange)
+		ptr = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, offset, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	if (ptr)
+	{
+		memcpy(ptr, data, size);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	}
+	else
+	{
+		glBufferSubData(GL_PIXEL_UNPACK_BUFFER, offset, size, data);
+	}
+
+	g_pixelUploadPos = (g_pixelUploadPos + size + 63) & ~63;
+	return (const uint8_t *)NULL + offset;
+}
+static inline void pixelUploadEnd()
+{
+	// Other calls with pixels pointer would read from the buffer
+	if (g_pixelUploadBound)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		g_pixelUploadBound = false;
+	}
+}
@@ -0,0 +1,287 @@
+// SPDX-License-Identifier: MIT
+
+/* Included by OpenGL2.c */
+
+/*
+ * Optional render thread. Glide calls from the game thread are recorded into
+ * a single-producer/single-consumer ring and the render thread, which owns
+ * the GL context, replays them by calling the same functions. The game can
+ * run at most "renderThreadFrames" frames ahead of the render thread.
+ *
+ * Commands are encoded as described in "GlideTrace.h". When "glideTrace" is
+ * set, every executed command is also written to the trace file. Without
+ * the render thread the ring is then used only for encoding, a recorded
+ * command is executed right away.
+ */
+
+#include "../GlideTrace.h"
+#include "../Scheduler.h"
+
+#include <SDL2/SDL_atomic.h>
+#include <SDL2/SDL_thread.h>
+#include <SDL2/SDL_mutex.h>
+#include <stdarg.h>
+
+#define CommandRingSize 0x800000 // Must be a power of two
+
+static uint8_t *g_commandRing;
+static uint32_t g_commandWrite, g_commandPending; // Producer only
+static SDL_atomic_t g_commandWritePos, g_commandReadPos;
+static SDL_atomic_t g_producerWaiting, g_consumerWaiting;
+static SDL_sem *g_spaceSem, *g_commandsSem, *g_framesSem;
+static SDL_Thread *g_renderThread;
+static SDL_threadID g_renderThreadId;
+static FILE *g_traceFile;
+static BOOL g_commandExecuting; // Only without render thread
+static LfbStaging g_lfbRecord; // Locked by game thread while recording
+
+extern int32_t renderThreadFrames;
+extern char *glideTrace;
+
+/* True when called from game thread and the call must be recorded */
+static inline BOOL renderThreadRecording()
+{
+	if (g_renderThread)
+		return SDL_ThreadID() != g_renderThreadId;
+	return g_commandRing && !g_commandExecuting;
+}
+
+/* Sleeps until "ready" is true, "waiting" makes the other side post the semaphore */
+static void renderThreadWait(SDL_atomic_t *waiting, SDL_sem *sem, BOOL (*ready)(uint32_t), uint32_t arg)
+{
+	while (!ready(arg))
+	{
+		SDL_AtomicSet(waiting, 1);
+		if (ready(arg) && SDL_AtomicCAS(waiting, 1, 0))
+			break;
+		SDL_SemWait(sem);
+	}
+}
+static inline void renderThreadWake(SDL_atomic_t *waiting, SDL_sem *sem)
+{
+	if (SDL_AtomicGet(waiting) && SDL_AtomicCAS(waiting, 1, 0))
+		SDL_SemPost(sem);
+}
+
+static BOOL commandRingHasSpace(uint32_t size)
+{
+	return g_commandWrite - (uint32_t)SDL_AtomicGet(&g_commandReadPos) + size <= CommandRingSize;
+}
+static BOOL commandRingHasCommands(uint32_t readPos)
+{
+	return (uint32_t)SDL_AtomicGet(&g_commandWritePos) != readPos;
+}
+
+static void traceOpen()
+{
+	const GlideTraceHeader header = {GlideTraceMagic, GlideTraceVersion, sizeof(GrVertex), sizeof(TexCommand)};
+	char *path = createSettingsDirPath("", glideTrace);
+	g_traceFile = fopen(path, "wb");
+	if (g_traceFile && fwrite(&header, sizeof header, 1, g_traceFile) != 1)
+	{
+		fclose(g_traceFile);
+		g_traceFile = NULL;
+	}
+	if (!g_traceFile)
+		fprintf(stderr, "Can't create Glide trace: %s\n", path);
+	free(path);
+}
+static void traceClose()
+{
+	if (!g_traceFile)
+		return;
+	fclose(g_traceFile);
+	g_traceFile = NULL;
+}
+
+static void commandExecute(const CommandHeader *header)
+{
+	if (g_traceFile)
+	{
+		fwrite(header, header->size, 1, g_traceFile);
+		if (header->cmd == CmdBufferSwap)
+			fflush(g_traceFile); // Usable when the game is killed
+	}
+	GlideTraceExecute(header);
+}
+
+/* Returns space for "size" bytes of arguments, the command is visible after "commandEnd()" */
+static void *commandBegin(uint32_t cmd, uint32_t size)
+{
+	const uint32_t total = (sizeof(CommandHeader) + size + CommandAlignment - 1) & ~(CommandAlignment - 1);
+	uint32_t offset = g_commandWrite & (CommandRingSize - 1);
+	CommandHeader *header;
+
+	if (offset + total > CommandRingSize)
+	{
+		const uint32_t padding = CommandRingSize - offset;
+		renderThreadWait(&g_producerWaiting, g_spaceSem, commandRingHasSpace, padding + total);
+
+		header = (CommandHeader *)(g_commandRing + offset);
+		header->cmd = CmdWrap;
+		header->size = padding;
+		g_commandWrite += padding;
+		offset = 0;
+	}
+	else
+	{
+		renderThreadWait(&g_producerWaiting, g_spaceSem, commandRingHasSpace, total);
+	}
+
+	header = (CommandHeader *)(g_commandRing + offset);
+	header->cmd = cmd;
+	header->size = total;
+	g_commandPending = total;
+	return header + 1;
+}
+static void commandEnd()
+{
+	const CommandHeader *header = (const CommandHeader *)(g_commandRing + (g_commandWrite & (CommandRingSize - 1)));
+
+	g_commandWrite += g_commandPending;
+	g_commandPending = 0;
+
+	if (!g_renderThread)
+	{
+		g_commandExecuting = true;
+		commandExecute(header);
+		g_commandExecuting = false;
+		SDL_AtomicSet(&g_commandReadPos, g_commandWrite);
+		return;
+	}
+
+	SDL_AtomicSet(&g_commandWritePos, g_commandWrite);
+	renderThreadWake(&g_consumerWaiting, g_commandsSem);
+}
+
+/* Records a command with "count" integer arguments */
+static void recordCommand(uint32_t cmd, uint32_t count, ...)
+{
+	uint32_t *args = (uint32_t *)commandBegin(cmd, count * sizeof(uint32_t)), i;
+	va_list ap;
+	va_start(ap, count);
+	for (i = 0; i < count; ++i)
+		args[i] = va_arg(ap, uint32_t);
+	va_end(ap);
+	commandEnd();
+}
+static void recordCommandData(uint32_t cmd, const void *data, uint32_t size)
+{
+	memcpy(commandBegin(cmd, size), data, size);
+	commandEnd();
+}
+static void recordTexCommand(uint32_t cmd, uint32_t tmu, uint32_t startAddress, uint32_t evenOdd, const GrTexInfo *info, const void *data, uint32_t size)
+{
+	TexCommand *tex = (TexCommand *)commandBegin(cmd, sizeof(TexCommand) + size);
+	tex->tmu = tmu;
+	tex->startAddress = startAddress;
+	tex->evenOdd = evenOdd;
+	if (info)
+		tex->info = *info;
+	if (size > 0)
+		memcpy(tex + 1, data, size);
+	commandEnd();
+}
+static void recordLfbCommand(uint32_t buffer, const LfbStaging *lfb)
+{
+	const uint32_t stride = 640 * lfbBytesPerPixel(lfb->writeMode);
+	LfbCommand *cmd = (LfbCommand *)commandBegin(CmdLfbUnlock, sizeof(LfbCommand) + 480 * stride);
+	cmd->buffer = buffer;
+	cmd->writeMode = lfb->writeMode;
+	cmd->origin = lfb->origin;
+	cmd->strideInBytes = stride;
+	memcpy(cmd + 1, lfb->pixels, 480 * stride);
+	commandEnd();
+}
+
+static int renderThreadMain(void *userdata)
+{
+	uint32_t readPos = 0;
+	BOOL running = true;
+
+	g_renderThreadId = SDL_ThreadID();
+	SchedulerSetRole(SchedulerRender);
+
+	while (running)
+	{
+		renderThreadWait(&g_consumerWaiting, g_commandsSem, commandRingHasCommands, readPos);
+
+		const CommandHeader *header = (const CommandHeader *)(g_commandRing + (readPos & (CommandRingSize - 1)));
+		if (header->cmd == CmdGlideShutdown)
+			running = false;
+		if (header->cmd != CmdWrap)
+			commandExecute(header);
+		if (header->cmd == CmdBufferSwap)
+			SDL_SemPost(g_framesSem);
+
+		readPos += header->size;
+		SDL_AtomicSet(&g_commandReadPos, readPos);
+		renderThreadWake(&g_producerWaiting, g_spaceSem);
+	}
+
+	return 0;
+}
+
+static void renderThreadStart()
+{
+	if (g_commandRing)
+		return;
+
+	if (glideTrace)
+		traceOpen();
+	if (renderThreadFrames <= 0 && !g_traceFile)
+		return;
+
+	g_commandRing = (uint8_t *)malloc(CommandRingSize);
+	g_commandWrite = 0;
+	SDL_AtomicSet(&g_commandWritePos, 0);
+	SDL_AtomicSet(&g_commandReadPos, 0);
+	SDL_AtomicSet(&g_producerWaiting, 0);
+	SDL_AtomicSet(&g_consumerWaiting, 0);
+	if (renderThreadFrames <= 0)
+		return;
+
+	g_spaceSem = SDL_CreateSemaphore(0);
+	g_commandsSem = SDL_CreateSemaphore(0);
+	g_framesSem = SDL_CreateSemaphore(renderThreadFrames);
+
+	g_renderThread = SDL_CreateThread(renderThreadMain, "Render", NULL);
+	if (!g_renderThread)
+	{
+		fprintf(stderr, "Can't create render thread: %s\n", SDL_GetError());
+		SDL_DestroySemaphore(g_framesSem);
+		SDL_DestroySemaphore(g_commandsSem);
+		SDL_DestroySemaphore(g_spaceSem);
+		renderThreadFrames = 0;
+		if (!g_traceFile)
+		{
+			free(g_commandRing);
+			g_commandRing = NULL;
+		}
+		return;
+	}
+	g_renderThreadId = SDL_GetThreadID(g_renderThread);
+}
+/* Must be called after recording "CmdGlideShutdown" */
+static void renderThreadStop()
+{
+	if (g_renderThread)
+	{
+		SDL_WaitThread(g_renderThread, NULL);
+		g_renderThread = NULL;
+
+		SDL_DestroySemaphore(g_framesSem);
+		SDL_DestroySemaphore(g_commandsSem);
+		SDL_DestroySemaphore(g_spaceSem);
+	}
+	free(g_commandRing);
+	g_commandRing = NULL;
+	traceClose();
+}
+
+/* Limits how many frames the game can be ahead of the render thread */
+static inline void renderThreadThrottle()
+{
+	if (g_renderThread)
+		SDL_SemWait(g_framesSem);
+}
@@ -0,0 +1,243 @@
+// SPDX-License-Identifier: MIT
+
+/* Included by OpenGL2.c */
+
+#include "../ShaderCache.h"
+
+/*
+ * Program binaries are stored with "glGetProgramBinary()", one file per
+ * program. A file is valid only for the driver (vendor, renderer and version
+ * strings) and the sources it was linked from. Otherwise, or when the driver
+ * rejects the binary, the program is compiled and the file is written again.
+ */
+
+#ifndef GL_PROGRAM_BINARY_LENGTH
+# define GL_PROGRAM_BINARY_LENGTH 0x8741
+#endif
+#ifndef GL_NUM_PROGRAM_BINARY_FORMATS
+# define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+# define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#endif
+
+#define ShaderCacheMagic   SDL_FOURCC('N', 'S', 'B', '1')
+#define ShaderCacheMaxSize (4 << 20)
+
+typedef struct
+{
+	uint64_t key;
+	uint32_t magic;
+	uint32_t format;
+	uint32_t size;
+	uint32_t reserved;
+} ShaderCacheHeader;
+
+#ifdef GLES2
+static PFNGLGETPROGRAMBINARYOESPROC shaderCacheGetProgramBinary;
+static PFNGLPROGRAMBINARYOESPROC shaderCacheProgramBinary;
+static PFNGLPROGRAMPARAMETERIEXTPROC shaderCacheProgramParameteri;
+#else
+static PFNGLGETPROGRAMBINARYPROC shaderCacheGetProgramBinary;
+static PFNGLPROGRAMBINARYPROC shaderCacheProgramBinary;
+static PFNGLPROGRAMPARAMETERIPROC shaderCacheProgramParameteri;
+#endif
+
+extern BOOL shaderCache;
+
+static BOOL g_shaderCacheEnabled;
+static uint64_t g_shaderCacheDriverKey;
+
+static uint64_t shaderCacheHash(uint64_t hash, const char *str)
+{
+	// Including the terminator, so concatenated strings differ
+	do
+		hash = (hash ^ (uint8_t)*str) * 1099511628211ull;
+	while (*str++);
+	return hash;
+}
+static inline const char *shaderCacheGetString(GLenum name)
+{
+	const char *str = (const char *)glGetString(name);
+	return str ? str : "";
+}
+
+/* Call with current context */
+static void shaderCacheInit()
+{
+	int32_t major = 0, minor = 0;
+	GLint formats = 0;
+
+	g_shaderCacheEnabled = false;
+	shaderCacheGetProgramBinary = NULL;
+	shaderCacheProgramBinary = NULL;
+	shaderCacheProgramParameteri = NULL;
+
+	if (!shaderCache)
+		return;
+
+#ifdef GLES2
+	sscanf(shaderCacheGetString(GL_VERSION), "OpenGL ES %d.%d", &major, &minor);
+	if (major >= 3)
+	{
+		shaderCacheGetProgramBinary = SDL_GL_GetProcAddress("glGetProgramBinary");
+		shaderCacheProgramBinary = SDL_GL_GetProcAddress("glProgramBinary");
+		shaderCacheProgramParameteri = SDL_GL_GetProcAddress("glProgramParameteri");
+	}
+	else if (SDL_GL_ExtensionSupported("GL_OES_get_program_binary"))
+	{
+		// Binaries are always retrievable
+		shaderCacheGetProgramBinary = SDL_GL_GetProcAddress("glGetProgramBinaryOES");
+		shaderCacheProgramBinary = SDL_GL_GetProcAddress("glProgramBinaryOES");
+	}
+#else
+	sscanf(shaderCacheGetString(GL_VERSION), "%d.%d", &major, &minor);
+	if (major > 4 || (major == 4 && minor >= 1) || SDL_GL_ExtensionSupported("GL_ARB_get_program_binary"))
+	{
+		shaderCacheGetProgramBinary = SDL_GL_GetProcAddress("glGetProgramBinary");
+		shaderCacheProgramBinary = SDL_GL_GetProcAddress("glProgramBinary");
+		shaderCacheProgramParameteri = SDL_GL_GetProcAddress("glProgramParameteri");
+	}
+#endif
+	if (!shaderCacheGetProgramBinary || !shaderCacheProgramBinary)
+		return;
+
+	// Some drivers expose the functions without any format
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	if (formats <= 0)
+		return;
+
+	g_shaderCacheDriverKey = shaderCacheHash(14695981039346656037ull, shaderCacheGetString(GL_VENDOR));
+	g_shaderCacheDriverKey = shaderCacheHash(g_shaderCacheDriverKey, shaderCacheGetString(GL_RENDERER));
+	g_shaderCacheDriverKey = shaderCacheHash(g_shaderCacheDriverKey, shaderCacheGetString(GL_VERSION));
+	g_shaderCacheEnabled = true;
+}
+
+static GLuint shaderCacheLoad(const char *path, uint64_t key)
+{
+	ShaderCacheHeader header;
+	GLuint program = 0;
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return 0;
+	if (fread(&header, sizeof header, 1, f) == 1 && header.magic == ShaderCacheMagic && header.key == key && header.size > 0 && header.size <= ShaderCacheMaxSize)
+	{
+		void *binary = malloc(header.size);
+		if (fread(binary, header.size, 1, f) == 1)
+		{
+			GLint status = 0;
+			program = glCreateProgram();
+			shaderCacheProgramBinary(program, header.format, binary, header.size);
+			glGetProgramiv(program, GL_LINK_STATUS, &status);
+			if (!status)
+			{
+				// E.g. driver update which doesn't change the version string
+				glDeleteProgram(program);
+				program = 0;
+			}
+		}
+		free(binary);
+	}
+	fclose(f);
+	return program;
+}
+static void shaderCacheSave(const char *path, uint64_t key, GLuint program)
+{
+	ShaderCacheHeader header;
+	GLint size = 0;
+	GLsizei len = 0;
+	GLenum format = 0;
+	void *binary;
+	FILE *f;
+
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+	if (size <= 0 || size > ShaderCacheMaxSize)
+		return;
+
+	binary = malloc(size);
+	shaderCacheGetProgramBinary(program, size, &len, &format, binary);
+	if (len > 0 && (f = fopen(path, "wb")))
+	{
+		memset(&header, 0, sizeof header);
+		header.key = key;
+		header.magic = ShaderCacheMagic;
+		header.format = format;
+		header.size = len;
+		// A truncated file fails to load and is written again
+		if (fwrite(&header, sizeof header, 1, f) == 1)
+			fwrite(binary, len, 1, f);
+		fclose(f);
+	}
+	free(binary);
+}
+
+static GLuint shaderCacheCompileShader(GLenum type, const char *src)
+{
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &src, NULL);
+	glCompileShader(shader);
+	if (!checkShaderCompilation(shader))
+	{
+		glDeleteShader(shader);
+		return 0;
+	}
+	return shader;
+}
+static GLuint shaderCacheCompile(const char *vShaderSrc, const char *fShaderSrc, const char *const *attribs)
+{
+	const GLuint vShader = shaderCacheCompileShader(GL_VERTEX_SHADER, vShaderSrc);
+	const GLuint fShader = shaderCacheCompileShader(GL_FRAGMENT_SHADER, fShaderSrc);
+	GLuint program = 0, i;
+
+	if (vShader && fShader)
+	{
+		program = glCreateProgram();
+		glAttachShader(program, vShader);
+		glAttachShader(program, fShader);
+		for (i = 0; attribs && attribs[i]; ++i)
+			glBindAttribLocation(program, i, attribs[i]);
+		if (g_shaderCacheEnabled && shaderCacheProgramParameteri)
+			shaderCacheProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		glLinkProgram(program);
+		if (!checkShaderProgram(program))
+		{
+			glDeleteProgram(program);
+			program = 0;
+		}
+	}
+
+	// Attached shaders are deleted with the program
+	glDeleteShader(vShader);
+	glDeleteShader(fShader);
+	return program;
+}
+
+uint32_t ShaderCacheProgram(const char *name, const char *vShaderSrc, const char *fShaderSrc, const char *const *attribs)
+{
+	char fn[64], *path = NULL;
+	uint64_t key = 0;
+	GLuint program;
+	uint32_t i;
+
+	if (g_shaderCacheEnabled)
+	{
+		key = shaderCacheHash(g_shaderCacheDriverKey, vShaderSrc);
+		key = shaderCacheHash(key, fShaderSrc);
+		for (i = 0; attribs && attribs[i]; ++i)
+			key = shaderCacheHash(key, attribs[i]);
+
+		snprintf(fn, sizeof fn, "shader_%s.bin", name);
+		path = createSettingsDirPath("", fn);
+		if ((program = shaderCacheLoad(path, key)))
+		{
+			free(path);
+			return program;
+		}
+	}
+
+	program = shaderCacheCompile(vShaderSrc, fShaderSrc, attribs);
+	if (program && path)
+		shaderCacheSave(path, key, program);
+	free(path);
+	return program;
+}
@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: MIT
+
+/* Included by OpenGL1.c and OpenGL2.c */
+
+/*
+ * Texel conversion kernels. SIMD variants are selected at runtime, so the
+ * rest of the binary can still be built for the baseline CPU. Palette
+ * expansion is a lookup, so only the palette itself is converted by SIMD.
+ */
+
+#include <SDL2/SDL_cpuinfo.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+# define TEXEL_CONVERT_X86
+# include <emmintrin.h>
+# include <tmmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+# define TEXEL_CONVERT_NEON
+# include <arm_neon.h>
+#endif
+
+/* ARGB -> RGBA for 16-bit texels, "shift" is the alpha size */
+static void texelRotate16Scalar(uint16_t *out, const uint16_t *in, uint32_t count, uint32_t shift)
+{
+	uint32_t i;
+	for (i = 0; i < count; ++i)
+	{
+		uint16_t value = in[i];
+		out[i] = (value << shift) | (value >> (16 - shift));
+	}
+}
+
+/* BGRA <-> RGBA for 32-bit texels */
+static void texelSwapRBScalar(uint32_t *out, const uint32_t *in, uint32_t count)
+{
+	uint32_t i;
+	for (i = 0; i < count; ++i)
+	{
+		uint32_t value = in[i];
+		out[i] = ((value >> 16) & 0x000000FF) | ((value << 16) & 0x00FF0000) | (value & 0xFF00FF00);
+	}
+}
+
+#ifdef TEXEL_CONVERT_X86
+__attribute__((target("sse2")))
+static void texelRotate16SSE2(uint16_t *out, const uint16_t *in, uint32_t count, uint32_t shift)
+{
+	const __m128i left = _mm_cvtsi32_si128(shift), right = _mm_cvtsi32_si128(16 - shift);
+	uint32_t i;
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		__m128i value = _mm_loadu_si128((const __m128i *)(in + i));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_or_si128(_mm_sll_epi16(value, left), _mm_srl_epi16(value, right)));
+	}
+	texelRotate16Scalar(out + i, in + i, count - i, shift);
+}
+
+__attribute__((target("sse2")))
+static void texelSwapRBSSE2(uint32_t *out, const uint32_t *in, uint32_t count)
+{
+	const __m128i agMask = _mm_set1_epi32(0xFF00FF00), rbMask = _mm_set1_epi32(0x000000FF);
+	uint32_t i;
+	for (i = 0; i + 4 <= count; i += 4)
+	{
+		__m128i value = _mm_loadu_si128((const __m128i *)(in + i));
+		__m128i ag = _mm_and_si128(value, agMask);
+		__m128i b = _mm_and_si128(_mm_srli_epi32(value, 16), rbMask);
+		__m128i r = _mm_slli_epi32(_mm_and_si128(value, rbMask), 16);
+		_mm_storeu_si128((__m128i *)(out + i), _mm_or_si128(ag, _mm_or_si128(r, b)));
+	}
+	texelSwapRBScalar(out + i, in + i, count - i);
+}
+
+__attribute__((target("ssse3")))
+static void texelSwapRBSSSE3(uint32_t *out, const uint32_t *in, uint32_t count)
+{
+	const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	uint32_t i;
+	for (i = 0; i + 4 <= count; i += 4)
+	{
+		__m128i value = _mm_loadu_si128((const __m128i *)(in + i));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_shuffle_epi8(value, shuffle));
+	}
+	texelSwapRBScalar(out + i, in + i, count - i);
+}
+#endif
+
+#ifdef TEXEL_CONVERT_NEON
+static void texelRotate16NEON(uint16_t *out, const uint16_t *in, uint32_t count, uint32_t shift)
+{
+	const int16x8_t left = vdupq_n_s16(shift), right = vdupq_n_s16((int32_t)shift - 16);
+	uint32_t i;
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		uint16x8_t value = vld1q_u16(in + i);
+		vst1q_u16(out + i, vorrq_u16(vshlq_u16(value, left), vshlq_u16(value, right)));
+	}
+	texelRotate16Scalar(out + i, in + i, count - i, shift);
+}
+
+static void texelSwapRBNEON(uint32_t *out, const uint32_t *in, uint32_t count)
+{
+	uint32_t i;
+	for (i = 0; i + 16 <= count; i += 16)
+	{
+		uint8x16x4_t value = vld4q_u8((const uint8_t *)(in + i));
+		uint8x16_t tmp = value.val[0];
+		value.val[0] = value.val[2];
+		value.val[2] = tmp;
+		vst4q_u8((uint8_t *)(out + i), value);
+	}
+	texelSwapRBScalar(out + i, in + i, count - i);
+}
+#endif
+
+static void (*texelRotate16)(uint16_t *out, const uint16_t *in, uint32_t count, uint32_t shift) = texelRotate16Scalar;
+static void (*texelSwapRB)(uint32_t *out, const uint32_t *in, uint32_t count) = texelSwapRBScalar;
+
+static void texelConvertInit()
+{
+#if defined(TEXEL_CONVERT_X86)
+	if (SDL_HasSSE2())
+	{
+		texelRotate16 = texelRotate16SSE2;
+		texelSwapRB = texelSwapRBSSE2;
+	}
+	if (__builtin_cpu_supports("ssse3")) // SDL2 doesn't detect SSSE3
+		texelSwapRB = texelSwapRBSSSE3;
+#elif defined(TEXEL_CONVERT_NEON)
+	if (SDL_HasNEON())
+	{
+		texelRotate16 = texelRotate16NEON;
+		texelSwapRB = texelSwapRBNEON;
+	}
+#endif
+}
+
+static void texelExpandPalette(uint32_t *out, const uint8_t *indices, const uint32_t *palette, uint32_t count)
+{
+	uint32_t i;
+	for (i = 0; i + 4 <= count; i += 4)
+	{
+		out[i + 0] = palette[indices[i + 0]];
+		out[i + 1] = palette[indices[i + 1]];
+		out[i + 2] = palette[indices[i + 2]];
+		out[i + 3] = palette[indices[i + 3]];
+	}
+	for (; i < count; ++i)
+		out[i] = palette[indices[i]];
+}
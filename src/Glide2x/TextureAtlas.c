@@ -0,0 +1,186 @@
+// SPDX-License-Identifier: MIT
+
+/* Included by OpenGL2.c */
+
+/*
+ * Glide textures are square and have power of two sizes, so every atlas page
+ * is divided by a quadtree buddy allocator. Each format has its own pages,
+ * because all texels of a GL texture use the same internal format.
+ */
+
+#define AtlasSize      1024
+#define AtlasMinBlock  8
+#define AtlasLevels    8 // 1024 -> 8
+#define AtlasNodes     ((1 << (2 * AtlasLevels)) / 3) // (4^levels - 1) / 3
+#define AtlasMaxPages  16
+
+enum
+{
+	AtlasNodeFree,
+	AtlasNodeSplit,
+	AtlasNodeUsed,
+};
+
+typedef struct
+{
+	GrTextureFormat_t fmt;
+	GLenum internalFormat, format, type;
+	GLuint id;
+	uint8_t nodes[AtlasNodes];
+} AtlasPage;
+static AtlasPage *g_atlasPages[AtlasMaxPages];
+static uint32_t g_atlasPagesCount;
+
+static int32_t atlasAllocNode(uint8_t *nodes, uint32_t node, uint32_t level, uint32_t targetLevel, uint32_t x, uint32_t y, uint16_t pos[2])
+{
+	if (nodes[node] == AtlasNodeUsed)
+		return -1;
+
+	if (level == targetLevel)
+	{
+		if (nodes[node] != AtlasNodeFree)
+			return -1;
+		nodes[node] = AtlasNodeUsed;
+		pos[0] = x;
+		pos[1] = y;
+		return node;
+	}
+
+	const uint32_t half = (AtlasSize >> level) >> 1;
+	uint32_t i;
+	for (i = 0; i < 4; ++i)
+	{
+		int32_t ret = atlasAllocNode(nodes, node * 4 + 1 + i, level + 1, targetLevel, x + (i & 1) * half, y + (i >> 1) * half, pos);
+		if (ret >= 0)
+		{
+			const uint32_t child = node * 4 + 1;
+			if (nodes[child] == AtlasNodeUsed && nodes[child + 1] == AtlasNodeUsed && nodes[child + 2] == AtlasNodeUsed && nodes[child + 3] == AtlasNodeUsed)
+				nodes[node] = AtlasNodeUsed;
+			else
+				nodes[node] = AtlasNodeSplit;
+			return ret;
+		}
+	}
+	return -1;
+}
+
+/* Returns page index + 1, or 0 if the texture doesn't fit */
+static uint32_t atlasAlloc(GrTextureFormat_t fmt, uint32_t size, uint16_t *node, uint16_t pos[2])
+{
+	uint32_t targetLevel = 0, blockSize = AtlasSize, i;
+	GLenum internalFormat, format, type;
+
+	if (!textureFormat(fmt, &internalFormat, &format, &type))
+		return 0;
+
+	while (blockSize > AtlasMinBlock && (blockSize >> 1) >= size)
+	{
+		blockSize >>= 1;
+		++targetLevel;
+	}
+
+	for (i = 0; i <= g_atlasPagesCount && i < AtlasMaxPages; ++i)
+	{
+		AtlasPage *page = g_atlasPages[i];
+		if (!page)
+		{
+			page = g_atlasPages[i] = (AtlasPage *)calloc(1, sizeof(AtlasPage));
+			page->fmt = fmt;
+			page->internalFormat = internalFormat;
+			page->format = format;
+			page->type = type;
+			++g_atlasPagesCount;
+		}
+		else if (page->fmt != fmt)
+		{
+			continue;
+		}
+
+		int32_t ret = atlasAllocNode(page->nodes, 0, 0, targetLevel, 0, 0, pos);
+		if (ret >= 0)
+		{
+			*node = ret;
+			return i + 1;
+		}
+	}
+
+	return 0;
+}
+static void atlasFree(uint32_t pageIdx, uint32_t node)
+{
+	uint8_t *nodes = g_atlasPages[pageIdx - 1]->nodes;
+
+	nodes[node] = AtlasNodeFree;
+	while (node > 0)
+	{
+		node = (node - 1) / 4;
+
+		const uint32_t child = node * 4 + 1;
+		uint32_t i, freeCount = 0, usedCount = 0;
+		for (i = 0; i < 4; ++i)
+		{
+			if (nodes[child + i] == AtlasNodeFree)
+				++freeCount;
+			else if (nodes[child + i] == AtlasNodeUsed)
+				++usedCount;
+		}
+
+		if (freeCount == 4)
+			nodes[node] = AtlasNodeFree;
+		else if (usedCount == 4)
+			nodes[node] = AtlasNodeUsed;
+		else
+			nodes[node] = AtlasNodeSplit;
+	}
+}
+
+/* Binds the page, creates its storage when needed (also after context recreation) */
+static GLuint atlasBindPage(uint32_t pageIdx)
+{
+	AtlasPage *page = g_atlasPages[pageIdx - 1];
+	if (page->id == 0)
+	{
+		glGenTextures(1, &page->id);
+		bindTexture(page->id);
+		setTextureFiltering();
+		glTexImage2D(GL_TEXTURE_2D, 0, page->internalFormat, AtlasSize, AtlasSize, 0, page->format, page->type, NULL);
+	}
+	else
+	{
+		bindTexture(page->id);
+	}
+	return page->id;
+}
+static void atlasUpload(uint32_t pageIdx, const uint16_t pos[2], uint32_t size, const void *data)
+{
+	const AtlasPage *page = g_atlasPages[pageIdx - 1];
+	atlasBindPage(pageIdx); // Before the unpack buffer is bound, storage is created without pixels
+	const void *pixels = pixelUploadBegin(data, size * size * 2); // Only 16-bit formats
+	glTexSubImage2D(GL_TEXTURE_2D, 0, pos[0], pos[1], size, size, page->format, page->type, pixels);
+	pixelUploadEnd();
+}
+
+/* Only GL objects are destroyed, allocations are kept to restore the textures */
+static void atlasDestroyTextures()
+{
+	uint32_t i;
+	for (i = 0; i < g_atlasPagesCount; ++i)
+	{
+		if (g_atlasPages[i]->id != 0)
+		{
+			glDeleteTextures(1, &g_atlasPages[i]->id);
+			g_atlasPages[i]->id = 0;
+		}
+	}
+}
+static void atlasDestroy()
+{
+	uint32_t i;
+	atlasDestroyTextures();
+	for (i = 0; i < g_atlasPagesCount; ++i)
+	{
+		free(g_atlasPages[i]);
+		g_atlasPages[i] = NULL;
+	}
+	g_atlasPagesCount = 0;
+}
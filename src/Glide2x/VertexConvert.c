@@ -0,0 +1,210 @@
+// SPDX-License-Identifier: MIT
+
+/* Included by OpenGL2.c */
+
+/*
+ * GrVertex -> Vertex conversion of a whole primitive (up to 4 vertices).
+ * SIMD variants transpose the vertices, so every field of all vertices is
+ * converted at once, and are selected at runtime like texel conversion.
+ * Colors and the fog index are truncated like the scalar casts on x86.
+ */
+
+#include <SDL2/SDL_cpuinfo.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+# define VERTEX_CONVERT_X86
+# include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+# define VERTEX_CONVERT_NEON
+# include <arm_neon.h>
+#endif
+
+typedef void (*VertexConvert)(Vertex *out, const GrVertex *const *in, uint32_t count, const uint16_t texRect[4], const uint8_t *fogTable, float bounds[4]);
+
+static void vertexConvertScalar(Vertex *out, const GrVertex *const *in, uint32_t count, const uint16_t texRect[4], const uint8_t *fogTable, float bounds[4])
+{
+	uint32_t i;
+	for (i = 0; i < count; ++i)
+	{
+		const GrVertex *grVertex = in[i];
+		Vertex *vertex = &out[i];
+
+		vertex->x = grVertex->x - VertexSnap;
+		vertex->y = grVertex->y - VertexSnap;
+		vertex->z = grVertex->oow;
+
+		vertex->s = grVertex->tmuvtx[0].sow / 256.0f;
+		vertex->t = grVertex->tmuvtx[0].tow / 256.0f;
+		vertex->r = 0.0f;
+		vertex->q = grVertex->oow;
+		memcpy(vertex->texRect, texRect, sizeof vertex->texRect);
+
+		vertex->color.r = grVertex->r;
+		vertex->color.g = grVertex->g;
+		vertex->color.b = grVertex->b;
+		vertex->color.a = grVertex->a;
+
+		vertex->fog = 255 - fogTable[(uint16_t)(1.0f / grVertex->oow)];
+
+		if (i == 0)
+		{
+			bounds[0] = bounds[2] = vertex->x;
+			bounds[1] = bounds[3] = vertex->y;
+		}
+		else
+		{
+			bounds[0] = SDL_min(bounds[0], vertex->x);
+			bounds[1] = SDL_min(bounds[1], vertex->y);
+			bounds[2] = SDL_max(bounds[2], vertex->x);
+			bounds[3] = SDL_max(bounds[3], vertex->y);
+		}
+	}
+}
+
+/* Stores transposed fields, "pos" is x,y,z,s and "tex" is t,r,q per vertex */
+static inline void vertexStore(Vertex *out, uint32_t count, const float pos[4][4], const float tex[4][4], const uint32_t colors[4], const int32_t fogIdx[4], const uint16_t texRect[4], const uint8_t *fogTable, float bounds[4])
+{
+	uint32_t i;
+
+	bounds[0] = bounds[2] = pos[0][0];
+	bounds[1] = bounds[3] = pos[0][1];
+
+	for (i = 0; i < count; ++i)
+	{
+		Vertex *vertex = &out[i];
+		memcpy(&vertex->x, pos[i], 4 * sizeof(float));
+		memcpy(&vertex->t, tex[i], 3 * sizeof(float));
+		memcpy(vertex->texRect, texRect, sizeof vertex->texRect);
+		memcpy(&vertex->color, &colors[i], sizeof vertex->color);
+		vertex->fog = 255 - fogTable[fogIdx[i] & 0xFFFF];
+
+		bounds[0] = SDL_min(bounds[0], pos[i][0]);
+		bounds[1] = SDL_min(bounds[1], pos[i][1]);
+		bounds[2] = SDL_max(bounds[2], pos[i][0]);
+		bounds[3] = SDL_max(bounds[3], pos[i][1]);
+	}
+}
+
+#ifdef VERTEX_CONVERT_X86
+__attribute__((target("sse2")))
+static void vertexConvertSSE2(Vertex *out, const GrVertex *const *in, uint32_t count, const uint16_t texRect[4], const uint8_t *fogTable, float bounds[4])
+{
+	// Missing vertices repeat the last one
+	const float *v0 = &in[0]->x, *v1 = &in[SDL_min(1, count - 1)]->x, *v2 = &in[SDL_min(2, count - 1)]->x, *v3 = &in[count - 1]->x;
+	const __m128i byteMask = _mm_set1_epi32(0xFF);
+	float pos[4][4], tex[4][4];
+	uint32_t colors[4];
+	int32_t fogIdx[4];
+
+	__m128 x = _mm_loadu_ps(v0), y = _mm_loadu_ps(v1), z = _mm_loadu_ps(v2), r = _mm_loadu_ps(v3);
+	_MM_TRANSPOSE4_PS(x, y, z, r);
+	__m128 g = _mm_loadu_ps(v0 + 4), b = _mm_loadu_ps(v1 + 4), ooz = _mm_loadu_ps(v2 + 4), a = _mm_loadu_ps(v3 + 4);
+	_MM_TRANSPOSE4_PS(g, b, ooz, a);
+	__m128 oow = _mm_loadu_ps(v0 + 8), sow = _mm_loadu_ps(v1 + 8), tow = _mm_loadu_ps(v2 + 8), unused = _mm_loadu_ps(v3 + 8);
+	_MM_TRANSPOSE4_PS(oow, sow, tow, unused);
+
+	x = _mm_sub_ps(x, _mm_set1_ps(VertexSnap));
+	y = _mm_sub_ps(y, _mm_set1_ps(VertexSnap));
+
+	__m128i color = _mm_and_si128(_mm_cvttps_epi32(r), byteMask);
+	color = _mm_or_si128(color, _mm_slli_epi32(_mm_and_si128(_mm_cvttps_epi32(g), byteMask), 8));
+	color = _mm_or_si128(color, _mm_slli_epi32(_mm_and_si128(_mm_cvttps_epi32(b), byteMask), 16));
+	color = _mm_or_si128(color, _mm_slli_epi32(_mm_cvttps_epi32(a), 24));
+	_mm_storeu_si128((__m128i *)colors, color);
+	_mm_storeu_si128((__m128i *)fogIdx, _mm_cvttps_epi32(_mm_div_ps(_mm_set1_ps(1.0f), oow)));
+
+	__m128 s = _mm_mul_ps(sow, _mm_set1_ps(1.0f / 256.0f));
+	__m128 t = _mm_mul_ps(tow, _mm_set1_ps(1.0f / 256.0f));
+	__m128 q = oow, zero = _mm_setzero_ps(), pad = _mm_setzero_ps();
+	z = oow;
+	_MM_TRANSPOSE4_PS(x, y, z, s);
+	_MM_TRANSPOSE4_PS(t, zero, q, pad);
+	_mm_storeu_ps(pos[0], x);
+	_mm_storeu_ps(pos[1], y);
+	_mm_storeu_ps(pos[2], z);
+	_mm_storeu_ps(pos[3], s);
+	_mm_storeu_ps(tex[0], t);
+	_mm_storeu_ps(tex[1], zero);
+	_mm_storeu_ps(tex[2], q);
+	_mm_storeu_ps(tex[3], pad);
+
+	vertexStore(out, count, pos, tex, colors, fogIdx, texRect, fogTable, bounds);
+}
+#endif
+
+#ifdef VERTEX_CONVERT_NEON
+static inline void transpose4NEON(float32x4_t *a, float32x4_t *b, float32x4_t *c, float32x4_t *d)
+{
+	const float32x4x2_t ab = vtrnq_f32(*a, *b), cd = vtrnq_f32(*c, *d);
+	*a = vcombine_f32(vget_low_f32(ab.val[0]), vget_low_f32(cd.val[0]));
+	*b = vcombine_f32(vget_low_f32(ab.val[1]), vget_low_f32(cd.val[1]));
+	*c = vcombine_f32(vget_high_f32(ab.val[0]), vget_high_f32(cd.val[0]));
+	*d = vcombine_f32(vget_high_f32(ab.val[1]), vget_high_f32(cd.val[1]));
+}
+
+static void vertexConvertNEON(Vertex *out, const GrVertex *const *in, uint32_t count, const uint16_t texRect[4], const uint8_t *fogTable, float bounds[4])
+{
+	// Missing vertices repeat the last one
+	const float *v0 = &in[0]->x, *v1 = &in[SDL_min(1, count - 1)]->x, *v2 = &in[SDL_min(2, count - 1)]->x, *v3 = &in[count - 1]->x;
+	const uint32x4_t byteMask = vdupq_n_u32(0xFF);
+	float pos[4][4], tex[4][4];
+	uint32_t colors[4];
+	int32_t fogIdx[4];
+
+	float32x4_t x = vld1q_f32(v0), y = vld1q_f32(v1), z = vld1q_f32(v2), r = vld1q_f32(v3);
+	transpose4NEON(&x, &y, &z, &r);
+	float32x4_t g = vld1q_f32(v0 + 4), b = vld1q_f32(v1 + 4), ooz = vld1q_f32(v2 + 4), a = vld1q_f32(v3 + 4);
+	transpose4NEON(&g, &b, &ooz, &a);
+	float32x4_t oow = vld1q_f32(v0 + 8), sow = vld1q_f32(v1 + 8), tow = vld1q_f32(v2 + 8), unused = vld1q_f32(v3 + 8);
+	transpose4NEON(&oow, &sow, &tow, &unused);
+
+	x = vsubq_f32(x, vdupq_n_f32(VertexSnap));
+	y = vsubq_f32(y, vdupq_n_f32(VertexSnap));
+
+	uint32x4_t color = vandq_u32(vreinterpretq_u32_s32(vcvtq_s32_f32(r)), byteMask);
+	color = vorrq_u32(color, vshlq_n_u32(vandq_u32(vreinterpretq_u32_s32(vcvtq_s32_f32(g)), byteMask), 8));
+	color = vorrq_u32(color, vshlq_n_u32(vandq_u32(vreinterpretq_u32_s32(vcvtq_s32_f32(b)), byteMask), 16));
+	color = vorrq_u32(color, vshlq_n_u32(vreinterpretq_u32_s32(vcvtq_s32_f32(a)), 24));
+	vst1q_u32(colors, color);
+
+#ifdef __aarch64__
+	const float32x4_t w = vdivq_f32(vdupq_n_f32(1.0f), oow);
+#else
+	// No division on ARMv7, two Newton-Raphson steps are enough for the fog table index
+	float32x4_t w = vrecpeq_f32(oow);
+	w = vmulq_f32(vrecpsq_f32(oow, w), w);
+	w = vmulq_f32(vrecpsq_f32(oow, w), w);
+#endif
+	vst1q_s32(fogIdx, vcvtq_s32_f32(w));
+
+	float32x4_t s = vmulq_n_f32(sow, 1.0f / 256.0f);
+	float32x4_t t = vmulq_n_f32(tow, 1.0f / 256.0f);
+	float32x4_t q = oow, zero = vdupq_n_f32(0.0f), pad = vdupq_n_f32(0.0f);
+	z = oow;
+	transpose4NEON(&x, &y, &z, &s);
+	transpose4NEON(&t, &zero, &q, &pad);
+	vst1q_f32(pos[0], x);
+	vst1q_f32(pos[1], y);
+	vst1q_f32(pos[2], z);
+	vst1q_f32(pos[3], s);
+	vst1q_f32(tex[0], t);
+	vst1q_f32(tex[1], zero);
+	vst1q_f32(tex[2], q);
+	vst1q_f32(tex[3], pad);
+
+	vertexStore(out, count, pos, tex, colors, fogIdx, texRect, fogTable, bounds);
+}
+#endif
+
+static VertexConvert vertexConvert = vertexConvertScalar;
+
+static void vertexConvertInit()
+{
+#if defined(VERTEX_CONVERT_X86)
+	if (SDL_HasSSE2())
+		vertexConvert = vertexConvertSSE2;
+#elif defined(VERTEX_CONVERT_NEON)
+	if (SDL_HasNEON())
+		vertexConvert = vertexConvertNEON;
+#endif
+}
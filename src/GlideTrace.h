@@ -0,0 +1,74 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef GLIDETRACE_H
+#define GLIDETRACE_H
+
+#include "Glide2x.h"
+
+/*
+ * Encoded Glide calls, used by the render thread ring and by trace files
+ * ("GlideTrace" setting, replayed by "Replay/GlideReplay.c"). Every command
+ * is a header followed by its arguments and payload, padded to 8 bytes.
+ * Pointer arguments (vertices, texture data, palette) are copied into the
+ * command. Calls which don't change the rendering aren't encoded.
+ */
+
+#define CommandAlignment 8
+
+enum
+{
+	CmdWrap, // Skip to the ring start
+	CmdAlphaBlendFunction,
+	CmdAlphaCombine,
+	CmdClipWindow,
+	CmdBufferClear,
+	CmdBufferSwap,
+	CmdDepthMask,
+	CmdDrawTriangle,
+	CmdDrawLine,
+	CmdFogColorValue,
+	CmdFogMode,
+	CmdFogTable,
+	CmdGammaCorrectionValue,
+	CmdGlideShutdown,
+	CmdSstWinOpen,
+	CmdTexDownloadMipMap,
+	CmdTexDownloadTable,
+	CmdTexSource,
+	CmdLfbUnlock,
+};
+
+typedef struct
+{
+	uint32_t cmd;
+	uint32_t size; // Including header and padding
+} CommandHeader;
+
+/* Followed by texture data or palette */
+typedef struct
+{
+	uint32_t tmu, startAddress, evenOdd;
+	GrTexInfo info;
+} TexCommand;
+
+/* Followed by 480 rows of pixels written while the LFB was locked */
+typedef struct
+{
+	uint32_t buffer, writeMode, origin;
+	uint32_t strideInBytes;
+} LfbCommand;
+
+/* Trace file starts with the header, commands follow without "CmdWrap" */
+#define GlideTraceMagic   0x3154474E // "NGT1"
+#define GlideTraceVersion 1
+
+typedef struct
+{
+	uint32_t magic, version;
+	uint32_t vertexSize, texCommandSize; // Layout check, the trace must be replayed by the same architecture
+} GlideTraceHeader;
+
+/* Calls the Glide function of the command, implemented by the Glide backend */
+void GlideTraceExecute(const CommandHeader *header);
+
+#endif // GLIDETRACE_H
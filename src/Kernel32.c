@@ -1,22 +1,28 @@
 // SPDX-License-Identifier: MIT
 
 #include "Kernel32.h"
+#include "Prefetch.h"
+#include "PathIndex.h"
+#include "Scheduler.h"
 
 #include <SDL2/SDL_timer.h>
 
 void exit_func();
 
-#ifdef WIN32
-	extern BOOL useOnlyOneCPU;
-#else
+#ifndef WIN32
 	#define ERROR_IO_PENDING 0x3E5
 	#define WAIT_TIMEOUT 0x102
 	#include <sys/stat.h>
+	#include <sys/mman.h>
 	#include <termios.h>
 	#include <unistd.h>
 	#include <fcntl.h>
 	#include <errno.h>
 
+	#ifdef __linux__
+		#include <sys/syscall.h>
+	#endif
+
 	#ifdef __ANDROID__
 		#include <sys/ioctl.h>
 		#define tcdrain(fd) \
@@ -29,8 +35,8 @@ void exit_func();
 REALIGN STDCALL void *CreateThread_wrap(void *threadAttributes, uint32_t stackSize, LPTHREAD_START_ROUTINE startAddress, void *parameter, uint32_t creationFlags, uint32_t *threadId)
 {
 	HANDLE thread = CreateThread(threadAttributes, stackSize, startAddress, parameter, creationFlags, (DWORD *)threadId);
-	if (useOnlyOneCPU)
-		SetThreadAffinityMask(thread, 1);
+	if (thread)
+		SchedulerSetThreadRole(thread, SchedulerMain);
 	return thread;
 }
 REALIGN STDCALL uint32_t ResumeThread_wrap(HANDLE hThread)
@@ -84,14 +90,16 @@ REALIGN STDCALL uint32_t GetLastError_wrap(void)
 }
 REALIGN STDCALL HANDLE CreateFileA_wrap(const char *fileName, uint32_t desiredAccess, uint32_t shareMode, SECURITY_ATTRIBUTES *securityAttributes, uint32_t creationDisposition, uint32_t flagsAndAttributes, void *templateFile)
 {
-	char *tmpFileName;
+	char buffer[MAX_NATIVE_PATH];
+	const char *tmpFileName;
 	HANDLE handle;
 	if (!strncasecmp(fileName, "\\\\.\\com", 7))
-		tmpFileName = strdup(fileName);
+		tmpFileName = fileName;
 	else
-		tmpFileName = convertFilePath(fileName, false);
+		tmpFileName = convertFilePath(fileName, buffer, false);
 	handle = CreateFileA(tmpFileName, desiredAccess, shareMode, securityAttributes, creationDisposition, flagsAndAttributes, templateFile);
-	free(tmpFileName);
+	if (handle != INVALID_HANDLE_VALUE && desiredAccess == GENERIC_READ)
+		PrefetchFileOpened(tmpFileName);
 	return handle;
 }
 REALIGN STDCALL HANDLE CreateFileMappingA_wrap(HANDLE hFile, SECURITY_ATTRIBUTES *fileMappingAttributes, uint32_t flProtect, uint32_t dwMaximumSizeHigh, uint32_t dwMaximumSizeLow, const char *lpName)
@@ -152,10 +160,8 @@ REALIGN STDCALL BOOL SetCommTimeouts_wrap(HANDLE hFile, COMMTIMEOUTS *commTimeou
 }
 REALIGN STDCALL BOOL DeleteFileA_wrap(const char *fileName)
 {
-	char *tmpFileName = convertFilePath(fileName, false);
-	BOOL ret = DeleteFileA(tmpFileName);
-	free(tmpFileName);
-	return ret;
+	char tmpFileName[MAX_NATIVE_PATH];
+	return DeleteFileA(convertFilePath(fileName, tmpFileName, false));
 }
 REALIGN STDCALL void *GetModuleHandleA_wrap(const char *moduleName)
 {
@@ -195,10 +201,8 @@ REALIGN STDCALL uint32_t GetCurrentDirectoryA_wrap(uint32_t bufferLength, char *
 }
 REALIGN STDCALL BOOL SetCurrentDirectoryA_wrap(const char *pathName)
 {
-	char *tmpPathName = convertFilePath(pathName, false);
-	BOOL ret = SetCurrentDirectoryA(tmpPathName);
-	free(tmpPathName);
-	return ret;
+	char tmpPathName[MAX_NATIVE_PATH];
+	return SetCurrentDirectoryA(convertFilePath(pathName, tmpPathName, false));
 }
 REALIGN STDCALL BOOL FindNextFileA_wrap(void *findFile, WIN32_FIND_DATAA *findFileData)
 {
@@ -218,14 +222,26 @@ REALIGN STDCALL void *FindFirstFileA_wrap(const char *fileName, WIN32_FIND_DATAA
 static uint32_t overlapped_error;
 
 extern char *serialPort[4];
-extern SDL_mutex *event_mutex;
-extern SDL_cond *event_cond;
+extern uint32_t serialBaudRate;
+
+static SDL_TLSID event_sem_tls;
 
 static int threadFunction(void *data)
 {
 	Thread *thread = (Thread *)data;
 	SDL_SemWait(thread->sem);
 	SDL_DestroySemaphore(thread->sem);
+
+	SchedulerSetRole(SchedulerMain);
+	// Publish the ID before checking the priority, see "SetThreadPriority_wrap()"
+#ifdef __linux__
+	SDL_AtomicSet(&thread->tid, syscall(SYS_gettid));
+#else
+	SDL_AtomicSet(&thread->tid, -1);
+#endif
+	if (SDL_AtomicGet(&thread->priorityRequested))
+		SchedulerSetPriority(SDL_AtomicGet(&thread->priority));
+
 #ifdef NFS_CPP
 	thread->function(thread->arg);
 #else
@@ -246,6 +262,9 @@ REALIGN STDCALL void *CreateThread_wrap(void *threadAttributes, uint32_t stackSi
 #else
 	thread->threadParameter = parameter;
 #endif
+	SDL_AtomicSet(&thread->tid, 0);
+	SDL_AtomicSet(&thread->priority, 0);
+	SDL_AtomicSet(&thread->priorityRequested, 0);
 	thread->sem = SDL_CreateSemaphore(!(creationFlags & 0x4 /* Start paused thread */));
 	SDL_Thread *sdl_thread = SDL_CreateThread(threadFunction, NULL, thread);
 	if (threadId)
@@ -260,7 +279,23 @@ REALIGN STDCALL uint32_t ResumeThread_wrap(Thread *thread)
 }
 REALIGN STDCALL BOOL SetThreadPriority_wrap(Thread *thread, int priority)
 {
-	return false;
+	int32_t tid;
+
+	// Pseudo handle from "GetCurrentThread_wrap()"
+	if (!thread)
+		return SchedulerSetPriority(priority);
+
+	// Not started thread applies it itself
+	SDL_AtomicSet(&thread->priority, priority);
+	SDL_AtomicSet(&thread->priorityRequested, 1);
+	tid = SDL_AtomicGet(&thread->tid);
+	if (tid == 0)
+		return true;
+#ifdef __linux__
+	return SchedulerSetThreadPriority(tid, priority);
+#else
+	return false; // Running thread can only change its own priority
+#endif
 }
 REALIGN STDCALL uint32_t GetCurrentThreadId_wrap(void)
 {
@@ -331,72 +366,164 @@ REALIGN STDCALL Event *CreateEventA_wrap(SECURITY_ATTRIBUTES *eventAttributes, B
 	Event *event = (Event *)malloc(sizeof(Event));
 	event->handleType = HandleEvent;
 	event->manualReset = manualReset;
-	event->is_set = initialState;
+	SDL_AtomicSet(&event->isSet, initialState);
+	SDL_AtomicSet(&event->waiterCount, 0);
+	event->mutex = SDL_CreateMutex();
+	event->waiters = NULL;
 	return event;
 }
 REALIGN STDCALL BOOL SetEvent_wrap(Event *event)
 {
 	if (event)
 	{
-		SDL_LockMutex(event_mutex);
-		event->is_set = true;
-		SDL_CondBroadcast(event_cond);
-		SDL_UnlockMutex(event_mutex);
+		SDL_AtomicSet(&event->isSet, 1);
+		if (SDL_AtomicGet(&event->waiterCount) > 0) // No locking when nobody waits
+		{
+			EventWaiter *waiter;
+			SDL_LockMutex(event->mutex);
+			for (waiter = event->waiters; waiter; waiter = waiter->next)
+				SDL_SemPost(waiter->sem);
+			SDL_UnlockMutex(event->mutex);
+		}
 		return true;
 	}
 	return false;
 }
+
+/* Returns index of the first signaled event and resets it if it isn't manual-reset */
+static uint32_t consumeEvent(uint32_t count, Event *const *events)
+{
+	uint32_t i;
+	for (i = 0; i != count; ++i)
+	{
+		if (events[i]->manualReset ? SDL_AtomicGet(&events[i]->isSet) : SDL_AtomicCAS(&events[i]->isSet, 1, 0))
+			return i;
+	}
+	return WAIT_TIMEOUT;
+}
+static SDL_sem *getEventSemaphore()
+{
+	SDL_sem *sem;
+	if (!event_sem_tls)
+	{
+		static SDL_SpinLock lock;
+		SDL_AtomicLock(&lock);
+		if (!event_sem_tls)
+			event_sem_tls = SDL_TLSCreate();
+		SDL_AtomicUnlock(&lock);
+	}
+	sem = (SDL_sem *)SDL_TLSGet(event_sem_tls);
+	if (!sem)
+	{
+		sem = SDL_CreateSemaphore(0);
+		SDL_TLSSet(event_sem_tls, sem, (void (*)(void *))SDL_DestroySemaphore);
+	}
+	return sem;
+}
 REALIGN STDCALL uint32_t WaitForMultipleObjects_wrap(uint32_t count, Event *const *events, BOOL waitAll, uint32_t milliseconds)
 {
-	//milliseconds always -1 or 0
 	//waitAll always false
-	uint32_t i, ret = WAIT_TIMEOUT;
-	SDL_LockMutex(event_mutex);
-	for (;;)
+	EventWaiter waiters[64 /* MAXIMUM_WAIT_OBJECTS */];
+	uint32_t i, ret = consumeEvent(count, events);
+	if (ret != WAIT_TIMEOUT || !milliseconds || count > 64)
+		return ret;
+
+	/* Register on every event, then check again, so a concurrent "SetEvent_wrap()" either sees the waiter or is seen here */
+	SDL_sem *sem = getEventSemaphore();
+	for (i = 0; i != count; ++i)
+	{
+		waiters[i].sem = sem;
+		SDL_LockMutex(events[i]->mutex);
+		waiters[i].next = events[i]->waiters;
+		events[i]->waiters = &waiters[i];
+		SDL_AtomicAdd(&events[i]->waiterCount, 1);
+		SDL_UnlockMutex(events[i]->mutex);
+	}
+
+	const uint32_t startTicks = SDL_GetTicks();
+	while ((ret = consumeEvent(count, events)) == WAIT_TIMEOUT)
 	{
-		for (i = 0; i != count; ++i)
+		if (milliseconds == 0xFFFFFFFF)
+		{
+			SDL_SemWait(sem);
+		}
+		else
 		{
-			if (events[i]->is_set)
+			const uint32_t elapsed = SDL_GetTicks() - startTicks;
+			if (elapsed >= milliseconds || SDL_SemWaitTimeout(sem, milliseconds - elapsed) == SDL_MUTEX_TIMEDOUT)
 			{
-				if (ret == WAIT_TIMEOUT)
-					ret = i;
-				if (!events[i]->manualReset)
-					events[i]->is_set = false;
+				ret = consumeEvent(count, events);
+				break;
 			}
 		}
-		if (ret != WAIT_TIMEOUT || !milliseconds)
-			break;
-		if (SDL_CondWait(event_cond, event_mutex) == -1) //no timeout, because milliseconds will be always -1 here
+	}
+
+	for (i = 0; i != count; ++i)
+	{
+		EventWaiter **waiter;
+		SDL_LockMutex(events[i]->mutex);
+		for (waiter = &events[i]->waiters; *waiter; waiter = &(*waiter)->next)
 		{
-			ret = -1;
-			break;
+			if (*waiter == &waiters[i])
+			{
+				*waiter = waiters[i].next;
+				break;
+			}
 		}
+		SDL_AtomicAdd(&events[i]->waiterCount, -1);
+		SDL_UnlockMutex(events[i]->mutex);
 	}
-	SDL_UnlockMutex(event_mutex);
+	while (SDL_SemTryWait(sem) == 0); // Wake-ups from other events which are no longer waited for
+
 	return ret;
 }
 
+/* One thread per overlapped file, it services the read requested by "ReadFile_wrap()" */
 static int serialPortThread(void *data)
 {
 	File *file = (File *)data;
 	struct timeval tv;
-	int bread, r;
+	int bread, r, maxFd;
+	char wake[16];
 	fd_set fds;
+
+	SchedulerSetRole(SchedulerSerial);
+
+	SDL_LockMutex(file->mutex);
 	for (;;)
 	{
+		while (!file->pending && !file->quit)
+			SDL_CondWait(file->ioCond, file->mutex);
+		if (file->quit)
+			break;
+		SDL_UnlockMutex(file->mutex);
+
 		FD_ZERO(&fds);
 		FD_SET(file->fd, &fds);
-		tv.tv_sec = 0;
-		tv.tv_usec = file->us_timeout;
-		r = select(file->fd + 1, &fds, NULL, NULL, &tv);
+		FD_SET(file->wakeFd[0], &fds);
+		maxFd = SDL_max(file->fd, file->wakeFd[0]);
+		tv.tv_sec = file->us_timeout / 1000000;
+		tv.tv_usec = file->us_timeout % 1000000;
+		r = select(maxFd + 1, &fds, NULL, NULL, &tv);
+
 		SDL_LockMutex(file->mutex);
+		if (file->quit)
+			break;
 		if (r < 0)
 		{
+			if (errno == EINTR)
+				continue;
 			file->pending = false;
-			SDL_UnlockMutex(file->mutex);
-			break;
+			SetEvent_wrap(file->readOverlapped->hEvent);
+			continue;
+		}
+		if (r > 0 && FD_ISSET(file->wakeFd[0], &fds))
+		{
+			while (read(file->wakeFd[0], wake, sizeof wake) > 0);
+			if (!FD_ISSET(file->fd, &fds))
+				continue;
 		}
-		else if (r == 1)
+		if (r > 0)
 		{
 			if ((bread = read(file->fd, file->asyncReadBuffer, file->toRead)) > 0)
 			{
@@ -406,21 +533,14 @@ static int serialPortThread(void *data)
 					file->pending = false;
 				file->readSoFar += bread;
 			}
-			else if (bread < 0 || !file->toRead) //is it necessary?
+			else if (bread == 0 || errno != EAGAIN)
 			{
 				file->pending = false;
-				SDL_UnlockMutex(file->mutex);
-				break;
 			}
 		}
 		SetEvent_wrap(file->readOverlapped->hEvent);
-		if (!file->pending)
-		{
-			SDL_UnlockMutex(file->mutex);
-			break;
-		}
-		SDL_UnlockMutex(file->mutex);
 	}
+	SDL_UnlockMutex(file->mutex);
 	return 0;
 }
 
@@ -429,7 +549,8 @@ REALIGN STDCALL File *CreateFileA_wrap(const char *fileName, uint32_t desiredAcc
 	uint32_t COM_number = 0;
 	if (!strncasecmp(fileName, "\\\\.\\com", 7))
 		COM_number = fileName[7] - '0';
-	char *tmpFileName = COM_number ? strdup(serialPort[COM_number - 1]) : convertFilePath(fileName, true);
+	char buffer[MAX_NATIVE_PATH];
+	const char *tmpFileName = COM_number ? serialPort[COM_number - 1] : convertFilePath(fileName, buffer, true);
 
 	File *file = NULL;
 	int fd = -1;
@@ -448,6 +569,8 @@ REALIGN STDCALL File *CreateFileA_wrap(const char *fileName, uint32_t desiredAcc
 	}
 	if (fd > 0)
 	{
+		if (desiredAccess == GENERIC_READ && !COM_number)
+			PrefetchFileOpened(tmpFileName);
 		file = calloc(1, sizeof(File));
 		file->handleType = HandleFile;
 		if ((file->async = !!(flagsAndAttributes & 0x40000000 /* Overlapped, async mode */)))
@@ -455,8 +578,6 @@ REALIGN STDCALL File *CreateFileA_wrap(const char *fileName, uint32_t desiredAcc
 		file->fd = fd;
 	}
 
-	free(tmpFileName);
-
 	return file ? file : (File *)-1;
 }
 REALIGN STDCALL uint32_t GetFileSize_wrap(File *file, uint32_t *fileSizeHigh)
@@ -473,13 +594,45 @@ REALIGN STDCALL FileMapping *CreateFileMappingA_wrap(File *file, SECURITY_ATTRIB
 	fileMapping->fd = file->fd;
 	return fileMapping;
 }
+/* "UnmapViewOfFile()" doesn't provide the size, so lengths of the views are kept here */
+typedef struct
+{
+	void *address;
+	size_t length;
+} MappedView;
+static MappedView *mapped_views;
+static uint32_t mapped_views_count, mapped_views_capacity;
+static SDL_SpinLock mapped_views_lock;
+
 REALIGN STDCALL void *MapViewOfFile_wrap(FileMapping *fMapping, uint32_t desiredAccess, uint32_t fileOffsetHigh, uint32_t fileOffsetLow, uint32_t numberOfBytesToMap)
 {
-	//Cannot use mmap() because UnmapViewOfFile doesn't provide the size. I don't want to use an array for sizes. This is also OK.
 	uint32_t size = GetFileSize_wrap((File *)fMapping, NULL);
 	void *fileMap = NULL;
-	if (size > 0)
+	if (size > 0 && size != 0xFFFFFFFF)
 	{
+		/* The game can read 4 bytes past the end, so the file is mapped over an anonymous area reaching beyond */
+		const size_t pageSize = sysconf(_SC_PAGESIZE);
+		const size_t fileLength = (size + pageSize - 1) & ~(pageSize - 1);
+		const size_t length = (size + 4 + pageSize - 1) & ~(pageSize - 1);
+		fileMap = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (fileMap != MAP_FAILED && mmap(fileMap, fileLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fMapping->fd, 0) != MAP_FAILED)
+		{
+			SDL_AtomicLock(&mapped_views_lock);
+			if (mapped_views_count == mapped_views_capacity)
+			{
+				mapped_views_capacity = mapped_views_capacity ? mapped_views_capacity * 2 : 16;
+				mapped_views = (MappedView *)realloc(mapped_views, mapped_views_capacity * sizeof(MappedView));
+			}
+			mapped_views[mapped_views_count].address = fileMap;
+			mapped_views[mapped_views_count].length = length;
+			++mapped_views_count;
+			SDL_AtomicUnlock(&mapped_views_lock);
+			return fileMap;
+		}
+		if (fileMap != MAP_FAILED)
+			munmap(fileMap, length);
+
+		/* Fallback, read the whole file */
 		off_t pos = lseek(fMapping->fd, 0, SEEK_CUR);
 		lseek(fMapping->fd, 0, SEEK_SET);
 		fileMap = malloc(size + 4);
@@ -490,7 +643,23 @@ REALIGN STDCALL void *MapViewOfFile_wrap(FileMapping *fMapping, uint32_t desired
 }
 REALIGN STDCALL BOOL UnmapViewOfFile_wrap(const void *lpBaseAddress)
 {
-	free((void *)lpBaseAddress);
+	size_t length = 0;
+	uint32_t i;
+	SDL_AtomicLock(&mapped_views_lock);
+	for (i = 0; i < mapped_views_count; ++i)
+	{
+		if (mapped_views[i].address == lpBaseAddress)
+		{
+			length = mapped_views[i].length;
+			mapped_views[i] = mapped_views[--mapped_views_count];
+			break;
+		}
+	}
+	SDL_AtomicUnlock(&mapped_views_lock);
+	if (length)
+		munmap((void *)lpBaseAddress, length);
+	else
+		free((void *)lpBaseAddress);
 	return true;
 }
 REALIGN STDCALL BOOL FlusfileBuffers_wrap(File *file)
@@ -523,11 +692,7 @@ REALIGN STDCALL BOOL WriteFile_wrap(File *file, const void *buffer, uint32_t num
 {
 	BOOL hasEvent = file->async && overlapped && overlapped->hEvent, ret;
 	if (hasEvent)
-	{
-		SDL_LockMutex(event_mutex);
-		((Event *)overlapped->hEvent)->is_set = false;
-		SDL_UnlockMutex(event_mutex);
-	}
+		SDL_AtomicSet(&((Event *)overlapped->hEvent)->isSet, 0);
 	*numberOfBytesWritten = write(file->fd, buffer, numberOfBytesToWrite);
 	ret = numberOfBytesToWrite == *numberOfBytesWritten;
 	if (hasEvent && ret)
@@ -545,19 +710,28 @@ REALIGN STDCALL BOOL ReadFile_wrap(File *file, void *buffer, uint32_t numberOfBy
 		{
 			SDL_LockMutex(file->mutex);
 
-			SDL_LockMutex(event_mutex);
-			((Event *)overlapped->hEvent)->is_set = false;
-			SDL_UnlockMutex(event_mutex);
+			SDL_AtomicSet(&((Event *)overlapped->hEvent)->isSet, 0);
 
 			file->asyncReadBuffer = buffer;
 			file->readOverlapped = overlapped;
 			file->toRead = numberOfBytesToRead;
 			file->readSoFar = 0;
 
-			if (!file->pending)
+			if (!file->ioThread && pipe(file->wakeFd) == 0)
+			{
+				fcntl(file->wakeFd[0], F_SETFL, O_NONBLOCK);
+				file->ioCond = SDL_CreateCond();
+				if (!(file->ioThread = SDL_CreateThread(serialPortThread, "SerialPort", file)))
+				{
+					fprintf(stderr, "Can't create serial port thread: %s\n", SDL_GetError());
+					close(file->wakeFd[0]);
+					close(file->wakeFd[1]);
+				}
+			}
+			if (file->ioThread)
 			{
 				file->pending = true;
-				SDL_DetachThread(SDL_CreateThread(serialPortThread, NULL, file));
+				SDL_CondSignal(file->ioCond);
 			}
 			overlapped_error = ERROR_IO_PENDING;
 
@@ -584,9 +758,21 @@ REALIGN STDCALL BOOL PurgeComm_wrap(File *file, uint32_t flags)
 REALIGN STDCALL BOOL SetCommState_wrap(File *file, DCB *dcb)
 {
 	struct termios tty;
+	speed_t speed;
+	switch (serialBaudRate)
+	{
+		case 1200:   speed = B1200;   break;
+		case 2400:   speed = B2400;   break;
+		case 4800:   speed = B4800;   break;
+		case 19200:  speed = B19200;  break;
+		case 38400:  speed = B38400;  break;
+		case 57600:  speed = B57600;  break;
+		case 115200: speed = B115200; break;
+		default:     speed = B9600;   break;
+	}
 	memset(&tty, 0, sizeof(struct termios));
-	cfsetospeed(&tty, B9600);
-	cfsetispeed(&tty, B9600);
+	cfsetospeed(&tty, speed);
+	cfsetispeed(&tty, speed);
 	tty.c_iflag |= IGNBRK;
 	tty.c_cflag |= CS8 | CLOCAL | CREAD;
 	return !tcsetattr(file->fd, TCSANOW, &tty);
@@ -599,10 +785,8 @@ REALIGN STDCALL BOOL SetCommTimeouts_wrap(File *file, COMMTIMEOUTS *commTimeouts
 
 REALIGN STDCALL BOOL DeleteFileA_wrap(const char *fileName)
 {
-	char *tmpFileName = convertFilePath(fileName, true);
-	BOOL ret = !unlink(tmpFileName);
-	free(tmpFileName);
-	return ret;
+	char tmpFileName[MAX_NATIVE_PATH];
+	return !unlink(convertFilePath(fileName, tmpFileName, true));
 }
 
 REALIGN STDCALL void *GetModuleHandleA_wrap(const char *moduleName)
@@ -624,11 +808,19 @@ REALIGN STDCALL BOOL CloseHandle_wrap(void *handle)
 		case HandleFile:
 		{
 			File *file = (File *)handle;
-			SDL_LockMutex(file->mutex);
+			if (file->ioThread)
+			{
+				SDL_LockMutex(file->mutex);
+				file->quit = true;
+				SDL_CondSignal(file->ioCond);
+				SDL_UnlockMutex(file->mutex);
+				write(file->wakeFd[1], "", 1);
+				SDL_WaitThread(file->ioThread, NULL);
+				SDL_DestroyCond(file->ioCond);
+				close(file->wakeFd[0]);
+				close(file->wakeFd[1]);
+			}
 			close(file->fd);
-			SDL_UnlockMutex(file->mutex);
-			while (file->pending) //Cannot wait for finished, because thread is detached
-				SDL_Delay(10);
 			SDL_DestroyMutex(file->mutex);
 			free(file);
 			return true;
@@ -642,6 +834,7 @@ REALIGN STDCALL BOOL CloseHandle_wrap(void *handle)
 		case HandleEvent:
 		{
 			Event *event = (Event *)handle;
+			SDL_DestroyMutex(event->mutex);
 			free(event);
 			return true;
 		}
@@ -674,9 +867,9 @@ REALIGN STDCALL uint32_t GetCurrentDirectoryA_wrap(uint32_t bufferLength, char *
 }
 REALIGN STDCALL BOOL SetCurrentDirectoryA_wrap(const char *pathName)
 {
-	char *tmpPathName = convertFilePath(pathName, false);
-	BOOL ret = !chdir(tmpPathName);
-	free(tmpPathName);
+	char tmpPathName[MAX_NATIVE_PATH];
+	BOOL ret = !chdir(convertFilePath(pathName, tmpPathName, false));
+	PathIndexCurrentDirectoryChanged();
 	return ret;
 }
 
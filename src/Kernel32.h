@@ -10,6 +10,7 @@
 #else
 	#include <SDL2/SDL_thread.h>
 	#include <SDL2/SDL_mutex.h>
+	#include <SDL2/SDL_atomic.h>
 
 	#include <dirent.h>
 
@@ -116,17 +117,22 @@
 		int (*threadParameter)();
 #endif
 		SDL_sem *sem;
+		SDL_atomic_t tid; // Kernel thread ID when started (-1 where unknown)
+		SDL_atomic_t priority, priorityRequested; // From "SetThreadPriority_wrap()"
 	} Thread;
 	typedef struct
 	{
 		HandleType handleType;
 		int fd;
-		/* ASync */
-		BOOL async, pending;
+		/* ASync, reads are done by "ioThread" */
+		BOOL async, pending, quit;
 		uint32_t toRead, readSoFar;
 		uint8_t *asyncReadBuffer;
 		OVERLAPPED *readOverlapped;
 		SDL_mutex *mutex;
+		SDL_cond *ioCond;
+		SDL_Thread *ioThread;
+		int wakeFd[2]; // Interrupts "select()" on close
 		uint32_t us_timeout;
 	} File;
 	typedef struct
@@ -134,10 +140,19 @@
 		HandleType handleType;
 		int fd;
 	} FileMapping;
+	/* One per event a thread waits for, points to the waiting thread's semaphore */
+	typedef struct EventWaiter
+	{
+		SDL_sem *sem;
+		struct EventWaiter *next;
+	} EventWaiter;
 	typedef struct
 	{
 		HandleType handleType;
-		BOOL manualReset, is_set;
+		BOOL manualReset;
+		SDL_atomic_t isSet, waiterCount;
+		SDL_mutex *mutex; // Protects "waiters"
+		EventWaiter *waiters;
 	} Event;
 
 	typedef struct
@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: MIT
+
+#include "PathIndex.h"
+
+#ifndef WIN32
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <SDL2/SDL_stdinc.h>
+
+/*
+ * Case-insensitive index of the game directory. The CD-ROM has UPPERCASE
+ * names, the game asks for mixed case ones, so every file and directory is
+ * hashed by its lowercase relative path once at startup. Files which are
+ * created later aren't in the index: their directory is looked up and the
+ * name is lowercased as before.
+ */
+
+#define PathIndexMaxEntries 0x10000
+#define PathIndexMaxDepth   16
+
+typedef struct
+{
+	uint32_t hash;
+	uint32_t key, path; // Offsets in "strings", zero key is an empty slot
+} PathEntry;
+
+static char *strings;
+static uint32_t stringsSize, stringsCapacity;
+static PathEntry *entries, *table;
+static uint32_t entryCount, entryCapacity, tableMask;
+static char *indexRoot;
+static BOOL indexValid;
+
+static uint32_t hashKey(const char *key)
+{
+	uint32_t hash = 2166136261u;
+	for (; *key; ++key)
+		hash = (hash ^ (uint8_t)*key) * 16777619u;
+	return hash;
+}
+
+static uint32_t addString(const char *str, BOOL toLower)
+{
+	const uint32_t offset = stringsSize, len = strlen(str) + 1;
+	uint32_t i;
+	if (stringsSize + len > stringsCapacity)
+	{
+		stringsCapacity = SDL_max(stringsCapacity * 2, stringsSize + len + 0x10000);
+		strings = (char *)realloc(strings, stringsCapacity);
+	}
+	for (i = 0; i < len; ++i)
+		strings[offset + i] = toLower ? tolower(str[i]) : str[i];
+	stringsSize += len;
+	return offset;
+}
+
+static const PathEntry *findEntry(const char *key)
+{
+	uint32_t i;
+	const uint32_t hash = hashKey(key);
+	if (!table)
+		return NULL;
+	for (i = hash & tableMask; table[i].key; i = (i + 1) & tableMask)
+		if (table[i].hash == hash && !strcmp(strings + table[i].key, key))
+			return &table[i];
+	return NULL;
+}
+
+static void scanDir(char *path, uint32_t len, uint32_t depth)
+{
+	DIR *dir = opendir(len ? path : ".");
+	struct dirent *de;
+	if (!dir)
+		return;
+	while ((de = readdir(dir)) && entryCount < PathIndexMaxEntries)
+	{
+		const uint32_t nameLen = strlen(de->d_name);
+		if (de->d_name[0] == '.' || len + nameLen + 2 > MAX_NATIVE_PATH)
+			continue;
+
+		if (len)
+			path[len] = '/';
+		memcpy(path + len + !!len, de->d_name, nameLen + 1);
+
+		if (entryCount == entryCapacity)
+		{
+			entryCapacity = entryCapacity ? entryCapacity * 2 : 1024;
+			entries = (PathEntry *)realloc(entries, entryCapacity * sizeof(PathEntry));
+		}
+		entries[entryCount].key = addString(path, true);
+		entries[entryCount].path = addString(path, false);
+		entries[entryCount].hash = hashKey(strings + entries[entryCount].key);
+		++entryCount;
+
+		BOOL isDir = (de->d_type == DT_DIR);
+		if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK)
+		{
+			struct stat st;
+			isDir = !stat(path, &st) && S_ISDIR(st.st_mode); // Depth and entries limit loops
+		}
+		if (isDir && depth < PathIndexMaxDepth)
+			scanDir(path, len + !!len + nameLen, depth + 1);
+	}
+	path[len] = '\0';
+	closedir(dir);
+}
+
+void PathIndexBuild(void)
+{
+	char path[MAX_NATIVE_PATH] = "";
+	uint32_t i, j;
+
+	PathIndexFree();
+	addString("", false);
+	scanDir(path, 0, 0);
+
+	for (tableMask = 1; tableMask < entryCount * 2; tableMask <<= 1);
+	table = (PathEntry *)calloc(tableMask, sizeof(PathEntry));
+	--tableMask;
+	for (i = 0; i < entryCount; ++i)
+	{
+		const PathEntry *entry = &entries[i];
+		for (j = entry->hash & tableMask; table[j].key; j = (j + 1) & tableMask)
+		{
+			if (table[j].hash == entry->hash && !strcmp(strings + table[j].key, strings + entry->key))
+				break;
+		}
+		// Already lowercased name wins if the names differ only by case
+		if (!table[j].key || !strcmp(strings + entry->key, strings + entry->path))
+			table[j] = *entry;
+	}
+	free(entries);
+	entries = NULL;
+	entryCount = entryCapacity = 0;
+
+	indexRoot = getcwd(NULL, 0);
+	indexValid = !!indexRoot;
+}
+
+BOOL PathIndexResolve(char *path, size_t size, BOOL convToLower)
+{
+	char key[MAX_NATIVE_PATH], out[MAX_NATIVE_PATH];
+	const char *rel = path;
+	const PathEntry *entry;
+	uint32_t i, len;
+
+	if (!indexValid || *path == '/')
+		return false;
+
+	while (rel[0] == '.' && rel[1] == '/')
+		rel += 2;
+	for (len = 0; rel[len] && len < sizeof key - 1; ++len)
+		key[len] = tolower(rel[len]);
+	key[len] = '\0';
+	if (rel[len])
+		return false;
+
+	if ((entry = findEntry(key)))
+	{
+		snprintf(path, size, "%s", strings + entry->path);
+		return true;
+	}
+
+	/* Not existing file, keep the spelling of its directory */
+	for (i = len; i-- > 0;)
+	{
+		if (key[i] != '/')
+			continue;
+		key[i] = '\0';
+		if ((entry = findEntry(key)))
+		{
+			uint32_t pos = snprintf(out, sizeof out, "%s", strings + entry->path);
+			for (; rel[i] && pos < sizeof out - 1; ++i)
+				out[pos++] = convToLower ? tolower(rel[i]) : rel[i];
+			out[pos] = '\0';
+			snprintf(path, size, "%s", out);
+			return true;
+		}
+	}
+	return false;
+}
+
+void PathIndexCurrentDirectoryChanged(void)
+{
+	char *cwd;
+	if (!indexRoot)
+		return;
+	cwd = getcwd(NULL, 0);
+	indexValid = cwd && !strcmp(cwd, indexRoot);
+	free(cwd);
+}
+
+void PathIndexFree(void)
+{
+	free(table);
+	table = NULL;
+	free(strings);
+	strings = NULL;
+	stringsSize = stringsCapacity = 0;
+	free(indexRoot);
+	indexRoot = NULL;
+	indexValid = false;
+}
+
+#else
+
+void PathIndexBuild(void)
+{}
+BOOL PathIndexResolve(char *path, size_t size, BOOL convToLower)
+{
+	return false;
+}
+void PathIndexCurrentDirectoryChanged(void)
+{}
+void PathIndexFree(void)
+{}
+
+#endif
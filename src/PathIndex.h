@@ -0,0 +1,16 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef PATHINDEX_H
+#define PATHINDEX_H
+
+#include "Wrapper.h"
+
+/* Scans the current (game) directory, does nothing on Windows */
+void PathIndexBuild(void);
+/* Replaces a relative path by its on-disk spelling, returns false if it isn't in the index */
+BOOL PathIndexResolve(char *path, size_t size, BOOL convToLower);
+/* The index is used only while the current directory is the scanned one */
+void PathIndexCurrentDirectoryChanged(void);
+void PathIndexFree(void);
+
+#endif // PATHINDEX_H
@@ -0,0 +1,293 @@
+// SPDX-License-Identifier: MIT
+
+#include "Prefetch.h"
+
+#include <SDL2/SDL_thread.h>
+#include <SDL2/SDL_mutex.h>
+#include <SDL2/SDL_timer.h>
+#include <string.h>
+
+#if defined(__linux__) && !defined(__ANDROID__)
+	#include <fcntl.h>
+	#include <unistd.h>
+	#define PREFETCH_FADVISE
+#endif
+
+/*
+ * Loading a race opens many files in a burst. Files opened after the first
+ * one of a burst (the trigger) are remembered per trigger in the settings
+ * directory, and when the trigger is opened again, an I/O thread reads them
+ * ahead while the game is still busy with the previous ones.
+ *
+ * On desktop Linux the kernel is asked to read ahead, elsewhere (including
+ * Android, where emulated storage may ignore the advice) files are read in
+ * chunks to get them into the page cache.
+ */
+
+#define PrefetchBurstGap   2000 // ms without opens which ends a burst
+#define PrefetchMaxEntries 64
+#define PrefetchMaxFiles   256
+#define PrefetchQueueSize  1024 // Must be a power of two
+
+typedef struct
+{
+	char *trigger;
+	char **files;
+	uint32_t count;
+} PrefetchEntry;
+
+extern BOOL prefetchFiles;
+
+static PrefetchEntry entries[PrefetchMaxEntries], burst;
+static uint32_t entryCount, lastOpenTime;
+static BOOL initialized, dirty, quit;
+
+static char *queue[PrefetchQueueSize];
+static uint32_t queueRead, queueWrite;
+
+static SDL_mutex *mutex;
+static SDL_sem *workSem;
+static SDL_Thread *thread;
+
+static void freeEntry(PrefetchEntry *entry)
+{
+	uint32_t i;
+	for (i = 0; i < entry->count; ++i)
+		free(entry->files[i]);
+	free(entry->files);
+	free(entry->trigger);
+	memset(entry, 0, sizeof(PrefetchEntry));
+}
+
+static void addFile(PrefetchEntry *entry, const char *path)
+{
+	uint32_t i;
+	if (entry->count == PrefetchMaxFiles || !strcmp(entry->trigger, path))
+		return;
+	for (i = 0; i < entry->count; ++i)
+		if (!strcmp(entry->files[i], path))
+			return;
+	if (!(entry->count & (entry->count - 1)))
+		entry->files = (char **)realloc(entry->files, (entry->count ? entry->count * 2 : 1) * sizeof(char *));
+	entry->files[entry->count++] = strdup(path);
+}
+
+/* The most recently used entries are at the end */
+static PrefetchEntry *findEntry(const char *trigger)
+{
+	uint32_t i;
+	for (i = 0; i < entryCount; ++i)
+		if (!strcmp(entries[i].trigger, trigger))
+			return &entries[i];
+	return NULL;
+}
+static void removeEntry(PrefetchEntry *entry)
+{
+	freeEntry(entry);
+	memmove(entry, entry + 1, (entries + --entryCount - entry) * sizeof(PrefetchEntry));
+	memset(entries + entryCount, 0, sizeof(PrefetchEntry));
+}
+
+static void loadManifest()
+{
+	char *path = createSettingsDirPath("", "prefetch.txt");
+	FILE *f = fopen(path, "r");
+	char line[MAX_PATH + 2];
+	free(path);
+	if (!f)
+		return;
+	while (fgets(line, sizeof line, f))
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\t' && entryCount > 0)
+			addFile(&entries[entryCount - 1], line + 1);
+		else if (line[0] && line[0] != '\t' && entryCount < PrefetchMaxEntries)
+			entries[entryCount++].trigger = strdup(line);
+	}
+	fclose(f);
+}
+
+static void saveManifest(const char *data)
+{
+	char *path = createSettingsDirPath("", "prefetch.txt");
+	FILE *f = fopen(path, "w");
+	if (f)
+	{
+		fputs(data, f);
+		fclose(f);
+	}
+	free(path);
+}
+
+/* Must be called with the mutex locked, returns "malloc()"ed text */
+static char *serializeManifest()
+{
+	uint32_t i, j;
+	size_t size = 1, pos = 0;
+	for (i = 0; i < entryCount; ++i)
+	{
+		size += strlen(entries[i].trigger) + 1;
+		for (j = 0; j < entries[i].count; ++j)
+			size += strlen(entries[i].files[j]) + 2;
+	}
+	char *data = (char *)malloc(size);
+	for (i = 0; i < entryCount; ++i)
+	{
+		pos += sprintf(data + pos, "%s\n", entries[i].trigger);
+		for (j = 0; j < entries[i].count; ++j)
+			pos += sprintf(data + pos, "\t%s\n", entries[i].files[j]);
+	}
+	data[pos] = '\0';
+	return data;
+}
+
+/* Stores the finished burst as the file list of its trigger */
+static void finishBurst()
+{
+	if (!burst.trigger)
+		return;
+	if (burst.count > 0)
+	{
+		PrefetchEntry *entry = findEntry(burst.trigger);
+		if (entry)
+			removeEntry(entry);
+		else if (entryCount == PrefetchMaxEntries)
+			removeEntry(&entries[0]);
+		entries[entryCount++] = burst;
+		memset(&burst, 0, sizeof burst);
+		dirty = true;
+		SDL_SemPost(workSem);
+	}
+	else
+	{
+		freeEntry(&burst);
+	}
+}
+
+static void prefetchFile(const char *path)
+{
+#ifdef PREFETCH_FADVISE
+	int fd = open(path, O_RDONLY);
+	if (fd >= 0)
+	{
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+#else
+	static char buffer[0x40000];
+	FILE *f = fopen(path, "rb");
+	if (f)
+	{
+		while (fread(buffer, 1, sizeof buffer, f) == sizeof buffer);
+		fclose(f);
+	}
+#endif
+}
+
+static int prefetchThread(void *data)
+{
+	for (;;)
+	{
+		char *path = NULL, *manifest = NULL;
+		BOOL stop = false;
+
+		SDL_SemWait(workSem);
+
+		SDL_LockMutex(mutex);
+		if (queueRead != queueWrite)
+		{
+			path = queue[queueRead++ & (PrefetchQueueSize - 1)];
+		}
+		else
+		{
+			if (dirty)
+				manifest = serializeManifest();
+			dirty = false;
+			stop = quit;
+		}
+		SDL_UnlockMutex(mutex);
+
+		if (path)
+		{
+			prefetchFile(path);
+			free(path);
+		}
+		if (manifest)
+		{
+			saveManifest(manifest);
+			free(manifest);
+		}
+		if (stop)
+			break;
+	}
+	return 0;
+}
+
+void PrefetchFileOpened(const char *path)
+{
+	const uint32_t now = SDL_GetTicks();
+	uint32_t i;
+
+	if (!prefetchFiles || strlen(path) > MAX_PATH)
+		return;
+
+	if (!initialized)
+	{
+		initialized = true;
+		loadManifest();
+		mutex = SDL_CreateMutex();
+		workSem = SDL_CreateSemaphore(0);
+		thread = SDL_CreateThread(prefetchThread, "Prefetch", NULL);
+		if (!thread)
+		{
+			fprintf(stderr, "Can't create prefetch thread: %s\n", SDL_GetError());
+			prefetchFiles = false;
+			return;
+		}
+	}
+
+	SDL_LockMutex(mutex);
+	if (!burst.trigger || now - lastOpenTime >= PrefetchBurstGap)
+	{
+		finishBurst();
+		burst.trigger = strdup(path);
+
+		const PrefetchEntry *entry = findEntry(path);
+		for (i = 0; entry && i < entry->count && queueWrite - queueRead < PrefetchQueueSize; ++i)
+		{
+			queue[queueWrite++ & (PrefetchQueueSize - 1)] = strdup(entry->files[i]);
+			SDL_SemPost(workSem);
+		}
+	}
+	else
+	{
+		addFile(&burst, path);
+	}
+	lastOpenTime = now;
+	SDL_UnlockMutex(mutex);
+}
+
+void PrefetchShutdown(void)
+{
+	uint32_t i;
+
+	if (!thread)
+		return;
+
+	SDL_LockMutex(mutex);
+	finishBurst();
+	while (queueRead != queueWrite)
+		free(queue[queueRead++ & (PrefetchQueueSize - 1)]);
+	quit = true;
+	SDL_SemPost(workSem);
+	SDL_UnlockMutex(mutex);
+
+	SDL_WaitThread(thread, NULL);
+	thread = NULL;
+
+	for (i = 0; i < entryCount; ++i)
+		freeEntry(&entries[i]);
+	entryCount = 0;
+	SDL_DestroySemaphore(workSem);
+	SDL_DestroyMutex(mutex);
+}
@@ -0,0 +1,13 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include "Wrapper.h"
+
+/* Call when the game opens a file for reading, "path" is a native path */
+void PrefetchFileOpened(const char *path);
+/* Stops the I/O thread and saves learned file lists */
+void PrefetchShutdown(void);
+
+#endif // PREFETCH_H
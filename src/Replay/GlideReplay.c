@@ -0,0 +1,342 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Headless renderer benchmark. Replays a Glide trace (recorded with the
+ * "GlideTrace" setting, see "GlideTrace.h") into the Glide backend it's
+ * built with, in a hidden window without VSync. Frame time is measured from
+ * swap to swap, so it includes the command submission like in the game.
+ *
+ * Usage: glidereplay trace.bin [Key=Value ...]
+ * Keys are renderer settings from "nfs2se.conf" (see "options"), "WindowSize"
+ * and "Loops". Counters are exact only without the render thread.
+ */
+
+#include "../GlideTrace.h"
+#include "../Stats.h"
+
+#include <SDL2/SDL.h>
+#include <string.h>
+
+#define MaxPalettes 256
+
+REALIGN STDCALL void grGlideInit(void);
+REALIGN STDCALL void grGlideShutdown(void);
+REALIGN STDCALL void grTexDownloadTable(GrChipID_t tmu, GrTexTable_t type, void *data);
+
+/* Defined by "Wrapper.c" and "User32.c" in the game */
+SDL_Window *sdlWin = NULL;
+float dpr = 1.0f;
+int32_t initialWinWidth = 640, initialWinHeight = 480, winWidth, winHeight, vSync = 0, paletteCacheSize = 4096, statsMode = 0;
+BOOL keepAspectRatio = true, linearFiltering = true, needRecreateGl = false, windowResized = false;
+#ifndef OPENGL1X
+BOOL fixedFramebufferSize = false;
+BOOL framebufferLinearFiltering = true;
+BOOL textureAtlas = false, gpuPaletteLookup = true, textureShadowCopy = false, shaderCache = true, pixelBufferUpload = true;
+int32_t renderThreadFrames = 0;
+int32_t dynamicResolutionMin = 0, dynamicResolutionMax = 100, displaySharpening = 0;
+char *glideTrace = NULL;
+#endif
+
+typedef struct
+{
+	const char *key;
+	int32_t *value;
+	int32_t min, max;
+} Option;
+
+static const Option options[] =
+{
+	{"VSync=", &vSync, -1, 1},
+	{"KeepAspectRatio=", &keepAspectRatio, 0, 1},
+	{"LinearTextureFiltering=", &linearFiltering, 0, 1},
+	{"PaletteCacheSize=", &paletteCacheSize, 0, 0x100000},
+#ifndef OPENGL1X
+	{"TextureAtlas=", &textureAtlas, 0, 1},
+	{"GPUPaletteLookup=", &gpuPaletteLookup, 0, 1},
+	{"TextureShadowCopy=", &textureShadowCopy, 0, 1},
+	{"RenderThread=", &renderThreadFrames, 0, 3},
+	{"DynamicResolution=", &dynamicResolutionMin, 0, 100},
+	{"DynamicResolutionMax=", &dynamicResolutionMax, 10, 200},
+	{"DisplaySharpening=", &displaySharpening, 0, 100},
+	{"ShaderCache=", &shaderCache, 0, 1},
+	{"PixelBufferUpload=", &pixelBufferUpload, 0, 1},
+#endif
+};
+
+typedef struct
+{
+	float ms;
+	uint32_t drawCalls, triangles;
+} Frame;
+
+static Frame *frames;
+static uint32_t frameCount, frameCapacity;
+static uint64_t totals[StatCount];
+
+char *createSettingsDirPath(const char *subdir, const char *fn)
+{
+	char *pth = (char *)malloc(strlen(subdir) + 1 + strlen(fn) + 1);
+	if (*subdir)
+		sprintf(pth, "%s/%s", subdir, fn);
+	else
+		strcpy(pth, fn);
+	return pth;
+}
+#ifdef OPENGL1X
+void SetBrightness(float val)
+{}
+#endif
+
+static uint8_t *loadTrace(const char *path, uint32_t *size)
+{
+	const GlideTraceHeader *header;
+	uint8_t *trace = NULL;
+	long len;
+	FILE *f = fopen(path, "rb");
+	if (!f)
+	{
+		fprintf(stderr, "Can't open trace: %s\n", path);
+		return NULL;
+	}
+	if (!fseek(f, 0, SEEK_END) && (len = ftell(f)) >= (long)sizeof(GlideTraceHeader) && !fseek(f, 0, SEEK_SET))
+	{
+		trace = (uint8_t *)malloc(len);
+		if (fread(trace, len, 1, f) != 1)
+		{
+			free(trace);
+			trace = NULL;
+		}
+		*size = len;
+	}
+	fclose(f);
+
+	header = (const GlideTraceHeader *)trace;
+	if (!trace || header->magic != GlideTraceMagic || header->version != GlideTraceVersion)
+	{
+		fprintf(stderr, "Not a Glide trace: %s\n", path);
+		free(trace);
+		return NULL;
+	}
+	if (header->vertexSize != sizeof(GrVertex) || header->texCommandSize != sizeof(TexCommand))
+	{
+		fprintf(stderr, "Trace was recorded on different architecture: %s\n", path);
+		free(trace);
+		return NULL;
+	}
+	return trace;
+}
+
+static BOOL parseOption(const char *arg, int32_t *loops)
+{
+	uint32_t i;
+	if (!strncasecmp("WindowSize=", arg, 11))
+		return sscanf(arg + 11, "%dx%d", &initialWinWidth, &initialWinHeight) == 2 && initialWinWidth > 0 && initialWinHeight > 0;
+	if (!strncasecmp("Loops=", arg, 6))
+	{
+		*loops = SDL_max(atoi(arg + 6), 1);
+		return true;
+	}
+	for (i = 0; i < SDL_arraysize(options); ++i)
+	{
+		const uint32_t len = strlen(options[i].key);
+		if (!strncasecmp(options[i].key, arg, len))
+		{
+			*options[i].value = SDL_max(SDL_min(atoi(arg + len), options[i].max), options[i].min);
+			return true;
+		}
+	}
+	return false;
+}
+
+static void frameEnd(float ms)
+{
+	uint32_t i;
+	if (frameCount == frameCapacity)
+	{
+		frameCapacity = frameCapacity ? frameCapacity * 2 : 4096;
+		frames = (Frame *)realloc(frames, frameCapacity * sizeof(Frame));
+	}
+	frames[frameCount].ms = ms;
+	frames[frameCount].drawCalls = statsCounters[StatDrawCalls];
+	frames[frameCount].triangles = statsCounters[StatTriangles];
+	++frameCount;
+
+	for (i = 0; i < StatCount; ++i)
+		totals[i] += statsCounters[i];
+	memset(statsCounters, 0, sizeof statsCounters);
+}
+
+/* The game downloads the same palette again, it's replayed from one address like in the game */
+static void *findPalette(const void **palettes, uint32_t *count, const void *palette)
+{
+	uint32_t i;
+	for (i = 0; i < *count; ++i)
+	{
+		if (!memcmp(palettes[i], palette, 256 * sizeof(uint32_t)))
+			return (void *)palettes[i];
+	}
+	if (*count < MaxPalettes)
+		palettes[(*count)++] = palette;
+	return (void *)palette;
+}
+
+static void replay(const uint8_t *trace, uint32_t size)
+{
+	const double msPerTick = 1000.0 / SDL_GetPerformanceFrequency();
+	const void *palettes[MaxPalettes];
+	uint32_t paletteCount = 0, pos = sizeof(GlideTraceHeader);
+	uint64_t lastSwap = 0;
+	BOOL opened = false;
+
+	memset(statsCounters, 0, sizeof statsCounters);
+
+	while (size - pos >= sizeof(CommandHeader))
+	{
+		const CommandHeader *header = (const CommandHeader *)(trace + pos);
+		const TexCommand *tex = (const TexCommand *)(header + 1);
+		if (header->size < sizeof(CommandHeader) || header->size > size - pos)
+			break; // Truncated, the game was killed
+		pos += header->size;
+
+		if (header->cmd == CmdTexDownloadTable)
+			grTexDownloadTable(tex->tmu, tex->startAddress, findPalette(palettes, &paletteCount, tex + 1));
+		else
+			GlideTraceExecute(header);
+
+		switch (header->cmd)
+		{
+			case CmdSstWinOpen:
+				// Context creation isn't measured
+				opened = true;
+				memset(statsCounters, 0, sizeof statsCounters);
+				lastSwap = SDL_GetPerformanceCounter();
+				break;
+			case CmdGlideShutdown:
+				opened = false;
+				break;
+			case CmdBufferSwap:
+			{
+				const uint64_t now = SDL_GetPerformanceCounter();
+				frameEnd((now - lastSwap) * msPerTick);
+				lastSwap = now;
+				SDL_PumpEvents();
+				break;
+			}
+		}
+	}
+
+	if (opened)
+		grGlideShutdown();
+}
+
+static int compareFloat(const void *a, const void *b)
+{
+	const float x = *(const float *)a, y = *(const float *)b;
+	return (x > y) - (x < y);
+}
+
+static void report()
+{
+	float *sorted, sum = 0.0f;
+	uint32_t i, maxDrawCalls = 0;
+	uint64_t drawCalls = 0, triangles = 0;
+
+	if (frameCount == 0)
+	{
+		printf("No frames in trace\n");
+		return;
+	}
+
+	sorted = (float *)malloc(frameCount * sizeof(float));
+	for (i = 0; i < frameCount; ++i)
+	{
+		sorted[i] = frames[i].ms;
+		sum += frames[i].ms;
+		drawCalls += frames[i].drawCalls;
+		triangles += frames[i].triangles;
+		maxDrawCalls = SDL_max(maxDrawCalls, frames[i].drawCalls);
+	}
+	qsort(sorted, frameCount, sizeof(float), compareFloat);
+
+#define percentile(p) sorted[(uint32_t)((frameCount - 1) * (p) + 0.5f)]
+	printf("Frames: %u in %.3f s, %.1f frames/s\n", frameCount, sum / 1000.0f, frameCount * 1000.0f / sum);
+	printf("Frame time (ms): avg %.3f, p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n", sum / frameCount, percentile(0.5f), percentile(0.9f), percentile(0.99f), sorted[frameCount - 1]);
+	printf("Draw calls per frame: avg %.1f, max %u\n", (double)drawCalls / frameCount, maxDrawCalls);
+	printf("Triangles per frame: avg %.1f\n", (double)triangles / frameCount);
+	printf("Texture uploads: %llu (%llu bytes), palette uploads: %llu, palette expansions: %llu\n",
+		(unsigned long long)totals[StatTextureUploads], (unsigned long long)totals[StatTextureBytes],
+		(unsigned long long)totals[StatPaletteUploads], (unsigned long long)totals[StatPaletteExpansions]);
+	printf("Upload buffer waits: %llu, LFB writes: %llu\n", (unsigned long long)totals[StatUploadWaits], (unsigned long long)totals[StatLfbWrites]);
+#undef percentile
+
+	free(sorted);
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t *trace;
+	uint32_t size = 0;
+	int32_t loops = 1, i;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s trace.bin [Key=Value ...]\n", argv[0]);
+		return 1;
+	}
+	for (i = 2; i < argc; ++i)
+	{
+		if (!parseOption(argv[i], &loops))
+		{
+			fprintf(stderr, "Unknown option: %s\n", argv[i]);
+			return 1;
+		}
+	}
+#ifndef OPENGL1X
+	if (dynamicResolutionMin > 0)
+		dynamicResolutionMin = SDL_max(dynamicResolutionMin, 10);
+#endif
+
+	if (!(trace = loadTrace(argv[1], &size)))
+		return 1;
+
+	if (SDL_Init(SDL_INIT_VIDEO) < 0)
+	{
+		fprintf(stderr, "Can't initialize SDL: %s\n", SDL_GetError());
+		return 1;
+	}
+
+#ifndef OPENGL1X
+# ifdef GLES2
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_ES);
+	SDL_GL_SetAttribute(SDL_GL_RED_SIZE,   8);
+	SDL_GL_SetAttribute(SDL_GL_GREEN_SIZE, 8);
+	SDL_GL_SetAttribute(SDL_GL_BLUE_SIZE,  8);
+	SDL_GL_SetAttribute(SDL_GL_ALPHA_SIZE, 8);
+	SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
+	SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+# endif
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 2);
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 0);
+#endif
+
+	sdlWin = SDL_CreateWindow("Glide replay", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, initialWinWidth, initialWinHeight, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+	if (!sdlWin)
+	{
+		fprintf(stderr, "Can't create window: %s\n", SDL_GetError());
+		SDL_Quit();
+		return 1;
+	}
+	SDL_GetWindowSize(sdlWin, &winWidth, &winHeight);
+
+	grGlideInit();
+	for (i = 0; i < loops; ++i)
+		replay(trace, size);
+	report();
+
+	SDL_DestroyWindow(sdlWin);
+	sdlWin = NULL;
+	SDL_Quit();
+	free(frames);
+	free(trace);
+	return 0;
+}
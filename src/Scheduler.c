@@ -0,0 +1,308 @@
+// SPDX-License-Identifier: MIT
+
+#include "Scheduler.h"
+
+#include <SDL2/SDL_thread.h>
+#include <SDL2/SDL_atomic.h>
+#include <SDL2/SDL_cpuinfo.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(WIN32)
+	#include <windows.h>
+#elif defined(__linux__)
+	#include <sched.h>
+	#include <pthread.h>
+	#include <sys/resource.h>
+#endif
+
+/*
+ * Every thread of the wrapper sets its role when it starts, threads created
+ * by the game get the main role. Cores of a role are "any", "big" (all but
+ * the slowest cores), "little" (only the slowest cores) or a list like
+ * "0-3,6". Big and little cores are told apart by their maximum frequency
+ * on Linux and Android, elsewhere and on symmetric CPUs they mean any core.
+ * Realtime priority falls back to high where the system doesn't permit it.
+ * macOS has no thread affinity, only priority is applied there.
+ */
+
+#define SchedulerMaxCpus 64
+
+enum {CoresAny, CoresBig, CoresLittle, CoresList};
+enum {PriorityLow, PriorityNormal, PriorityHigh, PriorityRealtime};
+
+typedef struct
+{
+	uint32_t cores, priority;
+	uint64_t mask; // Only for "CoresList"
+} Schedule;
+
+static Schedule schedules[SchedulerRoleCount] =
+{
+	{CoresAny, PriorityNormal}, // Main
+	{CoresBig, PriorityHigh},   // Audio
+	{CoresBig, PriorityHigh},   // Timer
+	{CoresAny, PriorityNormal}, // Serial
+	{CoresAny, PriorityNormal}, // Render
+	{CoresAny, PriorityNormal}, // Network
+};
+
+/* Set by "SchedulerStart()", zero masks mean any core */
+static uint64_t allCores, bigCores, littleCores;
+static BOOL onlyFirstCPU, mainRestricted;
+
+static inline BOOL matches(const char *value, size_t len, const char *word)
+{
+	return (len == strlen(word) && !strncasecmp(value, word, len));
+}
+
+static uint64_t parseCoreList(const char *value, size_t len)
+{
+	const char *end = value + len;
+	uint64_t mask = 0;
+
+	while (value < end)
+	{
+		char *next;
+		long first = strtol(value, &next, 10), last = first;
+		if (next == value)
+			break;
+		if (*next == '-')
+		{
+			value = next + 1;
+			last = strtol(value, &next, 10);
+			if (next == value)
+				break;
+		}
+		for (; first <= last && first < SchedulerMaxCpus; ++first)
+		{
+			if (first >= 0)
+				mask |= 1ull << first;
+		}
+		value = next;
+		if (*value != ',')
+			break;
+		++value;
+	}
+
+	return mask;
+}
+
+void SchedulerConfigure(uint32_t role, const char *value)
+{
+	Schedule *schedule = &schedules[role];
+	const char *priority = strchr(value, ':');
+	const size_t len = priority ? (size_t)(priority - value) : strlen(value);
+
+	if (len == 0 || matches(value, len, "any"))
+		schedule->cores = CoresAny;
+	else if (matches(value, len, "big"))
+		schedule->cores = CoresBig;
+	else if (matches(value, len, "little"))
+		schedule->cores = CoresLittle;
+	else if ((schedule->mask = parseCoreList(value, len)))
+		schedule->cores = CoresList;
+	else
+		fprintf(stderr, "Invalid thread cores: %s\n", value);
+
+	if (!priority)
+		return;
+
+	++priority;
+	if (!strcasecmp(priority, "low"))
+		schedule->priority = PriorityLow;
+	else if (!strcasecmp(priority, "normal"))
+		schedule->priority = PriorityNormal;
+	else if (!strcasecmp(priority, "high"))
+		schedule->priority = PriorityHigh;
+	else if (!strcasecmp(priority, "realtime"))
+		schedule->priority = PriorityRealtime;
+	else
+		fprintf(stderr, "Invalid thread priority: %s\n", priority);
+}
+
+static void detectCores()
+{
+	const int32_t count = SDL_min(SDL_GetCPUCount(), SchedulerMaxCpus);
+	int32_t i;
+
+	allCores = (count >= SchedulerMaxCpus) ? ~0ull : (1ull << count) - 1;
+	bigCores = littleCores = 0;
+
+#ifdef __linux__
+	uint32_t freqs[SchedulerMaxCpus], minFreq = 0xFFFFFFFF, maxFreq = 0;
+	for (i = 0; i < count; ++i)
+	{
+		char path[80];
+		FILE *f;
+
+		freqs[i] = 0;
+		snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq", i);
+		if ((f = fopen(path, "r")))
+		{
+			if (fscanf(f, "%u", &freqs[i]) != 1)
+				freqs[i] = 0;
+			fclose(f);
+		}
+		if (freqs[i] == 0)
+			return; // Unknown core, "big" and "little" mean any core
+
+		minFreq = SDL_min(minFreq, freqs[i]);
+		maxFreq = SDL_max(maxFreq, freqs[i]);
+	}
+	if (minFreq == maxFreq)
+		return;
+
+	for (i = 0; i < count; ++i)
+	{
+		if (freqs[i] == minFreq)
+			littleCores |= 1ull << i;
+		else
+			bigCores |= 1ull << i;
+	}
+#else
+	(void)i;
+#endif
+}
+
+static uint64_t coresMask(uint32_t role)
+{
+	const Schedule *schedule = &schedules[role];
+	uint64_t mask = 0;
+
+	if (onlyFirstCPU)
+		return 1;
+
+	switch (schedule->cores)
+	{
+		case CoresBig:
+			mask = bigCores;
+			break;
+		case CoresLittle:
+			mask = littleCores;
+			break;
+		case CoresList:
+			mask = schedule->mask & allCores;
+			break;
+	}
+
+	// Threads inherit cores of the thread which created them
+	if (mask == 0 && role != SchedulerMain && mainRestricted)
+		mask = allCores;
+
+	return mask;
+}
+
+static void setAffinity(uint64_t mask)
+{
+	if (mask == 0)
+		return;
+
+#if defined(WIN32)
+	SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)mask);
+#elif defined(__linux__)
+	cpu_set_t set;
+	uint32_t i;
+	CPU_ZERO(&set);
+	for (i = 0; i < SchedulerMaxCpus; ++i)
+	{
+		if (mask & (1ull << i))
+			CPU_SET(i, &set);
+	}
+	if (sched_setaffinity(0, sizeof set, &set))
+		perror("sched_setaffinity");
+#endif
+}
+
+static BOOL setPriority(uint32_t priority)
+{
+	switch (priority)
+	{
+		case PriorityLow:
+			return !SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+		case PriorityNormal:
+			return !SDL_SetThreadPriority(SDL_THREAD_PRIORITY_NORMAL);
+		case PriorityHigh:
+			return !SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+		case PriorityRealtime:
+		{
+#ifdef __linux__
+			// Lowest realtime priority still preempts every normal thread
+			struct sched_param param;
+			memset(&param, 0, sizeof param);
+			param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+			if (!pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+				return true;
+#endif
+			if (!SDL_SetThreadPriority(SDL_THREAD_PRIORITY_TIME_CRITICAL))
+				return true;
+			return !SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+		}
+	}
+	return false;
+}
+
+/* Game threads never get realtime priority, a busy one would stall the system */
+static uint32_t gamePriority(int32_t priority)
+{
+	if (priority > 0)
+		return PriorityHigh;
+	if (priority < 0)
+		return PriorityLow;
+	return PriorityNormal;
+}
+
+void SchedulerStart(BOOL onlyOneCPU)
+{
+	onlyFirstCPU = onlyOneCPU;
+	detectCores();
+	mainRestricted = (coresMask(SchedulerMain) != 0);
+	SchedulerSetRole(SchedulerMain);
+}
+
+static void applyPriority(uint32_t priority)
+{
+	static SDL_atomic_t warned;
+
+	// Usual for unprivileged users, so only once
+	if (!setPriority(priority) && priority != PriorityNormal && SDL_AtomicCAS(&warned, 0, 1))
+		fprintf(stderr, "Can't set thread priority: %s\n", SDL_GetError());
+}
+
+void SchedulerSetRole(uint32_t role)
+{
+	setAffinity(coresMask(role));
+	applyPriority(schedules[role].priority);
+}
+
+void SchedulerSetAudioCallbackRole(uint32_t role)
+{
+	setAffinity(coresMask(role));
+	if (schedules[role].priority == PriorityRealtime)
+		applyPriority(PriorityRealtime);
+}
+
+BOOL SchedulerSetPriority(int32_t priority)
+{
+	return setPriority(gamePriority(priority));
+}
+
+#if defined(WIN32)
+void SchedulerSetThreadRole(void *thread, uint32_t role)
+{
+	static const int winPriorities[] = {THREAD_PRIORITY_LOWEST, THREAD_PRIORITY_NORMAL, THREAD_PRIORITY_HIGHEST, THREAD_PRIORITY_TIME_CRITICAL};
+	const uint64_t mask = coresMask(role);
+
+	if (mask != 0)
+		SetThreadAffinityMask(thread, (DWORD_PTR)mask);
+	if (schedules[role].priority != PriorityNormal)
+		SetThreadPriority(thread, winPriorities[schedules[role].priority]);
+}
+#elif defined(__linux__)
+BOOL SchedulerSetThreadPriority(int32_t tid, int32_t priority)
+{
+	// Same nice values as "SDL_SetThreadPriority()"
+	static const int nices[] = {19, 0, -10};
+	return !setpriority(PRIO_PROCESS, tid, nices[gamePriority(priority)]);
+}
+#endif
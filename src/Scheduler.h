@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "Wrapper.h"
+
+/* Thread roles, each has cores and priority from "Thread*" settings */
+enum
+{
+	SchedulerMain, // Also threads created by the game
+	SchedulerAudio,
+	SchedulerTimer,
+	SchedulerSerial,
+	SchedulerRender,
+	SchedulerNetwork,
+
+	SchedulerRoleCount
+};
+
+/* Parses "cores:priority" setting value of the role */
+void SchedulerConfigure(uint32_t role, const char *value);
+/* Call after settings are loaded from the main thread, applies main role to it */
+void SchedulerStart(BOOL onlyOneCPU);
+/* Applies cores and priority of the role to the calling thread */
+void SchedulerSetRole(uint32_t role);
+/* Like "SchedulerSetRole()" for SDL audio threads, their priority is only ever raised to realtime */
+void SchedulerSetAudioCallbackRole(uint32_t role);
+/* Windows "THREAD_PRIORITY_*" value for the calling thread */
+BOOL SchedulerSetPriority(int32_t priority);
+#if defined(WIN32)
+/* Applies cores and priority of the role to other thread */
+void SchedulerSetThreadRole(void *thread, uint32_t role);
+#elif defined(__linux__)
+/* Windows "THREAD_PRIORITY_*" value for other thread, "tid" is a kernel thread ID */
+BOOL SchedulerSetThreadPriority(int32_t tid, int32_t priority);
+#endif
+
+#endif // SCHEDULER_H
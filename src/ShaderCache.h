@@ -0,0 +1,18 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef SHADERCACHE_H
+#define SHADERCACHE_H
+
+#include <stdint.h>
+
+/*
+ * GLSL programs which are linked from source once and then loaded from
+ * program binaries in the settings directory, implemented by the Glide
+ * backend ("Glide2x/ShaderCache.c") for its current context.
+ */
+
+/* Returns linked program or zero on error. "name" names the cache file,
+ * "attribs" (NULL terminated, can be NULL) are bound to their index. */
+uint32_t ShaderCacheProgram(const char *name, const char *vShaderSrc, const char *fShaderSrc, const char *const *attribs);
+
+#endif // SHADERCACHE_H
@@ -0,0 +1,248 @@
+// SPDX-License-Identifier: MIT
+
+#include "Stats.h"
+
+#include <SDL2/SDL_stdinc.h>
+#include <SDL2/SDL_timer.h>
+#include <SDL2/SDL_atomic.h>
+#include <string.h>
+
+#define StatsIntervalMs 500.0
+
+uint32_t statsCounters[StatCount];
+
+static const char *const statNames[StatCount] =
+{
+	"triangles",
+	"lines",
+	"draw_calls",
+	"runs",
+	"run_break_texture",
+	"run_break_blend",
+	"run_break_clip",
+	"run_break_other",
+	"flush_swap",
+	"flush_full",
+	"flush_texture",
+	"flush_other",
+	"texture_uploads",
+	"texture_bytes",
+	"palette_uploads",
+	"palette_expansions",
+	"upload_waits",
+	"lfb_writes",
+};
+
+/* 3x5 font, 3 bits per row */
+static const uint8_t digitsFont[10][5] =
+{
+	{7, 5, 5, 5, 7}, {2, 6, 2, 2, 7}, {7, 1, 7, 4, 7}, {7, 1, 7, 1, 7}, {5, 5, 7, 1, 1},
+	{7, 4, 7, 1, 7}, {7, 4, 7, 5, 7}, {7, 1, 1, 1, 1}, {7, 5, 7, 5, 7}, {7, 5, 7, 1, 7},
+};
+static const uint8_t lettersFont[26][5] =
+{
+	{2, 5, 7, 5, 5}, {6, 5, 6, 5, 6}, {3, 4, 4, 4, 3}, {6, 5, 5, 5, 6}, {7, 4, 6, 4, 7},
+	{7, 4, 6, 4, 4}, {3, 4, 5, 5, 3}, {5, 5, 7, 5, 5}, {7, 2, 2, 2, 7}, {1, 1, 1, 5, 2},
+	{5, 5, 6, 5, 5}, {4, 4, 4, 4, 7}, {5, 7, 7, 5, 5}, {6, 5, 5, 5, 5}, {2, 5, 5, 5, 2},
+	{6, 5, 6, 4, 4}, {2, 5, 5, 6, 3}, {6, 5, 6, 5, 5}, {3, 4, 2, 1, 6}, {7, 2, 2, 2, 2},
+	{5, 5, 5, 5, 7}, {5, 5, 5, 5, 2}, {5, 5, 7, 7, 5}, {5, 5, 2, 5, 5}, {5, 5, 2, 2, 2},
+	{7, 1, 2, 4, 7},
+};
+static const uint8_t dotFont[5] = {0, 0, 0, 0, 2};
+
+static FILE *csvFile;
+static BOOL csvFailed;
+static uint32_t frameNumber;
+static uint64_t lastFrameTime, intervalStart;
+
+static uint64_t intervalCounters[StatCount], intervalFrameTicks, intervalSwapTicks;
+static uint32_t intervalFrames;
+
+static float shownFrameMs, shownSwapMs;
+static uint32_t shownCounters[StatCount];
+
+static volatile uint32_t peersActive, peerRtt[StatsMaxPeers], peerLoss[StatsMaxPeers];
+
+static SDL_atomic_t timerJitterSum, timerJitterCount, timerJitterMax;
+static uint64_t intervalJitterSum, intervalJitterCount;
+static uint32_t intervalJitterMax, shownJitterAvg, shownJitterMax;
+
+static void openCsv()
+{
+	char *path = createSettingsDirPath("", "stats.csv");
+	uint32_t i;
+
+	csvFile = fopen(path, "w");
+	if (!csvFile)
+	{
+		fprintf(stderr, "Can't create stats file: %s\n", path);
+		csvFailed = true;
+	}
+	else
+	{
+		fputs("frame,frame_ms,swap_ms", csvFile);
+		for (i = 0; i < StatCount; ++i)
+			fprintf(csvFile, ",%s", statNames[i]);
+		fputs(",net_rtt_max,net_loss_max,timer_ticks,timer_jitter_avg_us,timer_jitter_max_us\n", csvFile);
+	}
+	free(path);
+}
+
+void StatsFrameEnd(uint64_t swapTicks)
+{
+	const uint64_t now = SDL_GetPerformanceCounter();
+	const double msPerTick = 1000.0 / SDL_GetPerformanceFrequency();
+	const uint64_t frameTicks = lastFrameTime ? now - lastFrameTime : 0;
+	uint32_t i;
+
+	lastFrameTime = now;
+
+	const uint32_t jitterSum = SDL_AtomicSet(&timerJitterSum, 0);
+	const uint32_t jitterCount = SDL_AtomicSet(&timerJitterCount, 0);
+	const uint32_t jitterMax = SDL_AtomicSet(&timerJitterMax, 0);
+
+	if ((statsMode & StatsCsv) && !csvFile && !csvFailed)
+		openCsv();
+	if (csvFile)
+	{
+		fprintf(csvFile, "%u,%.3f,%.3f", frameNumber, frameTicks * msPerTick, swapTicks * msPerTick);
+		uint32_t rttMax = 0, lossMax = 0;
+		for (i = 0; i < StatCount; ++i)
+			fprintf(csvFile, ",%u", statsCounters[i]);
+		for (i = 0; i < StatsMaxPeers; ++i)
+		{
+			if (peersActive & (1 << i))
+			{
+				rttMax = SDL_max(rttMax, peerRtt[i]);
+				lossMax = SDL_max(lossMax, peerLoss[i]);
+			}
+		}
+		fprintf(csvFile, ",%u,%u,%u,%u,%u\n", rttMax, lossMax, jitterCount, jitterCount ? jitterSum / jitterCount : 0, jitterMax);
+	}
+
+	for (i = 0; i < StatCount; ++i)
+		intervalCounters[i] += statsCounters[i];
+	intervalFrameTicks += frameTicks;
+	intervalSwapTicks += swapTicks;
+	intervalJitterSum += jitterSum;
+	intervalJitterCount += jitterCount;
+	intervalJitterMax = SDL_max(intervalJitterMax, jitterMax);
+	++intervalFrames;
+
+	if (!intervalStart)
+		intervalStart = now;
+	if ((now - intervalStart) * msPerTick >= StatsIntervalMs)
+	{
+		shownFrameMs = intervalFrameTicks * msPerTick / intervalFrames;
+		shownSwapMs = intervalSwapTicks * msPerTick / intervalFrames;
+		for (i = 0; i < StatCount; ++i)
+			shownCounters[i] = intervalCounters[i] / intervalFrames;
+		shownJitterAvg = intervalJitterCount ? intervalJitterSum / intervalJitterCount : 0;
+		shownJitterMax = intervalJitterMax;
+
+		memset(intervalCounters, 0, sizeof intervalCounters);
+		intervalFrameTicks = intervalSwapTicks = 0;
+		intervalJitterSum = intervalJitterCount = 0;
+		intervalJitterMax = 0;
+		intervalFrames = 0;
+		intervalStart = now;
+	}
+
+	memset(statsCounters, 0, sizeof statsCounters);
+	++frameNumber;
+}
+
+static void drawText(const char *text, int32_t x, int32_t y, int32_t scale, StatsFillRect fillRect)
+{
+	for (; *text; ++text, x += 4 * scale)
+	{
+		const uint8_t *glyph = NULL;
+		uint32_t row, col;
+
+		if (*text >= '0' && *text <= '9')
+			glyph = digitsFont[*text - '0'];
+		else if (*text >= 'A' && *text <= 'Z')
+			glyph = lettersFont[*text - 'A'];
+		else if (*text == '.')
+			glyph = dotFont;
+		if (!glyph)
+			continue;
+
+		for (row = 0; row < 5; ++row)
+		{
+			// Merge horizontal pixels into one rectangle
+			for (col = 0; col < 3; ++col)
+			{
+				uint32_t len = 0;
+				while (col + len < 3 && (glyph[row] & (4 >> (col + len))))
+					++len;
+				if (len > 0)
+					fillRect(x + col * scale, y + row * scale, len * scale, scale, 0xFFFFFF00);
+				col += len;
+			}
+		}
+	}
+}
+
+void StatsDrawOverlay(int32_t width, int32_t height, StatsFillRect fillRect)
+{
+	const int32_t scale = SDL_max(1, height / 240), lineHeight = 7 * scale;
+	const uint32_t *c = shownCounters;
+	char lines[8 + StatsMaxPeers][64];
+	int32_t i, count = 8, maxWidth = 0;
+
+	snprintf(lines[0], sizeof lines[0], "FPS %.1f MS %.1f SWAP %.2f", shownFrameMs > 0.0f ? 1000.0f / shownFrameMs : 0.0f, shownFrameMs, shownSwapMs);
+	snprintf(lines[1], sizeof lines[1], "TRI %u LINE %u", c[StatTriangles], c[StatLines]);
+	snprintf(lines[2], sizeof lines[2], "DRAW %u RUN %u", c[StatDrawCalls], c[StatRuns]);
+	snprintf(lines[3], sizeof lines[3], "BREAK TEX %u BLEND %u CLIP %u OTHER %u", c[StatRunBreakTexture], c[StatRunBreakBlend], c[StatRunBreakClip], c[StatRunBreakOther]);
+	snprintf(lines[4], sizeof lines[4], "FLUSH SWAP %u FULL %u TEX %u OTHER %u", c[StatFlushSwap], c[StatFlushFull], c[StatFlushTexture], c[StatFlushOther]);
+	snprintf(lines[5], sizeof lines[5], "UPLOAD %u KB %u WAIT %u LFB %u", c[StatTextureUploads], c[StatTextureBytes] / 1024, c[StatUploadWaits], c[StatLfbWrites]);
+	snprintf(lines[6], sizeof lines[6], "PAL %u EXPAND %u", c[StatPaletteUploads], c[StatPaletteExpansions]);
+	snprintf(lines[7], sizeof lines[7], "TIMER JITTER US %u MAX %u", shownJitterAvg, shownJitterMax);
+	for (i = 0; i < StatsMaxPeers; ++i)
+	{
+		if (peersActive & (1 << i))
+		{
+			snprintf(lines[count], sizeof lines[count], "PEER %d RTT %u LOSS %u.%u", i, peerRtt[i], peerLoss[i] / 10, peerLoss[i] % 10);
+			++count;
+		}
+	}
+
+	for (i = 0; i < count; ++i)
+		maxWidth = SDL_max(maxWidth, (int32_t)strlen(lines[i]) * 4 * scale);
+	fillRect(0, 0, SDL_min(maxWidth + 4 * scale, width), count * lineHeight + 3 * scale, 0xFF000000);
+
+	for (i = 0; i < count; ++i)
+		drawText(lines[i], 2 * scale, 2 * scale + i * lineHeight, scale, fillRect);
+}
+
+void StatsSetPeer(uint32_t peer, BOOL active, uint32_t rttMs, uint32_t lossPermille)
+{
+	if (peer >= StatsMaxPeers)
+		return;
+	peerRtt[peer] = rttMs;
+	peerLoss[peer] = lossPermille;
+	if (active)
+		peersActive |= 1 << peer;
+	else
+		peersActive &= ~(1 << peer);
+}
+
+void StatsTimerJitter(uint32_t us)
+{
+	int32_t max;
+	SDL_AtomicAdd(&timerJitterSum, us);
+	SDL_AtomicAdd(&timerJitterCount, 1);
+	do
+		max = SDL_AtomicGet(&timerJitterMax);
+	while ((uint32_t)max < us && !SDL_AtomicCAS(&timerJitterMax, max, us));
+}
+
+void StatsShutdown(void)
+{
+	if (csvFile)
+	{
+		fclose(csvFile);
+		csvFile = NULL;
+	}
+}
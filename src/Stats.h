@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "Wrapper.h"
+
+/* Per frame counters */
+enum
+{
+	StatTriangles,
+	StatLines,
+	StatDrawCalls,
+	StatRuns,
+	StatRunBreakTexture,
+	StatRunBreakBlend,
+	StatRunBreakClip,
+	StatRunBreakOther,
+	StatFlushSwap,
+	StatFlushFull,
+	StatFlushTexture,
+	StatFlushOther,
+	StatTextureUploads,
+	StatTextureBytes,
+	StatPaletteUploads,
+	StatPaletteExpansions,
+	StatUploadWaits,
+	StatLfbWrites,
+
+	StatCount
+};
+
+enum
+{
+	StatsOverlay = 0x1,
+	StatsCsv     = 0x2
+};
+
+#define StatsMaxPeers 8
+
+typedef void (*StatsFillRect)(int32_t x, int32_t y, int32_t w, int32_t h, uint32_t color); // From top-left, ARGB color
+
+extern uint32_t statsCounters[StatCount];
+extern int32_t statsMode;
+
+static inline void StatsAdd(uint32_t stat, uint32_t value)
+{
+	statsCounters[stat] += value;
+}
+
+/* Call after every swap with the time spent in swap, resets the counters */
+void StatsFrameEnd(uint64_t swapTicks);
+/* Draws counters averaged over last half a second */
+void StatsDrawOverlay(int32_t width, int32_t height, StatsFillRect fillRect);
+/* Network peer gauges, not reset every frame, must be updated from one thread */
+void StatsSetPeer(uint32_t peer, BOOL active, uint32_t rttMs, uint32_t lossPermille);
+/* Lateness of a game timer tick, can be called from any thread */
+void StatsTimerJitter(uint32_t us);
+void StatsShutdown(void);
+
+#endif // STATS_H
@@ -1,10 +1,34 @@
 // SPDX-License-Identifier: MIT
 
 #include "Wrapper.h"
+#include "Stats.h"
+#include "Scheduler.h"
 
 #include <SDL2/SDL_timer.h>
+#include <SDL2/SDL_thread.h>
+#include <SDL2/SDL_atomic.h>
 
-static SDL_TimerID timerID;
+#ifdef WIN32
+	#include <windows.h>
+	#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+		#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x2
+	#endif
+#else
+	#include <time.h>
+	#include <errno.h>
+#endif
+
+/*
+ * Game timer thread. Deadlines are kept in performance counter ticks and
+ * advanced by the exact 16.16 millisecond period, so the rate doesn't drift
+ * and isn't rounded to whole milliseconds. The thread sleeps until
+ * "timerSpinWait" microseconds before the deadline and spins the rest.
+ */
+
+static SDL_Thread *timer_thread;
+static SDL_atomic_t timer_running;
+
+extern int32_t timerSpinWait;
 
 typedef void Event;
 STDCALL BOOL SetEvent_wrap(Event *event);
@@ -23,43 +47,79 @@ STDCALL BOOL SetEvent_wrap(Event *event);
 	extern uint32_t dword_4DB1B0, dword_5637A0;
 #endif
 
-static uint32_t timerCallback(uint32_t interval, void *param)
+static void timerTick()
 {
-	static uint32_t dword_5637A8, dword_5637C8;
-	int32_t delay;
-
-	if (dword_5637A0 == 655360)
-		delay = 1;
-	else
-	{
-		uint32_t val = (dword_5637C8 + dword_5637A0) >> 16 /*/ 61440*/;
-		dword_5637C8 = (uint16_t)(dword_5637C8 + dword_5637A0);
-		dword_5637A8 += val;
-
-		delay = dword_5637A8 - SDL_GetTicks() - 1;
-		if (delay < 1)
-		{
-			if (delay < -1000)
-				dword_5637A8 = SDL_GetTicks() + 1;
-			delay = 1;
-		}
-	}
-
 	if (dword_5637CC)
 		SetEvent_wrap(dword_5637CC);
 	if (dword_5637D8 && !dword_4DB1B0)
 		SetEvent_wrap(dword_5637D8);
 	if (dword_4DDA70)
 		SetEvent_wrap(dword_4DDA70);
+}
 
-	return delay;
+static int timerThread(void *data)
+{
+	const uint64_t freq = SDL_GetPerformanceFrequency();
+	const uint64_t spinTicks = freq * timerSpinWait / 1000000;
+	uint64_t deadline = SDL_GetPerformanceCounter(), remainder = 0;
+#ifdef WIN32
+	HANDLE waitableTimer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	if (!waitableTimer)
+		waitableTimer = CreateWaitableTimerW(NULL, false, NULL);
+#endif
+
+	SchedulerSetRole(SchedulerTimer);
+
+	while (SDL_AtomicGet(&timer_running))
+	{
+		/* Period in 16.16 milliseconds, 10.0 means as fast as possible (1 ms), never below 1 ms */
+		const uint64_t period = (dword_5637A0 == 655360) ? (1 << 16) : SDL_max(dword_5637A0, 1 << 16);
+		const uint64_t scaled = period * freq + remainder;
+		deadline += scaled / 65536000;
+		remainder = scaled % 65536000;
+
+		uint64_t now = SDL_GetPerformanceCounter();
+		if (now > deadline + freq)
+		{
+			deadline = now; // Too late (e.g. suspended), don't try to catch up
+		}
+		else if (deadline > now + spinTicks)
+		{
+			const uint64_t sleepUs = (deadline - now - spinTicks) * 1000000 / freq;
+#ifdef WIN32
+			LARGE_INTEGER dueTime;
+			dueTime.QuadPart = -(int64_t)(sleepUs * 10);
+			if (waitableTimer && SetWaitableTimer(waitableTimer, &dueTime, 0, NULL, NULL, false))
+				WaitForSingleObject(waitableTimer, INFINITE);
+			else
+				SDL_Delay(sleepUs / 1000);
+#else
+			struct timespec ts = {sleepUs / 1000000, (sleepUs % 1000000) * 1000};
+			while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+#endif
+		}
+		while ((now = SDL_GetPerformanceCounter()) < deadline);
+
+		if (statsMode)
+			StatsTimerJitter((now - deadline) * 1000000 / freq);
+		timerTick();
+	}
+
+#ifdef WIN32
+	if (waitableTimer)
+		CloseHandle(waitableTimer);
+#endif
+	return 0;
 }
 
 REALIGN void startTimer()
 {
-	timerID = SDL_AddTimer(1, timerCallback, NULL);
+	SDL_AtomicSet(&timer_running, 1);
+	timer_thread = SDL_CreateThread(timerThread, "Timer", NULL);
 }
 REALIGN void stopTimer()
 {
-	SDL_RemoveTimer(timerID);
+	SDL_AtomicSet(&timer_running, 0);
+	SDL_WaitThread(timer_thread, NULL);
+	timer_thread = NULL;
 }
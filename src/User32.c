@@ -26,6 +26,47 @@ static const uint8_t sdl_to_windows_scancode_table[100] =
 	0x50, 0x51, 0x4B, 0x4C, 0x4D, 0x47, 0x48, 0x49, 0x52, 0x53
 };
 
+/* Virtual key codes of keys without a character, indexed by scancode (keycode without "SDLK_SCANCODE_MASK") */
+static const uint8_t sdl_to_windows_vk_table[SDL_NUM_SCANCODES] =
+{
+	[SDL_SCANCODE_LSHIFT]      = 0x10,
+	[SDL_SCANCODE_RSHIFT]      = 0x10,
+	[SDL_SCANCODE_PAGEDOWN]    = 0x21,
+	[SDL_SCANCODE_PAGEUP]      = 0x22,
+	[SDL_SCANCODE_END]         = 0x23,
+	[SDL_SCANCODE_HOME]        = 0x24,
+	[SDL_SCANCODE_LEFT]        = 0x25,
+	[SDL_SCANCODE_UP]          = 0x26,
+	[SDL_SCANCODE_RIGHT]       = 0x27,
+	[SDL_SCANCODE_DOWN]        = 0x28,
+	[SDL_SCANCODE_INSERT]      = 0x2D,
+	[SDL_SCANCODE_KP_0]        = 0x60,
+	[SDL_SCANCODE_KP_1]        = 0x61,
+	[SDL_SCANCODE_KP_2]        = 0x62,
+	[SDL_SCANCODE_KP_3]        = 0x63,
+	[SDL_SCANCODE_KP_4]        = 0x64,
+	[SDL_SCANCODE_KP_5]        = 0x65,
+	[SDL_SCANCODE_KP_6]        = 0x66,
+	[SDL_SCANCODE_KP_7]        = 0x67,
+	[SDL_SCANCODE_KP_8]        = 0x68,
+	[SDL_SCANCODE_KP_9]        = 0x69,
+	[SDL_SCANCODE_KP_MULTIPLY] = 0x6A,
+	[SDL_SCANCODE_KP_PLUS]     = 0x6B,
+	[SDL_SCANCODE_KP_MINUS]    = 0x6D,
+	[SDL_SCANCODE_KP_PERIOD]   = 0x6E,
+	[SDL_SCANCODE_KP_DIVIDE]   = 0x6F,
+};
+/* Virtual key codes of character keys which differ from the character */
+static const uint8_t sdl_char_to_windows_vk_table[0x80] =
+{
+	['='] = 0xBB,
+	['-'] = 0xBD,
+	['.'] = 0xBE,
+	['`'] = 0xC0,
+	['\''] = 0xDE,
+	[SDLK_DELETE] = 0x2E,
+};
+
 extern int32_t winWidth, winHeight;
 extern uint32_t fullScreenFlag;
 extern SDL_Window *sdlWin;
@@ -110,7 +151,7 @@ REALIGN STDCALL BOOL GetMessageA_wrap(MSG *msg, void *hWnd, uint32_t wMsgFilterM
 	do
 	{
 		br = true;
-		if (SDL_WaitEventTimeout(&event, 1))
+		if (SDL_WaitEvent(&event))
 		{
 			switch (event.type)
 			{
@@ -125,11 +166,19 @@ REALIGN STDCALL BOOL GetMessageA_wrap(MSG *msg, void *hWnd, uint32_t wMsgFilterM
 					switch (event.window.event)
 					{
 						case SDL_WINDOWEVENT_RESIZED:
+						{
+							/* Only the last size of a resize burst matters */
+							SDL_Event next;
+							while (SDL_PeepEvents(&next, 1, SDL_PEEKEVENT, SDL_WINDOWEVENT, SDL_WINDOWEVENT) == 1 && next.window.event == SDL_WINDOWEVENT_RESIZED)
+							{
+								SDL_PeepEvents(&event, 1, SDL_GETEVENT, SDL_WINDOWEVENT, SDL_WINDOWEVENT);
+							}
 							winWidth  = event.window.data1 * dpr;
 							winHeight = event.window.data2 * dpr;
 							windowResized = true;
 							br = false;
 							break;
+						}
 					}
 					break;
 				case WM_DESTROY:
@@ -164,121 +213,17 @@ REALIGN STDCALL BOOL GetMessageA_wrap(MSG *msg, void *hWnd, uint32_t wMsgFilterM
 
 					msg->lParam = 1;
 
-					switch (sym)
+					if (sym == SDLK_KP_ENTER)
+						sym = SDLK_RETURN;
+					if (sym & SDLK_SCANCODE_MASK)
 					{
-						// #ifdef __ANDROID__
-						case SDL_FINGERDOWN:
-						case SDL_FINGERUP:
-						case SDL_FINGERMOTION:
-							VirtualControls_HandleFingerEvent(&event.tfinger);
-							break;
-						// case SDL_MOUSEBUTTONDOWN:
-						// case SDL_MOUSEBUTTONUP:
-						// 	VirtualControls_HandleFingerEvent(&event.button);
-						// 	break;
-						// #endif
-						case SDLK_LSHIFT:
-						case SDLK_RSHIFT:
-							msg->wParam = 0x10;
-							break;
-						case SDLK_PAGEDOWN:
-							msg->wParam = 0x21;
-							break;
-						case SDLK_PAGEUP:
-							msg->wParam = 0x22;
-							break;
-						case SDLK_END:
-							msg->wParam = 0x23;
-							break;
-						case SDLK_HOME:
-							msg->wParam = 0x24;
-							break;
-						case SDLK_LEFT:
-							msg->wParam = 0x25;
-							break;
-						case SDLK_UP:
-							msg->wParam = 0x26;
-							break;
-						case SDLK_RIGHT:
-							msg->wParam = 0x27;
-							break;
-						case SDLK_DOWN:
-							msg->wParam = 0x28;
-							break;
-						case SDLK_INSERT:
-							msg->wParam = 0x2D;
-							break;
-						case SDLK_DELETE:
-							msg->wParam = 0x2E;
-							break;
-						case SDLK_KP_0:
-							msg->wParam = 0x60;
-							break;
-						case SDLK_KP_1:
-							msg->wParam = 0x61;
-							break;
-						case SDLK_KP_2:
-							msg->wParam = 0x62;
-							break;
-						case SDLK_KP_3:
-							msg->wParam = 0x63;
-							break;
-						case SDLK_KP_4:
-							msg->wParam = 0x64;
-							break;
-						case SDLK_KP_5:
-							msg->wParam = 0x65;
-							break;
-						case SDLK_KP_6:
-							msg->wParam = 0x66;
-							break;
-						case SDLK_KP_7:
-							msg->wParam = 0x67;
-							break;
-						case SDLK_KP_8:
-							msg->wParam = 0x68;
-							break;
-						case SDLK_KP_9:
-							msg->wParam = 0x69;
-							break;
-						case SDLK_KP_MULTIPLY:
-							msg->wParam = 0x6A;
-							break;
-						case SDLK_KP_PLUS:
-							msg->wParam = 0x6B;
-							break;
-						case SDLK_KP_MINUS:
-							msg->wParam = 0x6D;
-							break;
-						case SDLK_KP_PERIOD:
-							msg->wParam = 0x6E;
-							break;
-						case SDLK_KP_DIVIDE:
-							msg->wParam = 0x6F;
-							break;
-						case SDLK_EQUALS:
-							msg->wParam = 0xBB;
-							break;
-						case SDLK_MINUS:
-							msg->wParam = 0xBD;
-							break;
-						case SDLK_PERIOD:
-							msg->wParam = 0xBE;
-							break;
-						case SDLK_BACKQUOTE:
-							msg->wParam = 0xC0;
-							break;
-						case SDLK_QUOTE:
-							msg->wParam = 0xDE;
-							break;
-						case SDLK_KP_ENTER:
-							sym = SDLK_RETURN;
-						default:
-							if (!(sym & 0x40000000))
-							{
-								isWMChar = sym >= SDLK_BACKSPACE && sym < SDLK_SPACE;
-								msg->wParam = sym;
-							}
+						if ((sym & ~SDLK_SCANCODE_MASK) < SDL_NUM_SCANCODES)
+							msg->wParam = sdl_to_windows_vk_table[sym & ~SDLK_SCANCODE_MASK];
+					}
+					else
+					{
+						isWMChar = sym >= SDLK_BACKSPACE && sym < SDLK_SPACE;
+						msg->wParam = (sym < 0x80 && sdl_char_to_windows_vk_table[sym]) ? sdl_char_to_windows_vk_table[sym] : (uint32_t)sym;
 					}
 
 					if (msg->lParam == 1 && scancode < 100)
@@ -2,13 +2,15 @@
 
 #include "Wrapper.h"
 #include "Version"
+#include "Stats.h"
+#include "Prefetch.h"
+#include "PathIndex.h"
+#include "Scheduler.h"
 #include <SDL2/SDL.h>
 #include <signal.h>
 #include <sys/stat.h>
 #ifdef WIN32
 	#include <windows.h>
-#else
-	#include <sched.h>
 #endif
 // kofred - include virtual gamepad headers
 // #ifdef __ANDROID__
@@ -43,15 +45,12 @@ void SetBrightness(float val)
 
 static char *settingsDir = NULL;
 
-#ifndef WIN32
-static
-#endif
-BOOL useOnlyOneCPU = false;
+static BOOL useOnlyOneCPU = false;
+BOOL prefetchFiles = true;
 
 #ifndef WIN32
 char *serialPort[4] = {NULL};
-SDL_mutex *event_mutex;
-SDL_cond *event_cond;
+uint32_t serialBaudRate = 9600;
 #endif
 void exit_func(void)
 {
@@ -76,6 +75,9 @@ void exit_func(void)
 	}
 	atExitProcedureCount = 0;
 
+	StatsShutdown();
+	PrefetchShutdown();
+
 #ifndef WIN32
 	for (i = 0; i < 4; ++i)
 	{
@@ -88,15 +90,10 @@ void exit_func(void)
 	while (sdlWin && i--)
 		SDL_Delay(10);
 
-#if !defined(WIN32) && 0 // Disabled, because currently causes deadlock on Linux
-	SDL_DestroyCond(event_cond);
-	event_cond = NULL;
-	SDL_DestroyMutex(event_mutex);
-	event_mutex = NULL;
-#endif
-
 	free(settingsDir);
 	settingsDir = NULL;
+
+	PathIndexFree();
 }
 
 #ifndef WIN32
@@ -105,52 +102,76 @@ void exit_func(void)
 #include <unistd.h>
 #include <fcntl.h>
 
-static char *createSettingsDirPath(const char *subdir, const char *fn)
+char *createSettingsDirPath(const char *subdir, const char *fn)
 {
-	char *pth = (char *)malloc(strlen(settingsDir) + strlen(subdir) + 1 + strlen(fn) + 1);
-	sprintf(pth, "%s%s/%s", settingsDir, subdir, fn);
+	const char *dir = settingsDir ? settingsDir : "";
+	char *pth = (char *)malloc(strlen(dir) + strlen(subdir) + 1 + strlen(fn) + 1);
+	if (*subdir)
+		sprintf(pth, "%s%s/%s", dir, subdir, fn);
+	else
+		sprintf(pth, "%s%s", dir, fn);
 	return pth;
 }
-char *convertFilePath(const char *srcPth, BOOL convToLower)
+char *convertFilePath(const char *srcPth, char dstPth[MAX_NATIVE_PATH], BOOL convToLower)
 {
-	char *tmpFileName = NULL;
+	const char *subdir = NULL, *fileName = NULL;
 	uint32_t i;
 	if (settingsDir)
 	{
 		if (!strncasecmp(srcPth, ".\\fedata\\pc\\config\\", 19))
-			tmpFileName = createSettingsDirPath("config", srcPth + 19);
+		{
+			subdir = "config";
+			fileName = srcPth + 19;
+		}
 		else if (!strncasecmp(srcPth, ".\\fedata\\pc\\save\\", 17))
-			tmpFileName = createSettingsDirPath("save", srcPth + 17);
+		{
+			subdir = "save";
+			fileName = srcPth + 17;
+		}
 		else if (!strncasecmp(srcPth, ".\\gamedata\\tmptrk\\", 18))
-			tmpFileName = createSettingsDirPath("tmptrk", srcPth + 18);
+		{
+			subdir = "tmptrk";
+			fileName = srcPth + 18;
+		}
 		else if (!strcasecmp(srcPth, "replay.rpy"))
-			tmpFileName = createSettingsDirPath("tmptrk", srcPth);
+		{
+			subdir = "tmptrk";
+			fileName = srcPth;
+		}
 		else if (!strncasecmp(srcPth, ".\\fedata\\pc\\stats\\", 18))
 		{
 			i = strlen(srcPth) - 4;
 			if (i > 0 && !strcasecmp(srcPth + i, ".stf"))
 			{
 				if (!strncasecmp(srcPth, ".\\fedata\\pc\\stats\\prh\\", 22))
-					tmpFileName = createSettingsDirPath("stats/prh", srcPth + 22);
+				{
+					subdir = "stats/prh";
+					fileName = srcPth + 22;
+				}
 				else
-					tmpFileName = createSettingsDirPath("stats", srcPth + 18);
+				{
+					subdir = "stats";
+					fileName = srcPth + 18;
+				}
 			}
 		}
 	}
-	if (!tmpFileName)
+	if (subdir)
 	{
-		tmpFileName = strdup(srcPth);
-#ifndef WIN32
-		for (i = 0; tmpFileName[i]; ++i)
-		{
-			if (tmpFileName[i] == '\\')
-				tmpFileName[i] = '/';
-			else if (convToLower)
-				tmpFileName[i] = tolower(tmpFileName[i]);
-		}
-#endif
+		snprintf(dstPth, MAX_NATIVE_PATH, "%s%s/%s", settingsDir, subdir, fileName);
+		return dstPth;
 	}
-	return tmpFileName;
+
+	snprintf(dstPth, MAX_NATIVE_PATH, "%s", srcPth);
+#ifndef WIN32
+	for (i = 0; dstPth[i]; ++i)
+		if (dstPth[i] == '\\')
+			dstPth[i] = '/';
+	if (!PathIndexResolve(dstPth, MAX_NATIVE_PATH, convToLower) && convToLower)
+		for (i = 0; dstPth[i]; ++i)
+			dstPth[i] = tolower(dstPth[i]);
+#endif
+	return dstPth;
 }
 
 static inline void mkdir_wrap(const char *path, uint32_t mode)
@@ -164,18 +185,13 @@ static inline void mkdir_wrap(const char *path, uint32_t mode)
 
 static void checkGameDirs()
 {
+	char path[MAX_NATIVE_PATH];
 	struct stat st;
 	uint32_t i;
 
-	if (stat("gamedata", &st) != 0 || !S_ISDIR(st.st_mode) || stat("fedata/pc", &st) != 0 || !S_ISDIR(st.st_mode))
+	if (stat(convertFilePath("gamedata", path, true), &st) != 0 || !S_ISDIR(st.st_mode) || stat(convertFilePath("fedata\\pc", path, true), &st) != 0 || !S_ISDIR(st.st_mode))
 	{
-		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, title,
-			"Can't find \"gamedata\" and/or \"fedata\" directories!"
-#ifndef WIN32
-			"\nMake sure that all files and directories have small letters!"
-#endif
-			, NULL
-		);
+		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, title, "Can't find \"gamedata\" and/or \"fedata\" directories!", NULL);
 		exit(-1);
 	}
 
@@ -190,7 +206,7 @@ static void checkGameDirs()
 	};
 	for (i = 0; i < sizeof(files) / sizeof(*files); ++i)
 	{
-		if (stat(files[i], &st) != 0 || !S_ISREG(st.st_mode))
+		if (stat(convertFilePath(files[i], path, true), &st) != 0 || !S_ISREG(st.st_mode))
 		{
 			char text[32];
 			snprintf(text, sizeof(text), "Missing %s file!", files[i]);
@@ -255,15 +271,22 @@ static void signal_handler(int sig)
 static BOOL startInFullScreen = true;
 
 int32_t joystickAxes[2][12] = {{0, 1, 2, 3, 4, 5, 0, 0, 0, 0, 0, 0}, {0, 1, 2, 3, 4, 5, 0, 0, 0, 0, 0, 0}};
-int32_t initialWinWidth = 640, initialWinHeight = 480, winWidth, winHeight, vSync = 1;
+int32_t initialWinWidth = 640, initialWinHeight = 480, winWidth, winHeight, vSync = 1, paletteCacheSize = 4096, statsMode = 0;
 BOOL joystickApplyDeadzone = false, joystickDisableAxesInMenu = false;
 int32_t joystickEscButton[2] = {-1, -1}, joystickResetButton[2] = {-1, -1}, joystickDPadButtons[2][4] = {{-1, -1, -1, -1}, {-1, -1, -1, -1}};
 BOOL linearSoundInterpolation = false, keepAspectRatio = true, linearFiltering = true;
+int32_t audioLatency = 50, soundResampler = -1, timerSpinWait = 0;
 uint32_t fullScreenFlag = SDL_WINDOW_FULLSCREEN_DESKTOP, broadcast = 0xFFFFFFFF;
 uint16_t PORT1 = 1030, PORT2 = 1029;
+BOOL tcpOverUdp = false;
+int32_t netJitterBuffer = 0;
 #ifndef OPENGL1X
 BOOL fixedFramebufferSize = false;
 BOOL framebufferLinearFiltering = true;
+BOOL textureAtlas = false, gpuPaletteLookup = true, textureShadowCopy = false, shaderCache = true, pixelBufferUpload = true;
+int32_t renderThreadFrames = 0;
+int32_t dynamicResolutionMin = 0, dynamicResolutionMax = 100, displaySharpening = 0;
+char *glideTrace = NULL;
 #endif
 
 static void initializeSDL2()
@@ -315,7 +338,6 @@ void WrapperInit(void)
 #endif
 	FILE *f = NULL;
 
-	SDL_JoystickEventState(SDL_IGNORE);
 	SDL_ShowCursor(false);
 
 #ifdef __ANDROID__
@@ -401,9 +423,6 @@ void WrapperInit(void)
 	}
 
 #ifndef WIN32
-	event_mutex = SDL_CreateMutex();
-	event_cond = SDL_CreateCond();
-
 	signal(SIGILL, signal_handler);
 	signal(SIGBUS, signal_handler);
 	signal(SIGFPE, signal_handler);
@@ -446,6 +465,22 @@ void WrapperInit(void)
 			line[nPos] = '\0';
 			if (!strncasecmp("UseOnlyOneCPU=", line, 14))
 				useOnlyOneCPU = !!atoi(line + 14);
+			else if (!strncasecmp("ThreadMain=", line, 11))
+				SchedulerConfigure(SchedulerMain, line + 11);
+			else if (!strncasecmp("ThreadAudio=", line, 12))
+				SchedulerConfigure(SchedulerAudio, line + 12);
+			else if (!strncasecmp("ThreadTimer=", line, 12))
+				SchedulerConfigure(SchedulerTimer, line + 12);
+			else if (!strncasecmp("ThreadSerial=", line, 13))
+				SchedulerConfigure(SchedulerSerial, line + 13);
+			else if (!strncasecmp("ThreadRender=", line, 13))
+				SchedulerConfigure(SchedulerRender, line + 13);
+			else if (!strncasecmp("ThreadNetwork=", line, 14))
+				SchedulerConfigure(SchedulerNetwork, line + 14);
+			else if (!strncasecmp("Prefetch=", line, 9))
+				prefetchFiles = !!atoi(line + 9);
+			else if (!strncasecmp("TimerSpinWait=", line, 14))
+				timerSpinWait = SDL_max(0, SDL_min(atoi(line + 14), 2000));
 			else if (!strncasecmp("StartInFullScreen=", line, 18))
 				startInFullScreen = !!atoi(line + 18);
 			else if (!strncasecmp("VSync=", line, 6))
@@ -472,12 +507,47 @@ void WrapperInit(void)
 #endif
 				}
 			}
+#ifndef OPENGL1X
+			else if (!strncasecmp("TextureAtlas=", line, 13))
+				textureAtlas = !!atoi(line + 13);
+			else if (!strncasecmp("GPUPaletteLookup=", line, 17))
+				gpuPaletteLookup = !!atoi(line + 17);
+			else if (!strncasecmp("TextureShadowCopy=", line, 18))
+				textureShadowCopy = !!atoi(line + 18);
+			else if (!strncasecmp("RenderThread=", line, 13))
+				renderThreadFrames = SDL_min(atoi(line + 13), 3);
+			else if (!strncasecmp("DynamicResolution=", line, 18))
+			{
+				dynamicResolutionMin = atoi(line + 18);
+				if (dynamicResolutionMin > 0)
+					dynamicResolutionMin = SDL_max(SDL_min(dynamicResolutionMin, 100), 10);
+				else
+					dynamicResolutionMin = 0;
+			}
+			else if (!strncasecmp("DynamicResolutionMax=", line, 21))
+				dynamicResolutionMax = SDL_max(SDL_min(atoi(line + 21), 200), 10);
+			else if (!strncasecmp("DisplaySharpening=", line, 18))
+				displaySharpening = SDL_max(SDL_min(atoi(line + 18), 100), 0);
+			else if (!strncasecmp("ShaderCache=", line, 12))
+				shaderCache = !!atoi(line + 12);
+			else if (!strncasecmp("PixelBufferUpload=", line, 18))
+				pixelBufferUpload = !!atoi(line + 18);
+			else if (!strncasecmp("GlideTrace=", line, 11))
+			{
+				free(glideTrace);
+				glideTrace = line[11] ? strdup(line + 11) : NULL;
+			}
+#endif
 			else if (!strncasecmp("WindowSize=", line, 11))
 				sscanf(line + 11, "%dx%d", &initialWinWidth, &initialWinHeight);
 			else if (!strncasecmp("KeepAspectRatio=", line, 16))
 				sscanf(line + 16, "%d", &keepAspectRatio);
 			else if (!strncasecmp("LinearTextureFiltering=", line, 23))
 				sscanf(line + 23, "%d", &linearFiltering);
+			else if (!strncasecmp("PaletteCacheSize=", line, 17))
+				sscanf(line + 17, "%d", &paletteCacheSize);
+			else if (!strncasecmp("Stats=", line, 6))
+				statsMode = atoi(line + 6) & (StatsOverlay | StatsCsv);
 			else if (!strncasecmp("JoystickApplyDeadzone=", line, 22))
 				joystickApplyDeadzone = !!atoi(line + 22);
 			else if (!strncasecmp("JoystickDisableAxesInMenu=", line, 26))
@@ -500,10 +570,18 @@ void WrapperInit(void)
 				sscanf(line + 21, "%d,%d,%d,%d", &joystickDPadButtons[1][0], &joystickDPadButtons[1][1], &joystickDPadButtons[1][2], &joystickDPadButtons[1][3]);
 			else if (!strncasecmp("LinearSoundInterpolation=", line, 25))
 				linearSoundInterpolation = !!atoi(line + 25);
+			else if (!strncasecmp("SoundResampler=", line, 15))
+				soundResampler = SDL_min(atoi(line + 15), 4);
+			else if (!strncasecmp("AudioLatency=", line, 13))
+				audioLatency = SDL_min(atoi(line + 13), 500);
 			else if (!strncasecmp("Port1=", line, 6))
 				PORT1 = atoi(line + 6);
 			else if (!strncasecmp("Port2=", line, 6))
 				PORT2 = atoi(line + 6);
+			else if (!strncasecmp("TCPOverUDP=", line, 11))
+				tcpOverUdp = !!atoi(line + 11);
+			else if (!strncasecmp("JitterBuffer=", line, 13))
+				netJitterBuffer = SDL_max(0, SDL_min(atoi(line + 13), 500));
 			else if (!strncasecmp("Bcast=", line, 6))
 			{
 				uint32_t a, b, c, d;
@@ -519,6 +597,8 @@ void WrapperInit(void)
 				serialPort[2] = strdup(line + 10);
 			else if (!strncasecmp("LinuxCOM4=", line, 10))
 				serialPort[3] = strdup(line + 10);
+			else if (!strncasecmp("SerialBaudRate=", line, 15))
+				serialBaudRate = atoi(line + 15);
 #endif
 #ifdef __ANDROID__
 			else if (!strncasecmp("AccelerometerAsJoystick=", line, 24))
@@ -560,20 +640,7 @@ void WrapperInit(void)
 	}
 #endif
 
-	if (useOnlyOneCPU)
-	{
-#if defined WIN32
-		SetThreadAffinityMask(GetCurrentThread(), 1);
-#elif !defined(linux)
-		#warning "TODO: thread affinity"
-#else
-		cpu_set_t set;
-		CPU_ZERO(&set);
-		CPU_SET(0, &set);
-		if (sched_setaffinity(0, sizeof set, &set))
-			perror("sched_setaffinity");
-#endif
-	}
+	SchedulerStart(useOnlyOneCPU);
 }
 
 #ifdef SWAP_WINDOW_AND_GL_THREAD
@@ -628,6 +695,7 @@ REALIGN STDCALL SDL_Window *WrapperCreateWindow(WindowProc windowProc)
 	uint32_t *icon, i, j;
 #endif
 
+	PathIndexBuild();
 	checkGameDirs();
 
 	int windowFlags = SDL_WINDOW_OPENGL | SDL_WINDOW_ALLOW_HIGHDPI | (startInFullScreen ? fullScreenFlag : 0);
@@ -42,6 +42,7 @@
 #endif
 
 #define MAX_PATH 260
+#define MAX_NATIVE_PATH 1024 // Size of "convertFilePath()" buffers
 
 #define BOOL int32_t
 #define false 0
@@ -49,6 +50,7 @@
 
 typedef uint32_t (STDCALL *WindowProc)(MAYBE_THIS void *hWnd, uint32_t uMsg, uint32_t wParam, uint32_t lParam);
 
-char *convertFilePath(const char *srcPth, BOOL convToLower);
+char *convertFilePath(const char *srcPth, char dstPth[MAX_NATIVE_PATH], BOOL convToLower); // Returns "dstPth"
+char *createSettingsDirPath(const char *subdir, const char *fn); // Empty "subdir" for settings dir itself
 
 #endif // WRAPPER_H
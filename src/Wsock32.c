@@ -1,16 +1,139 @@
 // SPDX-License-Identifier: MIT
 
 #include "Wsock32.h"
+#include "Stats.h"
+
+#if defined(__linux__)
+	#include <sys/epoll.h>
+	#define POLLER_EPOLL
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+	#include <sys/event.h>
+	#define POLLER_KQUEUE
+#endif
 
 extern uint16_t PORT1, PORT2;
 extern uint32_t broadcast;
 
+#include "Wsock32/UdpStream.c"
+
+#if defined(POLLER_EPOLL) || defined(POLLER_KQUEUE)
+/*
+ * Sockets passed to "select_wrap()" stay registered in epoll/kqueue between
+ * calls, only changes of the requested set are sent to the kernel.
+ */
+#define POLLER_MAX 64
+
+static int poll_fd = -1;
+static int polled_fds[POLLER_MAX];
+static uint32_t polled_count;
+
+static BOOL fdsContain(const int *fds, uint32_t count, int fd)
+{
+	uint32_t i;
+	for (i = 0; i < count; ++i)
+		if (fds[i] == fd)
+			return true;
+	return false;
+}
+
+static BOOL pollerControl(int fd, BOOL add)
+{
+#ifdef POLLER_EPOLL
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(poll_fd, add ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, fd, &ev) == 0;
+#else
+	struct kevent ev;
+	EV_SET(&ev, fd, EVFILT_READ, add ? EV_ADD : EV_DELETE, 0, 0, NULL);
+	return kevent(poll_fd, &ev, 1, NULL, 0, NULL) == 0;
+#endif
+}
+
+/* Closed socket is removed from the kernel set automatically, but its number can be reused */
+static void pollerForget(int fd)
+{
+	uint32_t i;
+	for (i = 0; i < polled_count; ++i)
+	{
+		if (polled_fds[i] == fd)
+		{
+			polled_fds[i] = polled_fds[--polled_count];
+			break;
+		}
+	}
+}
+
+/* Returns number of ready sockets, -1 on error or -2 if the poller can't be used */
+static int pollerWait(struct win_fd_set *readfds, int timeout_ms)
+{
+	const int *requested = readfds ? readfds->fd_array : NULL;
+	const uint32_t fd_count = readfds ? readfds->fd_count : 0;
+	uint32_t i;
+	int ready;
+
+	if (poll_fd < 0)
+	{
+#ifdef POLLER_EPOLL
+		poll_fd = epoll_create(POLLER_MAX);
+#else
+		poll_fd = kqueue();
+#endif
+		if (poll_fd < 0)
+			return -2;
+	}
+
+	for (i = 0; i < polled_count;)
+	{
+		if (!fdsContain(requested, fd_count, polled_fds[i]))
+		{
+			pollerControl(polled_fds[i], false);
+			polled_fds[i] = polled_fds[--polled_count];
+		}
+		else
+		{
+			++i;
+		}
+	}
+	for (i = 0; i < fd_count; ++i)
+	{
+		const int fd = requested[i];
+		if (fdsContain(polled_fds, polled_count, fd))
+			continue;
+		if (polled_count == POLLER_MAX || !pollerControl(fd, true))
+			return -2;
+		polled_fds[polled_count++] = fd;
+	}
+
+#ifdef POLLER_EPOLL
+	struct epoll_event events[POLLER_MAX];
+	ready = epoll_wait(poll_fd, events, POLLER_MAX, timeout_ms);
+	for (i = 0; (int)i < ready; ++i)
+		readfds->fd_array[i] = events[i].data.fd;
+#else
+	struct kevent events[POLLER_MAX];
+	struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000};
+	ready = kevent(poll_fd, NULL, 0, events, POLLER_MAX, &ts);
+	for (i = 0; (int)i < ready; ++i)
+		readfds->fd_array[i] = events[i].ident;
+#endif
+
+	if (readfds)
+		readfds->fd_count = (ready > 0) ? ready : 0;
+	return ready;
+}
+#endif
+
 REALIGN STDCALL uint32_t inet_addr_wrap(const char *cp)
 {
 	return inet_addr(cp);
 }
 REALIGN STDCALL int listen_wrap(int fd, int n)
 {
+	int ret;
+	if (streamListen(fd, &ret))
+		return ret;
 	return listen(fd, n);
 }
 REALIGN STDCALL char *inet_ntoa_wrap(struct in_addr in)
@@ -42,11 +165,17 @@ REALIGN STDCALL int gethostname_wrap(char *name, int namelen)
 }
 REALIGN STDCALL int connect_wrap(int sock, const struct sockaddr *name, int namelen)
 {
+	int ret;
 	((struct sockaddr_in *)name)->sin_port = htons(PORT1);
+	if (streamConnect(sock, (const struct sockaddr_in *)name, &ret))
+		return ret;
 	return connect(sock, name, namelen);
 }
 REALIGN STDCALL int accept_wrap(int sock, struct sockaddr *addr, socklen_t *addrlen)
 {
+	int ret;
+	if (streamAcceptConn(sock, addr, addrlen, &ret))
+		return ret;
 	return accept(sock, addr, addrlen);
 }
 REALIGN STDCALL int WSAFDIsSet_wrap(int fd, struct win_fd_set *w_fds)
@@ -66,25 +195,37 @@ REALIGN STDCALL int select_wrap(int nfds, struct win_fd_set *readfds, struct win
 #ifdef WIN32
 	return select(nfds, readfds, writefds, exceptfds, timeout);
 #else
-	uint32_t i, j, fd_count, max_fd = 0;
+	uint32_t i, j;
+	int fd_count, max_fd = 0;
 	fd_set fds;
 
-	struct timeval tv = {0, 10000}; /* On Linux, exiting from UDP game host hangs for long time */
+	struct timeval tv = {0, 10000}; /* Don't wait infinitely, on Linux exiting from UDP game host hangs for long time */
+	if (timeout)
+		tv = *timeout;
+
+#if defined(POLLER_EPOLL) || defined(POLLER_KQUEUE)
+	fd_count = pollerWait(readfds, tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+	if (fd_count != -2)
+		return fd_count;
+#endif
 
 	FD_ZERO(&fds);
-	for (i = 0; i < readfds->fd_count; ++i)
+	for (i = 0; readfds && i < readfds->fd_count; ++i)
 	{
 		FD_SET(readfds->fd_array[i], &fds);
 		if (readfds->fd_array[i] > max_fd)
 			max_fd = readfds->fd_array[i];
 	}
 
-	if ((fd_count = select(max_fd + 1, &fds, NULL, NULL, &tv)) > 0)
-		for (i = 0, j = 0; i < readfds->fd_count; ++i)
-			if (FD_ISSET(readfds->fd_array[i], &fds) && j != i)
+	fd_count = select(max_fd + 1, &fds, NULL, NULL, &tv);
+	if (readfds)
+	{
+		for (i = 0, j = 0; fd_count > 0 && i < readfds->fd_count; ++i)
+			if (FD_ISSET(readfds->fd_array[i], &fds))
 				readfds->fd_array[j++] = readfds->fd_array[i];
-
-	return (readfds->fd_count = fd_count);
+		readfds->fd_count = (fd_count > 0) ? fd_count : 0;
+	}
+	return fd_count;
 #endif
 }
 REALIGN STDCALL int send_wrap(int sock, const char *buf, socklen_t len, int flags)
@@ -102,6 +243,9 @@ REALIGN STDCALL int getsockname_wrap(int sock, struct sockaddr *name, socklen_t
 		memset(name, 0x00, sizeof(struct sockaddr_ipx)); /* It works */
 		return 0;
 	}
+	int ret;
+	if (streamGetSockName(sock, name, namelen, &ret))
+		return ret;
 	return getsockname(sock, name, namelen);
 }
 REALIGN STDCALL int bind_wrap(int sock, const struct sockaddr *name, int namelen)
@@ -113,6 +257,9 @@ REALIGN STDCALL int bind_wrap(int sock, const struct sockaddr *name, int namelen
 		name_in.sin_port = ((struct sockaddr_ipx *)name)->sa_socket ? htons(PORT2) : htons(PORT1);
 	else
 		name_in.sin_port = ((struct sockaddr_in *)name)->sin_port ? htons(PORT1) : 0;
+	int ret;
+	if (streamBind(sock, name_in.sin_port, &ret))
+		return ret;
 	return bind(sock, (struct sockaddr *)&name_in, sizeof name_in);
 }
 REALIGN STDCALL uint16_t htons_wrap(uint16_t hostshort)
@@ -138,6 +285,8 @@ REALIGN STDCALL int ioctlsocket_wrap(int sock, int32_t cmd, uint32_t *argp)
 }
 REALIGN STDCALL int setsockopt_wrap(int sock, int level, int optname, const char *optval, socklen_t optlen)
 {
+	if (streamIsEmulated(sock))
+		return 0; /* Options are meant for the TCP connection */
 	switch (optname)
 	{
 		case SO_DEBUG:
@@ -187,9 +336,13 @@ REALIGN STDCALL int WSAGetLastError_wrap(void)
 }
 REALIGN STDCALL int closesocket_wrap(int sock)
 {
+	streamClose(sock);
 #ifdef WIN32
 	return closesocket(sock);
 #else
+#if defined(POLLER_EPOLL) || defined(POLLER_KQUEUE)
+	pollerForget(sock);
+#endif
 	return close(sock);
 #endif
 }
@@ -204,7 +357,10 @@ REALIGN STDCALL int socket_wrap(int af, int type, int protocol)
 		type = SOCK_DGRAM;
 		protocol = IPPROTO_UDP;
 	}
-	int s = socket(af, type, protocol);
+	int s = isTCP ? streamSocket() : -1;
+	if (s >= 0)
+		return s;
+	s = socket(af, type, protocol);
 	if (s > 0)
 	{
 		BOOL opt = true;
@@ -216,6 +372,7 @@ REALIGN STDCALL int socket_wrap(int af, int type, int protocol)
 }
 REALIGN STDCALL int WSACleanup_wrap(void)
 {
+	streamStop();
 #ifdef WIN32
 	return WSACleanup();
 #else
@@ -230,55 +387,126 @@ REALIGN STDCALL int WSAStartup_wrap(uint16_t wVersionRequested, void *WSAData)
 	return 0;
 #endif
 }
+/*
+ * IPX datagrams are sent over UDP with the 2-byte IPX socket type in front of
+ * the data. Header and payload are passed as separate buffers, so nothing is
+ * allocated or copied.
+ */
+#if defined(__linux__) && !defined(__ANDROID__)
+	#define HAVE_SENDMMSG
+#endif
+
+static int sendDatagram(int sock, const uint16_t *ipxSocket, const char *buf, socklen_t len, int flags, const struct sockaddr_in *to)
+{
+#ifdef WIN32
+	WSABUF bufs[2] = {{2, (char *)ipxSocket}, {len, (char *)buf}};
+	DWORD bsent = 0;
+	if (WSASendTo(sock, bufs, 2, &bsent, flags, (const struct sockaddr *)to, sizeof *to, NULL, NULL) != 0)
+		return -1;
+	return bsent;
+#else
+	struct iovec iov[2] = {{(void *)ipxSocket, 2}, {(void *)buf, len}};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof msg);
+	msg.msg_name = (void *)to;
+	msg.msg_namelen = sizeof *to;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	return sendmsg(sock, &msg, flags);
+#endif
+}
+static int recvDatagram(int sock, uint16_t *ipxSocket, char *buf, socklen_t len, int flags, struct sockaddr_in *from)
+{
+#ifdef WIN32
+	WSABUF bufs[2] = {{2, (char *)ipxSocket}, {len, buf}};
+	DWORD brecv = 0, dwFlags = flags;
+	int fromlen = sizeof *from;
+	if (WSARecvFrom(sock, bufs, 2, &brecv, &dwFlags, (struct sockaddr *)from, &fromlen, NULL, NULL) != 0)
+		return -1;
+	return brecv;
+#else
+	struct iovec iov[2] = {{ipxSocket, 2}, {buf, len}};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof msg);
+	msg.msg_name = from;
+	msg.msg_namelen = sizeof *from;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	return recvmsg(sock, &msg, flags);
+#endif
+}
+
 REALIGN STDCALL int sendto_wrap(int sock, const char *buf, socklen_t len, int flags, const struct sockaddr_ipx *to, socklen_t tolen)
 {
-	struct sockaddr_in to_in;
-	char *data = (char *)malloc(len += 2);
+	struct sockaddr_in to_in[2];
 
-	to_in.sin_family = AF_INET;
-	to_in.sin_port = htons(PORT1);
+	memset(to_in, 0, sizeof to_in);
+	to_in[0].sin_family = AF_INET;
+	to_in[0].sin_port = htons(PORT1);
 	if (!memcmp(to->sa_nodenum, "\xFF\xFF\xFF\xFF\xFF\xFF", 6) || !memcmp(to->sa_nodenum, "\0\0\0\0\0\0", 6)) /* 0x000000000000 address is broadcast too */
-		to_in.sin_addr.s_addr = broadcast;
+		to_in[0].sin_addr.s_addr = broadcast;
 	else
-		memcpy(&to_in.sin_addr.s_addr, to->sa_nodenum, 4); /* IPX address to INET address */
+		memcpy(&to_in[0].sin_addr.s_addr, to->sa_nodenum, 4); /* IPX address to INET address */
 
-	memcpy(data, &to->sa_socket, 2); /* IPX socket type */
-	memcpy(data + 2, buf, len - 2); /* Data */
+	/* If IPX socket type is not 0 (0x452) then send it to second port too */
+	to_in[1] = to_in[0];
+	to_in[1].sin_port = htons(PORT2);
 
-	int bsent = sendto(sock, data, len, flags, (struct sockaddr *)&to_in, sizeof to_in);
-	if (bsent == len && to->sa_socket) /* If IPX socket type is not 0 (0x452) then send it to second port too */
+	int bsent = -1;
+	BOOL sent = false;
+#ifdef HAVE_SENDMMSG
+	if (to->sa_socket)
 	{
-		to_in.sin_port = htons(PORT2);
-		bsent = sendto(sock, data, len, flags, (struct sockaddr *)&to_in, sizeof to_in);
+		/* Both ports in one call */
+		struct iovec iov[2] = {{(void *)&to->sa_socket, 2}, {(void *)buf, len}};
+		struct mmsghdr msgs[2];
+		uint32_t i;
+
+		memset(msgs, 0, sizeof msgs);
+		for (i = 0; i < 2; ++i)
+		{
+			msgs[i].msg_hdr.msg_name = &to_in[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof to_in[i];
+			msgs[i].msg_hdr.msg_iov = iov;
+			msgs[i].msg_hdr.msg_iovlen = 2;
+		}
+
+		int count = sendmmsg(sock, msgs, 2, flags);
+		if (count == 2)
+			bsent = msgs[1].msg_len;
+		else if (count == 1 && msgs[0].msg_len == len + 2)
+			bsent = sendDatagram(sock, &to->sa_socket, buf, len, flags, &to_in[1]); /* Retry to get the error */
+		else if (count == 1)
+			bsent = msgs[0].msg_len;
+		sent = (count >= 0 || errno != ENOSYS);
+	}
+#endif
+	if (!sent)
+	{
+		bsent = sendDatagram(sock, &to->sa_socket, buf, len, flags, &to_in[0]);
+		if (bsent == len + 2 && to->sa_socket)
+			bsent = sendDatagram(sock, &to->sa_socket, buf, len, flags, &to_in[1]);
 	}
 
 	if (bsent >= 2)
 		bsent -= 2;
 
-	free(data);
 	return bsent;
 }
 REALIGN STDCALL int recvfrom_wrap(int sock, char *buf, socklen_t len, int flags, struct sockaddr_ipx *from, socklen_t *fromlen)
 {
 	struct sockaddr_in from_in;
-	socklen_t fromlen_in = sizeof from_in;
-	char *data = (char *)malloc(len += 2);
+	uint16_t ipxSocket;
 
-	int brecv = recvfrom(sock, data, len, flags, (struct sockaddr *)&from_in, &fromlen_in);
+	int brecv = recvDatagram(sock, &ipxSocket, buf, len, flags, &from_in);
 	if (brecv <= 2)
-	{
-		free(data);
 		return -1;
-	}
 
 	from->sa_family = 0x6; /* AF_IPX */
 	memset(from->sa_netnum, 0x00, sizeof from->sa_netnum);
 	memcpy(from->sa_nodenum, &from_in.sin_addr, 4); /* INET address to IPX address */
 	memset(from->sa_nodenum + 4, 0, 2); /* IP address is only 32-bit, zeroing leading 16-bits */
-	memcpy(&from->sa_socket, data, 2); /* IPX socket type */
+	from->sa_socket = ipxSocket; /* IPX socket type */
 
-	memcpy(buf, data + 2, brecv -= 2);
-
-	free(data);
-	return brecv;
+	return brecv - 2;
 }
@@ -0,0 +1,1072 @@
+// SPDX-License-Identifier: MIT
+
+/* Included by Wsock32.c */
+
+/*
+ * Optional transport for the TCP game mode ("TCPOverUDP=1" on every player).
+ * A stream socket is emulated with a local socket pair: the game gets one
+ * end, so send/recv/select/ioctlsocket keep working unchanged, and the
+ * network thread moves data between the other end and a UDP socket.
+ *
+ * Data is split into numbered segments, which are acknowledged cumulatively
+ * plus a 32-segment selective bitmap and retransmitted one by one after an
+ * RTT based timeout or when three later segments have arrived, so a single
+ * lost datagram doesn't wait for TCP's retransmission timer or resend the
+ * whole window. Received segments can be held back by "netJitterBuffer" ms
+ * relatively to the lowest seen delay, which smooths bursts on jittery links.
+ */
+
+#include "../Scheduler.h"
+
+#include <SDL2/SDL_thread.h>
+#include <SDL2/SDL_mutex.h>
+#include <SDL2/SDL_timer.h>
+#include <stddef.h>
+
+#ifdef WIN32
+	#define streamWouldBlock() (WSAGetLastError() == WSAEWOULDBLOCK)
+	#define streamCloseSocket(s) closesocket(s)
+	#define SHUT_WR SD_SEND
+	#define StreamSendFlags 0
+#else
+	#include <fcntl.h>
+	#define streamWouldBlock() (errno == EWOULDBLOCK || errno == EAGAIN)
+	#define streamCloseSocket(s) close(s)
+	#ifdef MSG_NOSIGNAL
+		#define StreamSendFlags MSG_NOSIGNAL
+	#else
+		#define StreamSendFlags 0
+	#endif
+#endif
+
+#define StreamMaxConns      16
+#define StreamWindow        64 // Segments, must be a power of two
+#define StreamSegmentSize   1200
+#define StreamAcceptQueue   8
+#define StreamSynInterval   250
+#define StreamSynRetries    20
+#define StreamMinRto        30
+#define StreamMaxRto        2000
+#define StreamKeepAlive     1000
+#define StreamTimeout       15000
+#define StreamStatsInterval 1000
+
+enum
+{
+	PacketSyn = 1,
+	PacketSynAck,
+	PacketData,
+	PacketAck,
+	PacketRst
+};
+#define PacketFlagFin 0x1
+
+typedef struct
+{
+	uint8_t type, flags;
+	uint16_t length;    // Payload
+	uint16_t window;    // Segments the receiver can still accept
+	uint16_t reserved;
+	uint32_t connId;
+	uint32_t seq;       // Data segment number
+	uint32_t ack;       // Next expected segment
+	uint32_t sack;      // Bit "n" means that segment "ack + 1 + n" has been received
+	uint32_t time;      // Sender time
+	uint32_t echoTime;  // Time of the last data packet received from peer
+} StreamPacket;
+
+enum
+{
+	StreamIdle,
+	StreamListening,
+	StreamConnecting,
+	StreamEstablished,
+	StreamClosed
+};
+
+typedef struct
+{
+	uint32_t sentTime, timeout;
+	uint16_t length;
+	uint8_t sent, acked, fin, retransmits;
+	uint8_t data[StreamSegmentSize];
+} StreamSendSegment;
+
+typedef struct
+{
+	uint32_t releaseTime;
+	uint16_t length, offset;
+	uint8_t received, fin;
+	uint8_t data[StreamSegmentSize];
+} StreamRecvSegment;
+
+typedef struct StreamConn
+{
+	int32_t state;
+	int gameFd, fd; // Socket pair ends, "gameFd" is -1 when the game has closed it
+	int udp;        // Listener's socket is shared with accepted connections
+	BOOL ownsUdp;
+	uint16_t bindPort;
+	struct sockaddr_in peer;
+	uint32_t connId;
+
+	SDL_sem *connectSem;
+	BOOL connectWaiting; // The game thread frees it after "connectSem" if the game has closed it meanwhile
+	uint32_t synRetries;
+
+	struct StreamConn *acceptQueue[StreamAcceptQueue];
+	uint32_t acceptCount;
+
+	uint32_t sndUna, sndNext, peerWindow;
+	BOOL gameEof; // Game has shut down sending, FIN is queued
+	StreamSendSegment snd[StreamWindow];
+	uint32_t srtt, rttvar, rto;
+	uint32_t lastSendTime, lastRecvTime;
+
+	uint32_t rcvNext, dlvNext, peerTime;
+	BOOL ackPending, peerFin;
+	StreamRecvSegment rcv[StreamWindow];
+	int32_t delayMin[2];
+	uint32_t delayWindowTime;
+
+	uint32_t statsTime, statsSent, statsRetransmits, loss;
+	int32_t statsPeer; // Compact index in "StatsMaxPeers", -1 when it has none
+} StreamConn;
+
+extern BOOL tcpOverUdp;
+extern int32_t netJitterBuffer;
+
+static StreamConn *stream_conns[StreamMaxConns];
+static SDL_mutex *stream_mutex;
+static SDL_Thread *stream_thread;
+static int stream_wake[2] = {-1, -1};
+static uint32_t stream_conn_counter;
+static uint32_t stream_stats_peers; // Used "statsPeer" indexes
+
+static inline BOOL seqBefore(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) < 0;
+}
+
+static BOOL streamSetNonBlocking(int fd)
+{
+#ifdef WIN32
+	u_long on = 1;
+	return ioctlsocket(fd, FIONBIO, &on) == 0;
+#else
+	return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0;
+#endif
+}
+
+static BOOL streamSocketPair(int fds[2])
+{
+#ifdef WIN32
+	/* No socket pairs on Windows, use a loopback connection */
+	struct sockaddr_in addr;
+	int addrlen = sizeof addr;
+	int listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	BOOL opt = true;
+
+	fds[0] = fds[1] = -1;
+	if (listener < 0)
+		return false;
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(listener, (struct sockaddr *)&addr, sizeof addr) == 0 && listen(listener, 1) == 0 && getsockname(listener, (struct sockaddr *)&addr, &addrlen) == 0)
+	{
+		fds[0] = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (fds[0] >= 0 && connect(fds[0], (struct sockaddr *)&addr, sizeof addr) == 0)
+			fds[1] = accept(listener, NULL, NULL);
+	}
+	closesocket(listener);
+	if (fds[1] < 0)
+	{
+		if (fds[0] >= 0)
+			closesocket(fds[0]);
+		return false;
+	}
+	setsockopt(fds[0], IPPROTO_TCP, TCP_NODELAY, (char *)&opt, sizeof opt);
+	setsockopt(fds[1], IPPROTO_TCP, TCP_NODELAY, (char *)&opt, sizeof opt);
+	return true;
+#else
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		return false;
+#ifdef SO_NOSIGPIPE
+	BOOL opt = true;
+	setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, (char *)&opt, sizeof opt);
+	setsockopt(fds[1], SOL_SOCKET, SO_NOSIGPIPE, (char *)&opt, sizeof opt);
+#endif
+	return true;
+#endif
+}
+
+static void streamSetError(int error)
+{
+#ifdef WIN32
+	switch (error)
+	{
+		case ECONNREFUSED:
+			WSASetLastError(WSAECONNREFUSED);
+			break;
+		case EADDRINUSE:
+			WSASetLastError(WSAEADDRINUSE);
+			break;
+		default:
+			WSASetLastError(WSAENOBUFS);
+			break;
+	}
+#else
+	errno = error;
+#endif
+}
+
+static void streamWake()
+{
+	const char c = 0;
+	send(stream_wake[1], &c, 1, StreamSendFlags);
+}
+
+/* Must be called with the mutex locked */
+static StreamConn *streamFind(int gameFd)
+{
+	uint32_t i;
+	if (gameFd < 0)
+		return NULL;
+	for (i = 0; i < StreamMaxConns; ++i)
+		if (stream_conns[i] && stream_conns[i]->gameFd == gameFd)
+			return stream_conns[i];
+	return NULL;
+}
+
+static StreamConn *streamCreate()
+{
+	uint32_t i;
+	int fds[2];
+
+	for (i = 0; i < StreamMaxConns && stream_conns[i]; ++i);
+	if (i == StreamMaxConns || !streamSocketPair(fds))
+		return NULL;
+
+	StreamConn *conn = (StreamConn *)calloc(1, sizeof(StreamConn));
+	conn->gameFd = fds[0];
+	conn->fd = fds[1];
+	conn->udp = -1;
+	conn->rto = 200;
+	conn->peerWindow = StreamWindow;
+	conn->statsPeer = -1;
+	streamSetNonBlocking(conn->fd);
+	stream_conns[i] = conn;
+	return conn;
+}
+
+static void streamFree(StreamConn *conn)
+{
+	uint32_t i;
+
+	for (i = 0; i < StreamMaxConns; ++i)
+	{
+		if (stream_conns[i] == conn)
+			stream_conns[i] = NULL;
+		else if (stream_conns[i] && stream_conns[i]->acceptQueue[0])
+		{
+			// Remove from the listener's queue of not accepted connections
+			StreamConn *listener = stream_conns[i];
+			uint32_t j;
+			for (j = 0; j < listener->acceptCount; ++j)
+			{
+				if (listener->acceptQueue[j] == conn)
+				{
+					memmove(listener->acceptQueue + j, listener->acceptQueue + j + 1, (--listener->acceptCount - j) * sizeof(StreamConn *));
+					listener->acceptQueue[listener->acceptCount] = NULL;
+					break;
+				}
+			}
+		}
+	}
+	if (conn->udp >= 0)
+	{
+		// Shared socket is closed with its last user, which also takes over receiving
+		StreamConn *user = NULL;
+		for (i = 0; i < StreamMaxConns && !user; ++i)
+			if (stream_conns[i] && stream_conns[i]->udp == conn->udp)
+				user = stream_conns[i];
+		if (!user)
+			streamCloseSocket(conn->udp);
+		else if (conn->ownsUdp)
+			user->ownsUdp = true;
+	}
+	if (conn->statsPeer >= 0)
+	{
+		StatsSetPeer(conn->statsPeer, false, 0, 0);
+		stream_stats_peers &= ~(1u << conn->statsPeer);
+	}
+	streamCloseSocket(conn->fd);
+	if (conn->connectSem)
+		SDL_DestroySemaphore(conn->connectSem);
+	free(conn);
+}
+
+static void streamSendPacket(StreamConn *conn, uint32_t type, uint32_t flags, uint32_t seq, const void *data, uint32_t length, uint32_t now)
+{
+	uint8_t buffer[sizeof(StreamPacket) + StreamSegmentSize];
+	StreamPacket *packet = (StreamPacket *)buffer;
+	uint32_t sack = 0, i;
+
+	for (i = 0; i < 32 && conn->state == StreamEstablished; ++i)
+	{
+		const uint32_t s = conn->rcvNext + 1 + i;
+		if (seqBefore(s, conn->dlvNext + StreamWindow) && conn->rcv[s & (StreamWindow - 1)].received)
+			sack |= 1u << i;
+	}
+
+	packet->type = type;
+	packet->flags = flags;
+	packet->length = htons(length);
+	packet->window = htons(StreamWindow - (conn->rcvNext - conn->dlvNext));
+	packet->reserved = 0;
+	packet->connId = htonl(conn->connId);
+	packet->seq = htonl(seq);
+	packet->ack = htonl(conn->rcvNext);
+	packet->sack = htonl(sack);
+	packet->time = htonl(now);
+	packet->echoTime = htonl(conn->peerTime);
+	if (length > 0)
+		memcpy(packet + 1, data, length);
+
+	sendto(conn->udp, (const char *)buffer, sizeof(StreamPacket) + length, 0, (struct sockaddr *)&conn->peer, sizeof conn->peer);
+	conn->lastSendTime = now;
+	conn->ackPending = false;
+}
+
+static void streamSendSegment(StreamConn *conn, uint32_t seq, uint32_t now)
+{
+	StreamSendSegment *segment = &conn->snd[seq & (StreamWindow - 1)];
+	if (segment->sent)
+	{
+		++segment->retransmits;
+		++conn->statsRetransmits;
+	}
+	++conn->statsSent;
+	segment->sent = true;
+	segment->sentTime = now;
+	segment->timeout = SDL_min(conn->rto << SDL_min(segment->retransmits, 4), StreamMaxRto);
+	streamSendPacket(conn, PacketData, segment->fin ? PacketFlagFin : 0, seq, segment->data, segment->length, now);
+}
+
+/* Closes the connection without handshake, the game sees end of stream */
+static void streamAbort(StreamConn *conn, BOOL sendRst, uint32_t now)
+{
+	if (sendRst && conn->udp >= 0)
+		streamSendPacket(conn, PacketRst, 0, 0, NULL, 0, now);
+	if (conn->connectSem && conn->state == StreamConnecting)
+		SDL_SemPost(conn->connectSem);
+	conn->state = StreamClosed;
+	if (conn->gameFd < 0 && !conn->connectWaiting)
+		streamFree(conn);
+	else
+		shutdown(conn->fd, SHUT_WR);
+}
+
+static void streamRttSample(StreamConn *conn, uint32_t rtt)
+{
+	if (conn->srtt == 0)
+	{
+		conn->srtt = rtt;
+		conn->rttvar = rtt / 2;
+	}
+	else
+	{
+		const uint32_t delta = (rtt > conn->srtt) ? rtt - conn->srtt : conn->srtt - rtt;
+		conn->rttvar = (3 * conn->rttvar + delta) / 4;
+		conn->srtt = (7 * conn->srtt + rtt) / 8;
+	}
+	conn->rto = SDL_max(StreamMinRto, SDL_min(conn->srtt + 4 * conn->rttvar, StreamMaxRto));
+}
+
+static uint32_t streamReleaseTime(StreamConn *conn, uint32_t peerTime, uint32_t now)
+{
+	if (netJitterBuffer <= 0)
+		return now;
+
+	// Lowest one-way delay (including clock offset) over the current and previous 10 s
+	const int32_t delay = now - peerTime;
+	if (conn->delayWindowTime == 0 || now - conn->delayWindowTime >= 10000)
+	{
+		conn->delayMin[1] = conn->delayWindowTime ? conn->delayMin[0] : delay;
+		conn->delayMin[0] = delay;
+		conn->delayWindowTime = now;
+	}
+	conn->delayMin[0] = SDL_min(conn->delayMin[0], delay);
+
+	const uint32_t release = peerTime + SDL_min(conn->delayMin[0], conn->delayMin[1]) + netJitterBuffer;
+	return seqBefore(release, now) ? now : release;
+}
+
+static void streamHandleAck(StreamConn *conn, const StreamPacket *packet, uint32_t now)
+{
+	const uint32_t ack = ntohl(packet->ack), sack = ntohl(packet->sack);
+	BOOL newlyAcked = false;
+	uint32_t seq, i;
+
+	conn->peerWindow = SDL_min(ntohs(packet->window), StreamWindow);
+
+	if (seqBefore(conn->sndNext, ack))
+		return; // Acknowledges data never sent
+
+	for (seq = conn->sndUna; seqBefore(seq, ack); ++seq)
+	{
+		conn->snd[seq & (StreamWindow - 1)].acked = true;
+		newlyAcked = true;
+	}
+	if (seqBefore(conn->sndUna, ack))
+		conn->sndUna = ack;
+
+	for (i = 0; i < 32; ++i)
+	{
+		seq = ack + 1 + i;
+		if (!seqBefore(seq, conn->sndNext))
+			break;
+		if ((sack & (1u << i)) && !conn->snd[seq & (StreamWindow - 1)].acked)
+		{
+			conn->snd[seq & (StreamWindow - 1)].acked = true;
+			newlyAcked = true;
+		}
+	}
+
+	if (newlyAcked && packet->echoTime)
+		streamRttSample(conn, now - ntohl(packet->echoTime));
+
+	while (seqBefore(conn->sndUna, conn->sndNext) && conn->snd[conn->sndUna & (StreamWindow - 1)].acked)
+		++conn->sndUna;
+}
+
+static void streamHandleData(StreamConn *conn, const StreamPacket *packet, const uint8_t *payload, uint32_t now)
+{
+	const uint32_t seq = ntohl(packet->seq), length = ntohs(packet->length);
+
+	conn->ackPending = true;
+	if (seqBefore(seq, conn->rcvNext) || !seqBefore(seq, conn->dlvNext + StreamWindow) || length > StreamSegmentSize)
+		return; // Duplicate or out of window, only acknowledge
+
+	StreamRecvSegment *segment = &conn->rcv[seq & (StreamWindow - 1)];
+	if (segment->received)
+		return;
+
+	conn->peerTime = ntohl(packet->time);
+	segment->received = true;
+	segment->fin = !!(packet->flags & PacketFlagFin);
+	segment->length = length;
+	segment->offset = 0;
+	segment->releaseTime = streamReleaseTime(conn, conn->peerTime, now);
+	memcpy(segment->data, payload, length);
+
+	while (conn->rcv[conn->rcvNext & (StreamWindow - 1)].received && seqBefore(conn->rcvNext, conn->dlvNext + StreamWindow))
+		++conn->rcvNext;
+}
+
+static void streamAccept(StreamConn *listener, const StreamPacket *packet, const struct sockaddr_in *from, uint32_t now)
+{
+	if (listener->acceptCount == StreamAcceptQueue)
+		return;
+
+	StreamConn *conn = streamCreate();
+	if (!conn)
+		return;
+
+	conn->state = StreamEstablished;
+	conn->udp = listener->udp;
+	conn->peer = *from;
+	conn->connId = ntohl(packet->connId);
+	conn->lastRecvTime = now;
+	conn->peerTime = ntohl(packet->time);
+	listener->acceptQueue[listener->acceptCount++] = conn;
+	streamSendPacket(conn, PacketSynAck, 0, 0, NULL, 0, now);
+
+	// Wakes up "accept_wrap()"
+	const char c = 0;
+	send(listener->fd, &c, 1, StreamSendFlags);
+}
+
+static void streamReceive(int udp, uint32_t now)
+{
+	uint8_t buffer[sizeof(StreamPacket) + StreamSegmentSize];
+	const StreamPacket *packet = (const StreamPacket *)buffer;
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	int len;
+	uint32_t i;
+
+	for (;;)
+	{
+		fromlen = sizeof from;
+		len = recvfrom(udp, (char *)buffer, sizeof buffer, 0, (struct sockaddr *)&from, &fromlen);
+		if (len < 0)
+		{
+#ifdef WIN32
+			if (WSAGetLastError() == WSAECONNRESET)
+				continue; // ICMP port unreachable from previous send
+#endif
+			break;
+		}
+		if (len < (int)sizeof(StreamPacket) || len - sizeof(StreamPacket) < ntohs(packet->length))
+			continue;
+
+		StreamConn *conn = NULL, *listener = NULL;
+		const uint32_t connId = ntohl(packet->connId);
+		for (i = 0; i < StreamMaxConns; ++i)
+		{
+			StreamConn *c = stream_conns[i];
+			if (!c || c->udp != udp)
+				continue;
+			if (c->state == StreamListening)
+				listener = c;
+			else if (c->connId == connId && c->peer.sin_addr.s_addr == from.sin_addr.s_addr && c->peer.sin_port == from.sin_port)
+				conn = c;
+		}
+
+		if (!conn)
+		{
+			if (packet->type == PacketSyn && listener)
+				streamAccept(listener, packet, &from, now);
+			else if (packet->type != PacketRst)
+			{
+				// Unknown connection
+				StreamConn tmp;
+				memset(&tmp, 0, offsetof(StreamConn, snd)); // Idle connection doesn't touch the segments
+				tmp.udp = udp;
+				tmp.peer = from;
+				tmp.connId = connId;
+				streamSendPacket(&tmp, PacketRst, 0, 0, NULL, 0, now);
+			}
+			continue;
+		}
+
+		conn->lastRecvTime = now;
+		switch (packet->type)
+		{
+			case PacketSyn:
+				if (conn->state == StreamEstablished)
+					streamSendPacket(conn, PacketSynAck, 0, 0, NULL, 0, now); // Previous one has been lost
+				break;
+			case PacketSynAck:
+				if (conn->state == StreamConnecting)
+				{
+					conn->state = StreamEstablished;
+					SDL_SemPost(conn->connectSem);
+				}
+				break;
+			case PacketData:
+				if (conn->state == StreamEstablished)
+				{
+					streamHandleAck(conn, packet, now);
+					streamHandleData(conn, packet, buffer + sizeof(StreamPacket), now);
+				}
+				break;
+			case PacketAck:
+				if (conn->state == StreamEstablished)
+					streamHandleAck(conn, packet, now);
+				break;
+			case PacketRst:
+				if (conn->state == StreamConnecting || conn->state == StreamEstablished)
+					streamAbort(conn, false, now);
+				break;
+		}
+	}
+}
+
+/* Reads data written by the game into new segments */
+static void streamReadGame(StreamConn *conn, uint32_t now)
+{
+	while (!conn->gameEof && conn->sndNext - conn->sndUna < SDL_min(conn->peerWindow, StreamWindow))
+	{
+		StreamSendSegment *segment = &conn->snd[conn->sndNext & (StreamWindow - 1)];
+		const int len = recv(conn->fd, (char *)segment->data, StreamSegmentSize, 0);
+		if (len < 0 && streamWouldBlock())
+			break;
+
+		segment->length = SDL_max(len, 0);
+		segment->fin = (len <= 0);
+		segment->sent = false;
+		segment->acked = false;
+		segment->retransmits = 0;
+		if (segment->fin)
+			conn->gameEof = true;
+		streamSendSegment(conn, conn->sndNext++, now);
+	}
+}
+
+/* Moves in-order data to the game */
+static BOOL streamDeliver(StreamConn *conn, uint32_t now, uint32_t *timer)
+{
+	while (seqBefore(conn->dlvNext, conn->rcvNext))
+	{
+		StreamRecvSegment *segment = &conn->rcv[conn->dlvNext & (StreamWindow - 1)];
+		if (seqBefore(now, segment->releaseTime))
+		{
+			*timer = SDL_min(*timer, segment->releaseTime - now);
+			break;
+		}
+		if (segment->fin)
+		{
+			conn->peerFin = true;
+			shutdown(conn->fd, SHUT_WR);
+		}
+		while (segment->offset < segment->length)
+		{
+			const int len = send(conn->fd, (const char *)segment->data + segment->offset, segment->length - segment->offset, StreamSendFlags);
+			if (len < 0 && streamWouldBlock())
+			{
+				*timer = SDL_min(*timer, 5); // Game doesn't read, try again later
+				return true;
+			}
+			if (len <= 0)
+				return false;
+			segment->offset += len;
+		}
+		segment->received = false;
+		++conn->dlvNext;
+		conn->ackPending = true; // Window update
+	}
+	return true;
+}
+
+/* Timers of the connection, returns false when it has been freed */
+static BOOL streamUpdate(StreamConn *conn, uint32_t now, uint32_t *timer)
+{
+	uint32_t seq, i;
+
+	switch (conn->state)
+	{
+		case StreamConnecting:
+			if (now - conn->lastSendTime >= StreamSynInterval)
+			{
+				if (conn->synRetries++ == StreamSynRetries)
+				{
+					const BOOL kept = (conn->gameFd >= 0 || conn->connectWaiting);
+					streamAbort(conn, false, now);
+					return kept;
+				}
+				streamSendPacket(conn, PacketSyn, 0, 0, NULL, 0, now);
+			}
+			*timer = SDL_min(*timer, StreamSynInterval);
+			return true;
+		case StreamEstablished:
+			break;
+		default:
+			return true;
+	}
+
+	if (now - conn->lastRecvTime >= StreamTimeout || !streamDeliver(conn, now, timer))
+	{
+		streamAbort(conn, true, now);
+		return false;
+	}
+
+	// Highest selectively acknowledged segment enables fast retransmit of older ones
+	uint32_t highestAcked = conn->sndUna;
+	for (seq = conn->sndUna; seqBefore(seq, conn->sndNext); ++seq)
+		if (conn->snd[seq & (StreamWindow - 1)].acked)
+			highestAcked = seq;
+
+	for (seq = conn->sndUna; seqBefore(seq, conn->sndNext); ++seq)
+	{
+		StreamSendSegment *segment = &conn->snd[seq & (StreamWindow - 1)];
+		if (segment->acked)
+			continue;
+		const uint32_t elapsed = now - segment->sentTime;
+		if (elapsed >= segment->timeout || (highestAcked - seq >= 3 && seqBefore(seq, highestAcked) && elapsed >= SDL_max(conn->srtt, 1)))
+			streamSendSegment(conn, seq, now);
+		*timer = SDL_min(*timer, segment->timeout - SDL_min(now - segment->sentTime, segment->timeout));
+	}
+
+	if (conn->ackPending || now - conn->lastSendTime >= StreamKeepAlive)
+		streamSendPacket(conn, PacketAck, 0, 0, NULL, 0, now);
+	*timer = SDL_min(*timer, StreamKeepAlive - SDL_min(now - conn->lastSendTime, StreamKeepAlive));
+
+	if (now - conn->statsTime >= StreamStatsInterval)
+	{
+		conn->loss = conn->statsSent ? conn->statsRetransmits * 1000 / conn->statsSent : 0;
+		conn->statsSent = conn->statsRetransmits = 0;
+		conn->statsTime = now;
+		for (i = 0; i < StatsMaxPeers && conn->statsPeer < 0; ++i)
+		{
+			if (!(stream_stats_peers & (1u << i)))
+			{
+				stream_stats_peers |= 1u << i;
+				conn->statsPeer = i;
+			}
+		}
+		if (conn->statsPeer >= 0)
+			StatsSetPeer(conn->statsPeer, true, conn->srtt, conn->loss);
+	}
+
+	// Both directions are finished and acknowledged
+	if (conn->gameEof && conn->sndUna == conn->sndNext && (conn->peerFin || conn->gameFd < 0))
+	{
+		conn->state = StreamClosed;
+		if (conn->gameFd < 0 && !conn->connectWaiting)
+		{
+			streamFree(conn);
+			return false;
+		}
+	}
+	return true;
+}
+
+static int streamThreadMain(void *userdata)
+{
+	SchedulerSetRole(SchedulerNetwork);
+
+	SDL_LockMutex(stream_mutex);
+	for (;;)
+	{
+		uint32_t now = SDL_GetTicks(), timer = 100, i;
+		int max_fd = stream_wake[0];
+		fd_set fds;
+
+		FD_ZERO(&fds);
+		FD_SET(stream_wake[0], &fds);
+		for (i = 0; i < StreamMaxConns; ++i)
+		{
+			StreamConn *conn = stream_conns[i];
+			if (!conn)
+				continue;
+			if (!streamUpdate(conn, now, &timer))
+				continue;
+			if (conn->udp >= 0 && conn->ownsUdp)
+			{
+				FD_SET(conn->udp, &fds);
+				max_fd = SDL_max(max_fd, conn->udp);
+			}
+			if ((conn->state == StreamEstablished && !conn->gameEof && conn->sndNext - conn->sndUna < conn->peerWindow) || conn->state == StreamListening)
+			{
+				FD_SET(conn->fd, &fds);
+				max_fd = SDL_max(max_fd, conn->fd);
+			}
+		}
+
+		struct timeval tv = {0, timer * 1000};
+		SDL_UnlockMutex(stream_mutex);
+		select(max_fd + 1, &fds, NULL, NULL, &tv);
+		SDL_LockMutex(stream_mutex);
+
+		if (FD_ISSET(stream_wake[0], &fds))
+		{
+			char buffer[64];
+			if (recv(stream_wake[0], buffer, sizeof buffer, 0) == 0)
+				break; // Shutdown
+		}
+
+		now = SDL_GetTicks();
+		for (i = 0; i < StreamMaxConns; ++i)
+		{
+			StreamConn *conn = stream_conns[i];
+			if (conn && conn->udp >= 0 && conn->ownsUdp && FD_ISSET(conn->udp, &fds))
+				streamReceive(conn->udp, now);
+		}
+		for (i = 0; i < StreamMaxConns; ++i)
+		{
+			StreamConn *conn = stream_conns[i];
+			if (!conn || !FD_ISSET(conn->fd, &fds))
+				continue;
+			if (conn->state == StreamListening)
+			{
+				char c;
+				if (recv(conn->fd, &c, 1, 0) == 0)
+				{
+					// Listening socket has been closed, drop connections which were not accepted
+					while (conn->acceptCount > 0)
+					{
+						StreamConn *pending = conn->acceptQueue[0];
+						streamCloseSocket(pending->gameFd);
+						pending->gameFd = -1;
+						streamAbort(pending, true, now);
+					}
+					streamFree(conn);
+				}
+			}
+			else if (conn->state == StreamEstablished)
+			{
+				streamReadGame(conn, now);
+			}
+		}
+	}
+	SDL_UnlockMutex(stream_mutex);
+	return 0;
+}
+
+static BOOL streamStart()
+{
+	if (stream_thread)
+		return true;
+	if (!streamSocketPair(stream_wake))
+		return false;
+	streamSetNonBlocking(stream_wake[0]);
+	if (!stream_mutex)
+		stream_mutex = SDL_CreateMutex(); // Kept by "streamStop()", a connecting thread can still use it
+	stream_thread = SDL_CreateThread(streamThreadMain, "Network", NULL);
+	if (!stream_thread)
+	{
+		fprintf(stderr, "Can't create network thread: %s\n", SDL_GetError());
+		streamCloseSocket(stream_wake[0]);
+		streamCloseSocket(stream_wake[1]);
+		stream_wake[0] = stream_wake[1] = -1;
+		return false;
+	}
+	return true;
+}
+
+/* Joins the network thread and resets the connections, the game sees end of stream on them */
+static void streamStop()
+{
+	uint32_t i, now;
+
+	if (!stream_thread)
+		return;
+
+	// Thread exits when the wake socket reaches end of stream
+	streamCloseSocket(stream_wake[1]);
+	SDL_WaitThread(stream_thread, NULL);
+	stream_thread = NULL;
+	streamCloseSocket(stream_wake[0]);
+	stream_wake[0] = stream_wake[1] = -1;
+
+	SDL_LockMutex(stream_mutex);
+	now = SDL_GetTicks();
+	for (i = 0; i < StreamMaxConns; ++i)
+	{
+		StreamConn *conn = stream_conns[i];
+		if (!conn)
+			continue;
+		if (conn->connectWaiting)
+		{
+			// The connecting thread sees the failure and frees it if the game has closed it
+			conn->state = StreamClosed;
+			SDL_SemPost(conn->connectSem);
+			stream_conns[i] = NULL;
+			continue;
+		}
+		if (conn->udp >= 0 && conn->state == StreamEstablished)
+			streamSendPacket(conn, PacketRst, 0, 0, NULL, 0, now);
+		streamFree(conn);
+	}
+	SDL_UnlockMutex(stream_mutex);
+}
+
+/* UDP socket for listening or connecting, "port" in network byte order */
+static int streamOpenUdp(uint16_t port)
+{
+	struct sockaddr_in addr;
+	BOOL opt = true;
+	int udp = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (udp < 0)
+		return -1;
+	setsockopt(udp, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof opt);
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = port;
+	if (bind(udp, (struct sockaddr *)&addr, sizeof addr) != 0 || !streamSetNonBlocking(udp))
+	{
+		streamCloseSocket(udp);
+		return -1;
+	}
+	return udp;
+}
+
+/**/
+
+/* Returns socket for the game or -1 when the transport isn't used */
+static int streamSocket()
+{
+	int fd = -1;
+	if (!tcpOverUdp || !streamStart())
+		return -1;
+	SDL_LockMutex(stream_mutex);
+	StreamConn *conn = streamCreate();
+	if (conn)
+		fd = conn->gameFd;
+	SDL_UnlockMutex(stream_mutex);
+	return fd;
+}
+
+/* The functions below return "false" if the socket isn't emulated */
+static BOOL streamBind(int sock, uint16_t port, int *ret)
+{
+	if (!stream_thread)
+		return false;
+	SDL_LockMutex(stream_mutex);
+	StreamConn *conn = streamFind(sock);
+	if (conn)
+	{
+		conn->bindPort = port;
+		*ret = 0;
+	}
+	SDL_UnlockMutex(stream_mutex);
+	return !!conn;
+}
+
+static BOOL streamListen(int sock, int *ret)
+{
+	if (!stream_thread)
+		return false;
+	SDL_LockMutex(stream_mutex);
+	StreamConn *conn = streamFind(sock);
+	if (conn)
+	{
+		*ret = 0;
+		if (conn->state == StreamIdle)
+		{
+			conn->udp = streamOpenUdp(conn->bindPort ? conn->bindPort : htons(PORT1));
+			if (conn->udp < 0)
+			{
+				streamSetError(EADDRINUSE);
+				*ret = -1;
+			}
+			else
+			{
+				conn->ownsUdp = true;
+				conn->state = StreamListening;
+				streamWake();
+			}
+		}
+	}
+	SDL_UnlockMutex(stream_mutex);
+	return !!conn;
+}
+
+static BOOL streamConnect(int sock, const struct sockaddr_in *name, int *ret)
+{
+	if (!stream_thread)
+		return false;
+	SDL_LockMutex(stream_mutex);
+	StreamConn *conn = streamFind(sock);
+	if (conn && conn->state == StreamIdle)
+	{
+		conn->udp = streamOpenUdp(0);
+		conn->ownsUdp = true;
+		conn->peer = *name;
+		conn->connId = (uint32_t)SDL_GetPerformanceCounter() * 2654435761u + ++stream_conn_counter;
+		conn->connectSem = SDL_CreateSemaphore(0);
+		conn->lastRecvTime = SDL_GetTicks();
+		conn->state = (conn->udp >= 0) ? StreamConnecting : StreamClosed;
+		conn->connectWaiting = (conn->state == StreamConnecting);
+		streamWake();
+		SDL_UnlockMutex(stream_mutex);
+
+		if (conn->connectWaiting)
+			SDL_SemWait(conn->connectSem);
+
+		SDL_LockMutex(stream_mutex);
+		conn->connectWaiting = false;
+		*ret = (conn->state == StreamEstablished) ? 0 : -1;
+		if (*ret != 0)
+			streamSetError(ECONNREFUSED);
+		if (conn->gameFd < 0 && conn->state == StreamClosed)
+			streamFree(conn); // Closed by other game thread while connecting
+	}
+	else if (conn)
+	{
+		streamSetError(ECONNREFUSED);
+		*ret = -1;
+	}
+	SDL_UnlockMutex(stream_mutex);
+	return !!conn;
+}
+
+static BOOL streamAcceptConn(int sock, struct sockaddr *addr, socklen_t *addrlen, int *ret)
+{
+	if (!stream_thread)
+		return false;
+	SDL_LockMutex(stream_mutex);
+	StreamConn *listener = streamFind(sock);
+	SDL_UnlockMutex(stream_mutex);
+	if (!listener)
+		return false;
+
+	// One byte per pending connection, blocks unless the socket is non-blocking
+	char c;
+	if (recv(sock, &c, 1, 0) != 1)
+	{
+		*ret = -1;
+		return true;
+	}
+
+	SDL_LockMutex(stream_mutex);
+	listener = streamFind(sock);
+	*ret = -1;
+	if (listener && listener->acceptCount > 0)
+	{
+		StreamConn *conn = listener->acceptQueue[0];
+		memmove(listener->acceptQueue, listener->acceptQueue + 1, --listener->acceptCount * sizeof(StreamConn *));
+		listener->acceptQueue[listener->acceptCount] = NULL;
+		if (addr && addrlen && *addrlen >= (socklen_t)sizeof(struct sockaddr_in))
+		{
+			memcpy(addr, &conn->peer, sizeof conn->peer);
+			*addrlen = sizeof conn->peer;
+		}
+		*ret = conn->gameFd;
+	}
+	SDL_UnlockMutex(stream_mutex);
+	return true;
+}
+
+static BOOL streamGetSockName(int sock, struct sockaddr *name, socklen_t *namelen, int *ret)
+{
+	if (!stream_thread)
+		return false;
+	SDL_LockMutex(stream_mutex);
+	StreamConn *conn = streamFind(sock);
+	if (conn)
+	{
+		if (conn->udp >= 0)
+		{
+			*ret = getsockname(conn->udp, name, namelen);
+		}
+		else if (*namelen >= (socklen_t)sizeof(struct sockaddr_in))
+		{
+			struct sockaddr_in addr;
+			memset(&addr, 0, sizeof addr);
+			addr.sin_family = AF_INET;
+			addr.sin_port = conn->bindPort;
+			memcpy(name, &addr, sizeof addr);
+			*namelen = sizeof addr;
+			*ret = 0;
+		}
+		else
+		{
+			*ret = -1;
+		}
+	}
+	SDL_UnlockMutex(stream_mutex);
+	return !!conn;
+}
+
+static BOOL streamIsEmulated(int sock)
+{
+	if (!stream_thread)
+		return false;
+	SDL_LockMutex(stream_mutex);
+	const BOOL emulated = !!streamFind(sock);
+	SDL_UnlockMutex(stream_mutex);
+	return emulated;
+}
+
+/* Detaches the game end before it's closed, the connection finishes in background */
+static void streamClose(int sock)
+{
+	if (!stream_thread)
+		return;
+	SDL_LockMutex(stream_mutex);
+	StreamConn *conn = streamFind(sock);
+	if (conn)
+	{
+		conn->gameFd = -1;
+		if ((conn->state == StreamIdle || conn->state == StreamClosed) && !conn->connectWaiting)
+			streamFree(conn);
+		else
+			streamWake();
+	}
+	SDL_UnlockMutex(stream_mutex);
+}
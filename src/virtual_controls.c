@@ -1,10 +1,13 @@
 // virtual_controls.c
 // Simple virtual on-screen buttons: draws colored rects and synthesizes keydowns/up.
 #include "virtual_controls.h"
+#include "GLState.h"
+#include "ShaderCache.h"
 #include <SDL2/SDL.h>
-#ifdef __ANDROID__
-#include <GLES/gl2.h> // optional if available; we use GL immediate mode if present
+#ifdef GLES2
+#include <SDL2/SDL_opengles2.h>
 #else
+#define GL_GLEXT_PROTOTYPES
 #include <GL/gl.h>
 #endif
 #include <string.h>
@@ -13,6 +16,7 @@
 
 #define MAX_BUTTONS 16
 
+#ifndef OPENGL1X
 // Update code for shader-based gampad button overlay draw
 // Simple vertex + fragment shaders for colored rectangles
 static const char *vc_vs_src =
@@ -35,7 +39,13 @@ static GLuint vc_prog = 0;
 static GLint vc_loc_pos = -1;
 static GLint vc_loc_col = -1;
 static GLuint vc_vbo = 0;
+// The vertex buffer is rebuilt only on resize, a pressed state change rewrites one button
+typedef struct { float x, y; float r, g, b, a; } VC_Vertex;
+static int vc_uploaded_count = 0;
+static int vc_uploaded_pressed[MAX_BUTTONS];
 // Segment end - shader-based code
+#endif
+static int vc_geometry_dirty = 1;
 
 static VC_Button buttons[MAX_BUTTONS];
 static int button_count = 0;
@@ -66,6 +76,7 @@ int VirtualControls_Init(int win_w, int win_h) {
 void VirtualControls_OnWindowResized(int new_w, int new_h) {
     window_w = new_w;
     window_h = new_h;
+    vc_geometry_dirty = 1;
 }
 
 static int point_in_button(const VC_Button *b, float px_norm, float py_norm) {
@@ -160,6 +171,7 @@ void VirtualControls_HandleMouseEvent(const SDL_MouseButtonEvent *mb) {
     }
 }
 
+#ifdef OPENGL1X
 // Simple immediate-mode GL draw of rectangle (normalized coords to window pixels)
 static void draw_filled_rect_pixels(int x, int y, int w, int h) {
     // Use glBegin if available. This is simple and likely to work in a compatibility profile.
@@ -171,115 +183,89 @@ static void draw_filled_rect_pixels(int x, int y, int w, int h) {
         glVertex2f((float)x, (float)(y + h));
     glEnd();
 }
+#endif
 
+#ifndef OPENGL1X
 // Shader-based gamepad code
 static void vc_create_shader(void) {
-    GLint ok;
-    GLuint vs = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vs, 1, &vc_vs_src, NULL);
-    glCompileShader(vs);
-    glGetShaderiv(vs, GL_COMPILE_STATUS, &ok);
-    if (!ok) {
-        char buf[256]; glGetShaderInfoLog(vs, sizeof(buf), NULL, buf);
-        SDL_Log("VC vertex shader error: %s", buf);
-    }
-
-    GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fs, 1, &vc_fs_src, NULL);
-    glCompileShader(fs);
-    glGetShaderiv(fs, GL_COMPILE_STATUS, &ok);
-    if (!ok) {
-        char buf[256]; glGetShaderInfoLog(fs, sizeof(buf), NULL, buf);
-        SDL_Log("VC fragment shader error: %s", buf);
-    }
-
-    vc_prog = glCreateProgram();
-    glAttachShader(vc_prog, vs);
-    glAttachShader(vc_prog, fs);
-    glBindAttribLocation(vc_prog, 0, "aPos");
-    glBindAttribLocation(vc_prog, 1, "aColor");
-    glLinkProgram(vc_prog);
-    glGetProgramiv(vc_prog, GL_LINK_STATUS, &ok);
-    if (!ok) {
-        char buf[256]; glGetProgramInfoLog(vc_prog, sizeof(buf), NULL, buf);
-        SDL_Log("VC link error: %s", buf);
+    // Attribute locations are bound before linking, the binary keeps them
+    static const char *const attribs[] = { "aPos", "aColor", NULL };
+    vc_prog = ShaderCacheProgram("controls", vc_vs_src, vc_fs_src, attribs);
+    if (!vc_prog) {
+        SDL_Log("VC shader program error");
+        return;
     }
-    glDeleteShader(vs);
-    glDeleteShader(fs);
 
     vc_loc_pos = 0;
     vc_loc_col = 1;
     glGenBuffers(1, &vc_vbo);
 }
 
+// Writes the 6 vertices (2 triangles) of a button in normalized device coords (-1..1)
+static void vc_button_vertices(const VC_Button *b, int pressed, VC_Vertex *v) {
+    int px = (int)(b->x * window_w);
+    int py = (int)(b->y * window_h);
+    int pw = (int)(b->w * window_w);
+    int ph = (int)(b->h * window_h);
+
+    float x1 =  2.0f * (float)px / window_w - 1.0f;
+    float y1 =  1.0f - 2.0f * (float)py / window_h;
+    float x2 =  2.0f * (float)(px + pw) / window_w - 1.0f;
+    float y2 =  1.0f - 2.0f * (float)(py + ph) / window_h;
+
+    float r,g,b_,a;
+    if (pressed) { r=0.2f; g=0.6f; b_=0.2f; a=0.7f; }
+    else         { r=0.1f; g=0.1f; b_=0.1f; a=0.4f; }
+
+    v[0] = (VC_Vertex){x1,y1,r,g,b_,a};
+    v[1] = (VC_Vertex){x2,y1,r,g,b_,a};
+    v[2] = (VC_Vertex){x2,y2,r,g,b_,a};
+    v[3] = (VC_Vertex){x1,y1,r,g,b_,a};
+    v[4] = (VC_Vertex){x2,y2,r,g,b_,a};
+    v[5] = (VC_Vertex){x1,y2,r,g,b_,a};
+}
+
+// Call in the display pass with depth test disabled (as "useGameProgram(false)" leaves it), GL state goes through "GLState"
 void VirtualControls_Draw(void) {
     if (button_count == 0) return;
     if (!vc_prog) vc_create_shader();
+    if (!vc_prog) return;
 
-    // Convert screen coords to normalized device coords (-1..1)
-    typedef struct { float x, y; float r, g, b, a; } Vertex;
-    Vertex verts[6 * MAX_BUTTONS];
-    int vcount = 0;
+    GLStateBindArrayBuffer(vc_vbo);
 
-    for (int i = 0; i < button_count; ++i) {
-        VC_Button *b = &buttons[i];
-        int px = (int)(b->x * window_w);
-        int py = (int)(b->y * window_h);
-        int pw = (int)(b->w * window_w);
-        int ph = (int)(b->h * window_h);
-
-        float x1 =  2.0f * (float)px / window_w - 1.0f;
-        float y1 =  1.0f - 2.0f * (float)py / window_h;
-        float x2 =  2.0f * (float)(px + pw) / window_w - 1.0f;
-        float y2 =  1.0f - 2.0f * (float)(py + ph) / window_h;
-
-        float r,g,b_,a;
-        if (b->pressed) { r=0.2f; g=0.6f; b_=0.2f; a=0.7f; }
-        else            { r=0.1f; g=0.1f; b_=0.1f; a=0.4f; }
-
-        verts[vcount++] = (Vertex){x1,y1,r,g,b_,a};
-        verts[vcount++] = (Vertex){x2,y1,r,g,b_,a};
-        verts[vcount++] = (Vertex){x2,y2,r,g,b_,a};
-        verts[vcount++] = (Vertex){x1,y1,r,g,b_,a};
-        verts[vcount++] = (Vertex){x2,y2,r,g,b_,a};
-        verts[vcount++] = (Vertex){x1,y2,r,g,b_,a};
+    if (vc_geometry_dirty || vc_uploaded_count != button_count) {
+        VC_Vertex verts[6 * MAX_BUTTONS];
+        for (int i = 0; i < button_count; ++i) {
+            vc_uploaded_pressed[i] = buttons[i].pressed;
+            vc_button_vertices(&buttons[i], vc_uploaded_pressed[i], &verts[6 * i]);
+        }
+        glBufferData(GL_ARRAY_BUFFER, 6 * button_count * sizeof(VC_Vertex), verts, GL_STATIC_DRAW);
+        vc_uploaded_count = button_count;
+        vc_geometry_dirty = 0;
+    } else {
+        for (int i = 0; i < button_count; ++i) {
+            if (vc_uploaded_pressed[i] != buttons[i].pressed) {
+                VC_Vertex verts[6];
+                vc_uploaded_pressed[i] = buttons[i].pressed;
+                vc_button_vertices(&buttons[i], vc_uploaded_pressed[i], verts);
+                glBufferSubData(GL_ARRAY_BUFFER, 6 * i * sizeof(VC_Vertex), sizeof verts, verts);
+            }
+        }
     }
 
-     // Save previous GL state (minimal manual save)
-    GLboolean depthTestEnabled = glIsEnabled(GL_DEPTH_TEST);
-    GLboolean blendEnabled = glIsEnabled(GL_BLEND);
+    GLStateEnable(GL_BLEND, 1);
+    GLStateBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-    glDisable(GL_DEPTH_TEST);
-    glDepthMask(GL_FALSE);                    // disable depth writes
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-    glUseProgram(vc_prog);
-    glBindBuffer(GL_ARRAY_BUFFER, vc_vbo);
-    glBufferData(GL_ARRAY_BUFFER, vcount * sizeof(Vertex), verts, GL_DYNAMIC_DRAW);
-    glEnableVertexAttribArray(vc_loc_pos);
-    glEnableVertexAttribArray(vc_loc_col);
-    glVertexAttribPointer(vc_loc_pos, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
-    glVertexAttribPointer(vc_loc_col, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(sizeof(float)*2));
-
-    // glEnable(GL_BLEND);
-    // glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-    glDrawArrays(GL_TRIANGLES, 0, vcount);
-
-    glDisableVertexAttribArray(vc_loc_pos);
-    glDisableVertexAttribArray(vc_loc_col);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glUseProgram(0);
-
-    // restore state
-    if (!blendEnabled) glDisable(GL_BLEND);
-    if (depthTestEnabled) glEnable(GL_DEPTH_TEST);
-    glDepthMask(GL_TRUE);
+    GLStateUseProgram(vc_prog);
+    GLStateEnableAttribs((1u << vc_loc_pos) | (1u << vc_loc_col));
+    glVertexAttribPointer(vc_loc_pos, 2, GL_FLOAT, GL_FALSE, sizeof(VC_Vertex), (void*)0);
+    glVertexAttribPointer(vc_loc_col, 4, GL_FLOAT, GL_FALSE, sizeof(VC_Vertex), (void*)(sizeof(float)*2));
+
+    glDrawArrays(GL_TRIANGLES, 0, 6 * button_count);
 }
 
 // End shader-based code segment
-#ifdef OPENGL1X
+#else
 void VirtualControls_Draw_GL1(void) {
     if (button_count == 0) return;
     // Save state and set up 2D ortho
@@ -333,12 +319,17 @@ void VirtualControls_Draw_GL1(void) {
 void VirtualControls_Shutdown(void) {
     // nothing for now
     // Start shader-based code
+#ifndef OPENGL1X
     if (vc_vbo) {
+        GLStateBindArrayBuffer(0);
         glDeleteBuffers(1, &vc_vbo);
         vc_vbo = 0;
+        vc_geometry_dirty = 1;
     }
     if (vc_prog) {
+        GLStateUseProgram(0);
         glDeleteProgram(vc_prog);
         vc_prog = 0;
     }
+#endif
 }
@@ -19,10 +19,11 @@ int VirtualControls_Init(int win_w, int win_h); // call once after sdlWin create
 void VirtualControls_OnWindowResized(int new_w, int new_h);
 void VirtualControls_HandleFingerEvent(const SDL_TouchFingerEvent *tf); // finger down/up/motion
 void VirtualControls_HandleMouseEvent(const SDL_MouseButtonEvent *mb); // fallback if touch->mouse
+#ifndef OPENGL1X
 void VirtualControls_Draw(void); // call before SDL_GL_SwapWindow()
-#ifdef OPENGL1X
+#else
 void VirtualControls_Draw_GL1(void); // call before SDL_GL_SwapWindow()
 #endif
-void VirtualControls_Shutdown(void);
+void VirtualControls_Shutdown(void); // releases GL objects, call before the GL context is destroyed
 
 #endif // VIRTUAL_CONTROLS_H